@@ -0,0 +1,140 @@
+#include "affinity.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+
+namespace {
+    // Reads a cpulist file, format: "0-3,8-11".
+    std::vector<int> readCpuList(const std::string& path) {
+        std::vector<int> cpus;
+        std::ifstream file(path);
+        std::string range;
+        while (std::getline(file, range, ',')) {
+            std::istringstream sstr(range);
+            int first = -1;
+            int last = -1;
+            char dash = 0;
+            sstr >> first;
+            if (sstr >> dash >> last) {
+                for (int cpu = first; cpu <= last; ++cpu) {
+                    cpus.push_back(cpu);
+                }
+            }
+            else if (first >= 0) {
+                cpus.push_back(first);
+            }
+        }
+        return cpus;
+    }
+}
+#endif
+
+ThreadAffinity::ThreadAffinity(int cpu) : _is_pinned(false) {
+    if (cpu < 0) {
+        return;
+    }
+#ifdef _WIN32
+    GROUP_AFFINITY affinity = {};
+    GROUP_AFFINITY previous = {};
+    affinity.Group = static_cast<WORD>(cpu / 64);
+    affinity.Mask = static_cast<KAFFINITY>(1) << (cpu % 64);
+    if (SetThreadGroupAffinity(GetCurrentThread(), &affinity, &previous)) {
+        _prev_group = previous.Group;
+        _prev_mask = previous.Mask;
+        _is_pinned = true;
+    }
+#elif defined(__linux__)
+    cpu_set_t previous;
+    CPU_ZERO(&previous);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) != 0) {
+        return;
+    }
+    cpu_set_t affinity;
+    CPU_ZERO(&affinity);
+    CPU_SET(cpu, &affinity);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(affinity), &affinity) == 0) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&previous);
+        _prev_mask.assign(bytes, bytes + sizeof(previous));
+        _is_pinned = true;
+    }
+#endif
+}
+
+ThreadAffinity::~ThreadAffinity() {
+    if (!_is_pinned) {
+        return;
+    }
+#ifdef _WIN32
+    GROUP_AFFINITY previous = {};
+    previous.Group = _prev_group;
+    previous.Mask = static_cast<KAFFINITY>(_prev_mask);
+    SetThreadGroupAffinity(GetCurrentThread(), &previous, nullptr);
+#elif defined(__linux__)
+    cpu_set_t previous;
+    std::copy(_prev_mask.begin(), _prev_mask.end(), reinterpret_cast<unsigned char*>(&previous));
+    pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+#endif
+}
+
+std::vector<int> ThreadAffinity::nodeCpus(int node) {
+    std::vector<int> cpus;
+    if (node < 0) {
+        return cpus;
+    }
+#ifdef _WIN32
+    GROUP_AFFINITY affinity = {};
+    if (GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity)) {
+        for (int bit = 0; bit < 64; ++bit) {
+            if (affinity.Mask & (static_cast<KAFFINITY>(1) << bit)) {
+                cpus.push_back(affinity.Group * 64 + bit);
+            }
+        }
+    }
+#else
+    cpus = readCpuList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+#endif
+    return cpus;
+}
+
+std::vector<int> ThreadAffinity::isolatedCpus() {
+#ifdef __linux__
+    return readCpuList("/sys/devices/system/cpu/isolated");
+#else
+    return std::vector<int>();
+#endif
+}
+
+int ThreadAffinity::Select(const TransferConfig& config, size_t role) {
+    if (!config.pin_threads) {
+        return -1;
+    }
+    std::vector<int> cpus = config.cpus;
+    if (cpus.empty() && config.busy_poll_us > 0) {
+        // Spinning threads go to cores the scheduler keeps free of other tasks.
+        cpus = isolatedCpus();
+        std::vector<int> node = nodeCpus(config.numa_node);
+        if (!node.empty()) {
+            cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&node](int cpu) {
+                return std::find(node.begin(), node.end(), cpu) == node.end();
+            }), cpus.end());
+        }
+    }
+    if (cpus.empty()) {
+        cpus = nodeCpus(config.numa_node);
+    }
+    if (cpus.empty()) {
+        return -1;
+    }
+    return cpus[role % cpus.size()];
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "config.h"
+
+#include <stddef.h>
+#include <vector>
+
+/**
+ * @brief Pins the calling thread to a CPU for the lifetime of the object.
+ *
+ * The previous affinity of the thread is restored on destruction.
+ */
+class ThreadAffinity {
+public:
+    /**
+     * @brief Pins the calling thread.
+     *
+     * @param cpu CPU index, -1 to leave the affinity unchanged.
+     */
+    explicit ThreadAffinity(int cpu);
+    ~ThreadAffinity();
+
+    ThreadAffinity(const ThreadAffinity&) = delete;
+    ThreadAffinity& operator=(const ThreadAffinity&) = delete;
+
+    /**
+     * @brief Checks whether the thread was pinned.
+     *
+     * @return true if pinned, false otherwise.
+     */
+    bool isPinned() const { return _is_pinned; }
+
+    /**
+     * @brief Returns the CPUs of a NUMA node.
+     *
+     * @param node NUMA node index.
+     * @return std::vector<int> CPU indices, empty if unknown.
+     */
+    static std::vector<int> nodeCpus(int node);
+
+    /**
+     * @brief Returns the CPUs isolated from the scheduler (isolcpus), Linux only.
+     *
+     * @return std::vector<int> CPU indices, empty if none.
+     */
+    static std::vector<int> isolatedCpus();
+
+    /**
+     * @brief Selects the CPU for a thread of a transfer.
+     *
+     * Threads of a transfer get distinct CPUs from config.cpus, or from the
+     * CPUs of config.numa_node if the list is empty. With busy_poll_us the
+     * isolated CPUs of the node are preferred to the others.
+     *
+     * @param config Transfer configuration.
+     * @param role Index of the thread within the transfer (0 is the socket thread).
+     * @return int CPU index, -1 if pinning is disabled or no CPU is known.
+     */
+    static int Select(const TransferConfig& config, size_t role);
+
+private:
+    bool _is_pinned;
+#ifdef _WIN32
+    unsigned short _prev_group;
+    unsigned long long _prev_mask;
+#else
+    std::vector<unsigned char> _prev_mask;
+#endif
+};
@@ -1,16 +1,38 @@
 #pragma once
 
 #include <string>
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <deque>
 #include <algorithm>
+#include <memory>
+#include <cstring>
+#include <vector>
+
+#include "memory.h"
+#include "spin.h"
+#include "trace.h"
 
 /**
  * @brief Thread-safe buffer class template.
  *
+ * The capacity defaults to Size and can be changed at runtime with setCapacity().
+ *
+ * By default every Push()/Pop() wakes a waiting thread. With watermarks set
+ * (setWatermarks()) wakeups are batched with hysteresis: consumers waiting in
+ * waitForNotEmpty() are woken when the high watermark is reached or on
+ * Flush(), then drain the buffer; producers waiting in waitForNotFull() are
+ * woken when the buffer drains to the low watermark, then fill it up.
+ *
+ * With a spin time set (setSpinTime()) consumers poll in waitForNotEmpty()
+ * before they sleep, for low latency at the cost of a busy core.
+ *
+ * Pushes, pops and waits are recorded as spans of traced threads (see Tracer).
+ *
  * @tparam T Type of elements stored.
- * @tparam Size Maximum number of elements in the buffer.
+ * @tparam Size Default maximum number of elements in the buffer.
  */
 template <typename T, size_t Size>
 class Buffer {
@@ -18,16 +40,24 @@ public:
     static const size_t size = Size;
     using value_type = T;
 
-    Buffer() = default;
+    Buffer()
+        : _capacity(Size), _low_watermark(0), _high_watermark(0), _is_draining(false), _is_filling(true),
+          _published_count(0), _spin_time(0)
+    {}
     Buffer(Buffer<T, Size>&& other) = delete;
     virtual ~Buffer() = default;
 
     /**
      * @brief Copy constructor.
      */
-    Buffer(const Buffer<T, Size>& other) {
+    Buffer(const Buffer<T, Size>& other)
+        : _capacity(other._capacity), _low_watermark(other._low_watermark), _high_watermark(other._high_watermark),
+          _is_draining(false), _is_filling(true), _published_count(0), _spin_time(other._spin_time)
+    {
         std::lock_guard<std::mutex> lock(mutex);
         _buf = other._buf;
+        _published_count.store(_buf.size(), std::memory_order_release);
+        UpdateLocked();
         cv.notify_one();
     }
 
@@ -37,6 +67,12 @@ public:
     Buffer<T, Size>& operator=(const Buffer<T, Size>& other) {
         std::lock_guard<std::mutex> lock(mutex);
         _buf = other._buf;
+        _capacity = other._capacity;
+        _low_watermark = other._low_watermark;
+        _high_watermark = other._high_watermark;
+        _spin_time = other._spin_time;
+        _published_count.store(_buf.size(), std::memory_order_release);
+        UpdateLocked();
         cv.notify_one();
         return *this;
     }
@@ -49,12 +85,75 @@ public:
      * @param value The value to push.
      */
     void Push(const T& value) {
+        TraceSpan span("push");
         std::lock_guard<std::mutex> lock(mutex);
-        if (_buf.size() == Buffer::size) {
+        if (_buf.size() >= _capacity) {
             _buf.pop_front();
         }
         _buf.push_back(value);
-        cv.notify_one();
+        NotifyLocked();
+    }
+
+    /**
+     * @brief Push an element into the buffer by moving it.
+     *
+     * If the buffer is full, the oldest element is removed.
+     *
+     * @param value The value to push.
+     */
+    void Push(T&& value) {
+        TraceSpan span("push");
+        std::lock_guard<std::mutex> lock(mutex);
+        if (_buf.size() >= _capacity) {
+            _buf.pop_front();
+        }
+        _buf.push_back(std::move(value));
+        NotifyLocked();
+    }
+
+    /**
+     * @brief Pushes an element by moving it, waiting while the buffer is full.
+     *
+     * Unlike Push(), never drops elements: the wait and the push happen under
+     * one lock, so a capacity lowered meanwhile by setCapacity() only delays it.
+     *
+     * @param value The value to push.
+     */
+    void PushWait(T&& value) {
+        TraceSpan span("push");
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!canPushLocked()) {
+            TraceSpan wait("wait not full");
+            cv.wait(lock, [this] { return canPushLocked(); });
+        }
+        _buf.push_back(std::move(value));
+        NotifyLocked();
+    }
+
+    /**
+     * @brief Pushes a range of elements by moving them, under one lock per batch.
+     *
+     * Unlike Push(), waits while the buffer is full instead of dropping elements.
+     *
+     * @tparam InputIt Iterator over elements of type T.
+     * @param first Beginning of the range.
+     * @param last End of the range.
+     */
+    template <typename InputIt>
+    void PushRange(InputIt first, InputIt last) {
+        TraceSpan span("push");
+        while (first != last) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!canPushLocked()) {
+                TraceSpan wait("wait not full");
+                cv.wait(lock, [this] { return canPushLocked(); });
+            }
+            while (first != last && _buf.size() < _capacity) {
+                _buf.push_back(std::move(*first));
+                ++first;
+            }
+            NotifyLocked(true);
+        }
     }
 
     /**
@@ -81,13 +180,51 @@ public:
      * @return T The removed element.
      */
     T Pop() {
+        TraceSpan span("pop");
         std::lock_guard<std::mutex> lock(mutex);
-        T item = _buf.front();
+        T item = std::move(_buf.front());
         _buf.pop_front();
-        cv.notify_one();
+        NotifyLocked();
         return item;
     }
 
+    /**
+     * @brief Removes up to max_count elements from the front under one lock.
+     *
+     * Does not wait, call waitForNotEmpty() first to wait for elements.
+     *
+     * @tparam OutputIt Output iterator accepting elements of type T.
+     * @param out Destination of the moved elements.
+     * @param max_count Maximum number of elements.
+     * @return size_t Number of elements removed.
+     */
+    template <typename OutputIt>
+    size_t PopRange(OutputIt out, size_t max_count) {
+        TraceSpan span("pop");
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t count = std::min(max_count, _buf.size());
+        for (size_t idx = 0; idx < count; ++idx) {
+            *out = std::move(_buf.front());
+            ++out;
+            _buf.pop_front();
+        }
+        NotifyLocked(true);
+        return count;
+    }
+
+    /**
+     * @brief Wakes consumers to drain the buffer although it is below the high watermark.
+     *
+     * Call after the last element of a batch, e.g. at the end of the stream.
+     */
+    void Flush() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (_high_watermark > 0 && !_buf.empty() && !_is_draining) {
+            _is_draining = true;
+            cv.notify_all();
+        }
+    }
+
     /**
      * @brief Returns the number of elements in the buffer.
      *
@@ -97,34 +234,98 @@ public:
         return _buf.size();
     }
 
+    /**
+     * @brief Returns the current maximum number of elements.
+     *
+     * @return size_t Capacity of the buffer.
+     */
+    size_t capacity() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return _capacity;
+    }
+
+    /**
+     * @brief Changes the maximum number of elements.
+     *
+     * Elements already stored are kept even if they exceed the new capacity;
+     * waiting threads are woken up to re-check their conditions.
+     *
+     * @param capacity New capacity, at least 1.
+     */
+    void setCapacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex);
+        _capacity = std::max<size_t>(capacity, 1);
+        UpdateLocked();
+        cv.notify_all();
+    }
+
+    /**
+     * @brief Enables batched wakeups with hysteresis.
+     *
+     * The watermarks are clamped to the current capacity.
+     *
+     * @param low Producers are woken when the buffer drains to this many elements.
+     * @param high Consumers are woken when the buffer fills to this many elements, 0 to disable batching.
+     */
+    void setWatermarks(size_t low, size_t high) {
+        std::lock_guard<std::mutex> lock(mutex);
+        _low_watermark = low;
+        _high_watermark = high;
+        // Start from a state that lets both sides make progress.
+        _is_draining = !_buf.empty();
+        _is_filling = _buf.size() < _capacity;
+        UpdateLocked();
+        cv.notify_all();
+    }
+
+    /**
+     * @brief Lets consumers spin before they sleep in waitForNotEmpty().
+     *
+     * A waiting consumer polls the element count without the lock, with
+     * growing pauses (see SpinBackoff), so an element pushed meanwhile is
+     * taken without a wakeup through the scheduler.
+     *
+     * @param spin_us Microseconds to spin, 0 to sleep at once.
+     */
+    void setSpinTime(uint32_t spin_us) {
+        std::lock_guard<std::mutex> lock(mutex);
+        _spin_time = std::chrono::microseconds(spin_us);
+    }
+
     // Waiting methods:
     void waitForFull() {
         std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock, [this] { return _buf.size() == Buffer::size; });
+        cv.wait(lock, [this] { return _buf.size() >= _capacity; });
     }
     void waitForEmpty() {
         std::unique_lock<std::mutex> lock(mutex);
         cv.wait(lock, [this] { return _buf.empty(); });
     }
     void waitForNotFull() {
+        TraceSpan span("wait not full");
         std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock, [this] { return _buf.size() < Buffer::size; });
+        cv.wait(lock, [this] { return canPushLocked(); });
     }
     void waitForNotEmpty() {
+        TraceSpan span("wait not empty");
         std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock, [this] { return !_buf.empty(); });
+        auto is_ready = [this] { return !_buf.empty() && (_high_watermark == 0 || _is_draining); };
+        if (_spin_time.count() > 0 && !is_ready()) {
+            SpinLocked(lock, is_ready);
+        }
+        cv.wait(lock, is_ready);
     }
     void waitForHalf() {
         std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock, [this] { return _buf.size() == Buffer::size / 2; });
+        cv.wait(lock, [this] { return _buf.size() == _capacity / 2; });
     }
     void waitForAboveHalf() {
         std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock, [this] { return _buf.size() > Buffer::size / 2; });
+        cv.wait(lock, [this] { return _buf.size() > _capacity / 2; });
     }
     void waitForBelowHalf() {
         std::unique_lock<std::mutex> lock(mutex);
-        cv.wait(lock, [this] { return _buf.size() < Buffer::size / 2; });
+        cv.wait(lock, [this] { return _buf.size() < _capacity / 2; });
     }
 
     /**
@@ -142,17 +343,17 @@ public:
      * @return true if full, false otherwise.
      */
     bool isFull() const {
-        return _buf.size() == Buffer::size;
+        return _buf.size() >= _capacity;
     }
 
     bool isHalf() const {
-        return _buf.size() == Buffer::size / 2;
+        return _buf.size() == _capacity / 2;
     }
     bool isAboveHalf() const {
-        return _buf.size() > Buffer::size / 2;
+        return _buf.size() > _capacity / 2;
     }
     bool isBelowHalf() const {
-        return _buf.size() < Buffer::size / 2;
+        return _buf.size() < _capacity / 2;
     }
 
 protected:
@@ -160,39 +361,283 @@ protected:
     std::condition_variable cv;
 
 private:
+    bool canPushLocked() const {
+        return _buf.size() < _capacity && (_high_watermark == 0 || _is_filling);
+    }
+
+    // Polls for up to the spin time, taking the lock only when elements were
+    // published; returns locked, the caller sleeps if is_ready() is still false.
+    template <typename Predicate>
+    void SpinLocked(std::unique_lock<std::mutex>& lock, Predicate is_ready) {
+        SpinBackoff backoff(_spin_time);
+        lock.unlock();
+        do {
+            if (_published_count.load(std::memory_order_acquire) > 0) {
+                lock.lock();
+                if (is_ready()) {
+                    return;
+                }
+                lock.unlock();
+            }
+        } while (backoff.Pause());
+        lock.lock();
+    }
+
+    // Wakes the waiting side after the size changed: every change without
+    // watermarks, only watermark crossings with them.
+    void NotifyLocked(bool is_bulk = false) {
+        _published_count.store(_buf.size(), std::memory_order_release);
+        if (_high_watermark == 0) {
+            if (is_bulk) {
+                cv.notify_all();
+            }
+            else {
+                cv.notify_one();
+            }
+            return;
+        }
+        if (UpdateLocked()) {
+            cv.notify_all();
+        }
+    }
+
+    // Updates the hysteresis state, returns true if a waiting side may proceed now.
+    bool UpdateLocked() {
+        if (_high_watermark == 0) {
+            return false;
+        }
+        size_t size = _buf.size();
+        size_t high = std::min(_high_watermark, _capacity);
+        size_t low = std::min(_low_watermark, high - 1);
+        bool is_woken = false;
+        if (!_is_draining && size >= high) {
+            _is_draining = true;
+            is_woken = true;
+        }
+        else if (_is_draining && size == 0) {
+            _is_draining = false;
+        }
+        if (_is_filling && size >= _capacity) {
+            _is_filling = false;
+        }
+        else if (!_is_filling && size <= low) {
+            _is_filling = true;
+            is_woken = true;
+        }
+        return is_woken;
+    }
+
     std::deque<T> _buf;
+    size_t _capacity;
+    size_t _low_watermark;
+    size_t _high_watermark;
+    // Consumers may pop, set at the high watermark or on Flush() until empty.
+    bool _is_draining;
+    // Producers may push, cleared when full until the low watermark.
+    bool _is_filling;
+    // Copy of the size for consumers spinning without the lock.
+    std::atomic<size_t> _published_count;
+    std::chrono::microseconds _spin_time;
 };
 
 /**
- * @brief A Chunk is a buffer of characters.
+ * @brief A Chunk is a contiguous block of characters.
+ *
+ * The capacity is chosen at construction; Chunk::size is the default one.
+ * An empty chunk is used as the end-of-stream marker in a Pool.
  */
-class Chunk : public Buffer<char, 1024> {};
+class Chunk {
+public:
+    static const size_t size = 1024;
+
+    Chunk() : Chunk(Chunk::size) {}
+
+    /**
+     * @brief Constructs an empty chunk able to hold capacity bytes.
+     *
+     * @param capacity Size of the underlying storage.
+     * @param allocator Allocator of the storage, nullptr for the heap.
+     * @param is_budgeted Take the storage from the memory budget of the allocator,
+     *        for data entering a transfer (see MemoryBudget).
+     */
+    explicit Chunk(size_t capacity, ChunkAllocator* allocator = nullptr, bool is_budgeted = false)
+        : _data(allocate(capacity, allocator, is_budgeted), Deleter{ allocator, capacity, is_budgeted }),
+          _capacity(capacity), _count(0)
+    {}
+
+    Chunk(Chunk&& other) = default;
+    Chunk& operator=(Chunk&& other) = default;
+
+    /**
+     * @brief Copies len bytes from src into the chunk.
+     *
+     * @param src Source data.
+     * @param len Number of bytes, not greater than capacity().
+     */
+    void Assign(const char* src, size_t len) {
+        std::memcpy(_data.get(), src, len);
+        _count = len;
+    }
+
+    /**
+     * @brief Sets the number of valid bytes, e.g. after filling data() directly.
+     *
+     * @param count Number of valid bytes, not greater than capacity().
+     */
+    void Resize(size_t count) {
+        _count = count;
+    }
+
+    char* data() { return _data.get(); }
+    const char* data() const { return _data.get(); }
+
+    /**
+     * @brief Returns the number of valid bytes in the chunk.
+     *
+     * @return size_t Count of bytes.
+     */
+    size_t Count() const { return _count; }
+    size_t capacity() const { return _capacity; }
+
+    bool isEmpty() const { return _count == 0; }
+    bool isFull() const { return _count == _capacity; }
+
+private:
+    struct Deleter {
+        ChunkAllocator* allocator;
+        size_t capacity;
+        bool is_budgeted;
+
+        void operator()(char* ptr) const {
+            if (allocator != nullptr) {
+                allocator->Deallocate(ptr, capacity, is_budgeted);
+            }
+            else {
+                delete[] ptr;
+            }
+        }
+    };
+
+    static char* allocate(size_t capacity, ChunkAllocator* allocator, bool is_budgeted) {
+        if (capacity == 0) {
+            return nullptr;
+        }
+        return allocator != nullptr ? allocator->Allocate(capacity, is_budgeted) : new char[capacity];
+    }
+
+    std::unique_ptr<char, Deleter> _data;
+    size_t _capacity;
+    size_t _count;
+};
 
 /**
  * @brief A Pool is a buffer of Chunks.
  *
- * The Fit() method splits an input string into chunks and pushes them into the pool.
+ * The Fit() method splits input data into chunks and pushes them into the pool.
+ * Unlike the generic Buffer, Fit() and Push() wait for free space instead of
+ * dropping the oldest chunk, so the pool capacity acts as the transfer queue
+ * depth, also while setCapacity() shrinks it.
+ * Chunks created by Fit() are data entering a transfer and are taken from
+ * the memory budget of the allocator, if any. Before a budgeted allocation
+ * waits the pool is flushed, its chunks may hold the memory waited for.
  */
-class Pool : public Buffer<Chunk, 1024> {
+class Pool : public Buffer<Chunk, 1024>, private BudgetListener {
 public:
+    // Chunks created by Fit() are pushed in batches of up to this many, under
+    // one lock; at most a quarter of the capacity so that few chunks wait outside.
+    static constexpr size_t fit_batch_size = 64;
+
+    Pool() : _allocator(nullptr) {}
+    ~Pool() { setAllocator(nullptr); }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
     /**
-     * @brief Splits the input string into fixed-size chunks and pushes them into the pool.
+     * @brief Sets the allocator of chunks created by Fit() and whose budget waits flush the pool.
+     *
+     * @param allocator Chunk allocator, nullptr for the heap; must outlive the pool.
+     */
+    void setAllocator(ChunkAllocator* allocator) {
+        if (_allocator != nullptr) {
+            _allocator->RemoveListener(this);
+        }
+        _allocator = allocator;
+        if (_allocator != nullptr) {
+            _allocator->AddListener(this);
+        }
+    }
+    ChunkAllocator* allocator() const { return _allocator; }
+
+    /**
+     * @brief Splits the input string into Chunk::size chunks and pushes them into the pool.
      *
      * @param buf The input string to split.
      */
     void Fit(const std::string& buf) {
-        size_t nchunks = buf.size() / Chunk::size;
-        if (buf.size() % Chunk::size != 0)
-            ++nchunks;
-
-        for (size_t nchunk = 0; nchunk < nchunks; ++nchunk) {
-            Chunk chunk;
-            size_t start_idx = nchunk * Chunk::size;
-            size_t finish_idx = std::min(start_idx + Chunk::size, buf.size());
-            for (size_t idx = start_idx; idx < finish_idx; ++idx) {
-                chunk.Push(buf[idx]);
+        Fit(buf.data(), buf.size(), Chunk::size);
+    }
+
+    /**
+     * @brief Splits the input data into chunk_size chunks and pushes them into the pool.
+     *
+     * @param buf The input data to split.
+     * @param len Length of the input data.
+     * @param chunk_size Size of a single chunk.
+     */
+    void Fit(const char* buf, size_t len, size_t chunk_size) {
+        const size_t batch_size = fitBatchSize();
+        std::vector<Chunk> batch;
+        batch.reserve(std::min(batch_size, (len + chunk_size - 1) / chunk_size));
+        for (size_t start_idx = 0; start_idx < len; start_idx += chunk_size) {
+            Chunk chunk(chunk_size, _allocator, true);
+            chunk.Assign(buf + start_idx, std::min(chunk_size, len - start_idx));
+            batch.push_back(std::move(chunk));
+            if (batch.size() >= batch_size) {
+                PushRange(batch.begin(), batch.end());
+                batch.clear();
             }
-            Push(chunk);
         }
+        PushRange(batch.begin(), batch.end());
+    }
+
+    /**
+     * @brief Returns the number of chunks moved per batch by Fit() and bulk consumers.
+     *
+     * @return size_t Up to fit_batch_size, at most a quarter of the capacity.
+     */
+    size_t batchSize() const {
+        // A copy: std::min() takes references and the constant has no definition before C++17.
+        const size_t max_batch_size = fit_batch_size;
+        return std::min(max_batch_size, std::max<size_t>(capacity() / 4, 1));
+    }
+
+    /**
+     * @brief Pushes a chunk, waiting while the pool is full.
+     *
+     * Hides the dropping Buffer::Push(): a chunk of a pool is never discarded.
+     *
+     * @param chunk The chunk to push.
+     */
+    void Push(Chunk&& chunk) {
+        PushWait(std::move(chunk));
+    }
+
+    /**
+     * @brief Pushes the end-of-stream marker (an empty chunk) and flushes.
+     */
+    void PushEnd() {
+        PushWait(Chunk(0));
+        Flush();
+    }
+
+private:
+    void onBudgetWait() override { Flush(); }
+
+    ChunkAllocator* _allocator;
+
+    // A chunk waiting for the memory budget must not hold back the earlier ones.
+    size_t fitBatchSize() const {
+        return _allocator != nullptr && _allocator->isBudgeted() ? 1 : batchSize();
     }
 };
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "buffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class ConnectionPool;
+
+/**
+ * @brief Authenticated encryption algorithms.
+ */
+enum class cipher {
+    NONE = 0,
+    AES_256_GCM = 1,
+    CHACHA20_POLY1305 = 2,
+    // AES-256-GCM if the CPU has AES instructions, ChaCha20-Poly1305 otherwise.
+    AUTO = 255
+};
+
+/**
+ * @brief When the received file is flushed to stable storage.
+ */
+enum class durability {
+    NONE = 0,
+    // One flush after the last byte is written.
+    AT_END = 1,
+    // One flush per sync_interval bytes and one at the end.
+    PERIODIC = 2
+};
+
+/**
+ * @brief Transports carrying the data between FOSocket and FISocket.
+ */
+enum class transport {
+    TCP = 0,
+    // Unix domain socket, for processes on one host.
+    UNIX = 1,
+    // Ring buffers in shared memory set up over a Unix domain socket, for
+    // processes on one host. Linux only.
+    SHARED_MEMORY = 2
+};
+
+/**
+ * @brief Tunable parameters of a single file transfer.
+ *
+ * Set on FOSocket/FISocket before Transmit()/Receive().
+ */
+struct TransferConfig {
+    // Transport of the connection, applied by Connect()/Init(). With UNIX and
+    // SHARED_MEMORY the address is the path of the socket file, the port is ignored.
+    transport channel = transport::TCP;
+    // Bytes of the shared-memory ring from the sender to the receiver, rounded
+    // up to a power of two.
+    size_t shm_ring_size = 8 * 1024 * 1024;
+    // TCP Fast Open: the listener takes data in the SYN and a connecting
+    // sender puts its first frame into it, from the second connection to a
+    // receiver on (the first fetches the cookie). The system must allow it,
+    // e.g. net.ipv4.tcp_fastopen = 3 on Linux. TCP only.
+    bool fast_open = false;
+    // Idle connections established ahead of FOSocket::Connect(), nullptr to
+    // connect on every call (see ConnectionPool).
+    ConnectionPool* connection_pool = nullptr;
+
+    // Bytes per chunk on the sender, bytes per recv() call on the receiver.
+    size_t chunk_size = Chunk::size;
+    // Maximum number of chunks queued between the file and socket threads.
+    size_t queue_depth = Pool::size;
+    // Move chunks between threads in batches: consumers are woken at 3/4 of
+    // queue_depth or at the end of the stream, producers at 1/4.
+    bool batch_wakeups = false;
+
+    // Adjust chunk_size and queue_depth from measured RTT and throughput.
+    bool auto_tune = false;
+    size_t min_chunk_size = 4 * 1024;
+    size_t max_chunk_size = 4 * 1024 * 1024;
+    size_t max_queue_depth = 4096;
+
+    // Files up to this size are sent with the header in a single vectored send
+    // and written by the receiver in one call, without worker threads. The
+    // receiver rejects inline files above its own threshold.
+    size_t small_file_threshold = 64 * 1024;
+
+    // Blocks the sender asks the disk to read ahead of the block being sent,
+    // 0 to rely on the default read-ahead of the system.
+    size_t prefetch_depth = 4;
+
+    // Send only the data extents of files with holes (SEEK_DATA/SEEK_HOLE),
+    // the receiver recreates the holes. A sparse file is written without the
+    // direct I/O and write-behind modes.
+    bool sparse = false;
+
+    // Let a peer on the same host copy the file in the kernel (FICLONE reflink,
+    // copy_file_range) instead of sending it; both sides must enable it. The
+    // receiver opens the path named by the sender, so enable it only between
+    // trusted processes. Not used with encryption.
+    bool local_copy = false;
+
+    // Multiplexed sessions (FOSession, FISocket::ReceiveSession()): bytes a
+    // stream may send ahead of the receiver's writes, and streams open at once.
+    // Set on the receiver, which announces them to the sender.
+    size_t stream_window = 1024 * 1024;
+    size_t max_streams = 16;
+
+    // Shared limit on the chunk memory of concurrent transfers, nullptr for
+    // none (see MemoryBudget), and the bytes guaranteed to this transfer.
+    MemoryBudget* memory_budget = nullptr;
+    size_t memory_minimum = 4 * 1024 * 1024;
+
+    // Record the pipeline stages of the transfer threads, nullptr for none
+    // (see Tracer).
+    Tracer* tracer = nullptr;
+
+    // Chunk memory backed by huge pages and placed on numa_node (-1 for any).
+    bool use_hugepages = false;
+    int numa_node = -1;
+    // Pin the socket, reader and writer threads to distinct cores of numa_node,
+    // or to the cores listed in cpus.
+    bool pin_threads = false;
+    std::vector<int> cpus;
+
+    // Low-latency mode for small latency-critical transfers: threads waiting
+    // for chunks, socket data or shared-memory data spin for up to
+    // busy_poll_us microseconds, with growing pauses, before they sleep, and
+    // sockets busy-poll the device queue (SO_BUSY_POLL, Linux). Every waiting
+    // thread keeps a core busy; with pin_threads and no cpus the threads go to
+    // the isolated cores (isolcpus) if there are any. Synchronous transfers
+    // only, 0 to sleep at once.
+    uint32_t busy_poll_us = 0;
+
+    // Encrypt the data with a pre-shared 32-byte key. Chunks are encrypted and
+    // decrypted by crypto_threads threads in parallel (0 for one per CPU).
+    cipher encryption = cipher::NONE;
+    std::string key;
+    size_t crypto_threads = 0;
+
+    // Write the received file with direct I/O, bypassing the page cache, through
+    // two aligned blocks of direct_io_block_size bytes.
+    bool direct_io = false;
+    size_t direct_io_block_size = 4 * 1024 * 1024;
+
+    // Write the received file behind: chunks are coalesced into writes of
+    // write_behind_size bytes, writeback is started as data lands and written
+    // ranges are dropped from the page cache. Ignored with direct_io.
+    bool write_behind = false;
+    size_t write_behind_size = 8 * 1024 * 1024;
+    durability sync = durability::NONE;
+    uint64_t sync_interval = 64 * 1024 * 1024;
+};
@@ -0,0 +1,229 @@
+#include "connection_pool.h"
+#include "log.h"
+
+#include <algorithm>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+namespace {
+    // Pause of the background connects to a destination after a failed one.
+    const std::chrono::milliseconds retry_delay(1000);
+
+    /**
+     * @brief Checks an idle connection without blocking.
+     *
+     * The receiver sends nothing before the sender's header, so an idle
+     * socket that is readable was closed or reset by the peer.
+     *
+     * @param connection Idle connection.
+     * @return true if the connection can carry a transfer.
+     */
+    bool isHealthy(Connection& connection) {
+        tcpft_sock sock = connection.sock();
+        if (sock == static_cast<tcpft_sock>(-1)) {
+            return false;
+        }
+#ifdef _WIN32
+        WSAPOLLFD fd = {};
+        fd.fd = sock;
+        fd.events = POLLRDNORM;
+        return WSAPoll(&fd, 1, 0) == 0;
+#else
+        pollfd fd = {};
+        fd.fd = sock;
+        fd.events = POLLIN;
+        return poll(&fd, 1, 0) == 0;
+#endif
+    }
+}
+
+ConnectionPool::ConnectionPool(const TransferConfig& config, size_t size, uint32_t max_idle_ms)
+    : _config(config), _idle_config(config), _size(size), _max_idle(max_idle_ms), _hits(0), _misses(0), _discarded(0),
+      _is_stopping(false)
+{
+    _idle_config.fast_open = false;
+    _connector = std::thread(&ConnectionPool::ConnectLoop, this);
+}
+
+ConnectionPool::~ConnectionPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _is_stopping = true;
+    }
+    _cv.notify_all();
+    _connector.join();
+    for (std::unique_ptr<Destination>& destination : _destinations) {
+        for (Idle& idle : destination->idle) {
+            idle.connection->Close();
+        }
+    }
+}
+
+status ConnectionPool::Warm(const std::string& dst_addr, uint16_t dst_port) {
+    if (_config.channel == transport::SHARED_MEMORY) {
+        return status::TRANSPORT_NOT_SUPPORTED;
+    }
+    std::unique_lock<std::mutex> lock(_mutex);
+    Destination* destination = findLocked(dst_addr, dst_port);
+    if (destination == nullptr) {
+        _destinations.emplace_back(new Destination());
+        destination = _destinations.back().get();
+        destination->addr = dst_addr;
+        destination->port = dst_port;
+    }
+
+    // Connected in the calling thread, so the connections are ready on return.
+    while (destination->idle.size() + destination->connecting < _size) {
+        ++destination->connecting;
+        lock.unlock();
+        std::unique_ptr<Connection> connection;
+        status result = ConnectTo(_idle_config, dst_addr, dst_port, connection);
+        lock.lock();
+        --destination->connecting;
+        if (result != status::OK) {
+            destination->retry_at = std::chrono::steady_clock::now() + retry_delay;
+            return result;
+        }
+        destination->idle.push_back(Idle{ std::move(connection), std::chrono::steady_clock::now() });
+    }
+    tcpft_logInfo("connection pool: ", destination->idle.size(), " idle connections to ", dst_addr, ":", dst_port);
+    return status::OK;
+}
+
+status ConnectionPool::Acquire(const std::string& dst_addr, uint16_t dst_port,
+                               std::unique_ptr<Connection>& connection) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Destination* destination = findLocked(dst_addr, dst_port);
+        while (destination != nullptr && !destination->idle.empty()) {
+            std::unique_ptr<Connection> idle = std::move(destination->idle.front().connection);
+            destination->idle.pop_front();
+            if (isHealthy(*idle)) {
+                connection = std::move(idle);
+                break;
+            }
+            idle->Close();
+            ++_discarded;
+        }
+        if (connection) {
+            ++_hits;
+        }
+        else {
+            ++_misses;
+        }
+    }
+    // Refill what was taken or discarded.
+    _cv.notify_all();
+    if (connection) {
+        return status::OK;
+    }
+    return ConnectTo(_config, dst_addr, dst_port, connection);
+}
+
+size_t ConnectionPool::idle(const std::string& dst_addr, uint16_t dst_port) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    Destination* destination = findLocked(dst_addr, dst_port);
+    return destination != nullptr ? destination->idle.size() : 0;
+}
+
+uint64_t ConnectionPool::hits() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _hits;
+}
+
+uint64_t ConnectionPool::misses() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _misses;
+}
+
+uint64_t ConnectionPool::discarded() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _discarded;
+}
+
+void ConnectionPool::ConnectLoop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_is_stopping) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point wake = ExpireLocked(now);
+
+        Destination* due = nullptr;
+        for (std::unique_ptr<Destination>& destination : _destinations) {
+            if (destination->idle.size() + destination->connecting >= _size) {
+                continue;
+            }
+            if (destination->retry_at <= now) {
+                due = destination.get();
+                break;
+            }
+            wake = std::min(wake, destination->retry_at);
+        }
+        if (due == nullptr) {
+            if (wake == std::chrono::steady_clock::time_point::max()) {
+                _cv.wait(lock);
+            }
+            else {
+                _cv.wait_until(lock, wake);
+            }
+            continue;
+        }
+
+        // Destinations are never removed, so due stays valid while unlocked.
+        ++due->connecting;
+        lock.unlock();
+        std::unique_ptr<Connection> connection;
+        status result = ConnectTo(_idle_config, due->addr, due->port, connection);
+        lock.lock();
+        --due->connecting;
+        if (result != status::OK) {
+            tcpft_logCritical("connection pool: connect to ", due->addr, ":", due->port, " failed");
+            due->retry_at = std::chrono::steady_clock::now() + retry_delay;
+        }
+        else {
+            due->idle.push_back(Idle{ std::move(connection), std::chrono::steady_clock::now() });
+        }
+    }
+}
+
+status ConnectionPool::ConnectTo(const TransferConfig& config, const std::string& dst_addr, uint16_t dst_port,
+                                 std::unique_ptr<Connection>& connection) {
+    connection = Connection::Create(config);
+    if (!connection) {
+        return status::TRANSPORT_NOT_SUPPORTED;
+    }
+    status result = connection->Connect(dst_addr, dst_port);
+    if (result != status::OK) {
+        connection.reset();
+    }
+    return result;
+}
+
+ConnectionPool::Destination* ConnectionPool::findLocked(const std::string& dst_addr, uint16_t dst_port) const {
+    for (const std::unique_ptr<Destination>& destination : _destinations) {
+        if (destination->addr == dst_addr && destination->port == dst_port) {
+            return destination.get();
+        }
+    }
+    return nullptr;
+}
+
+std::chrono::steady_clock::time_point ConnectionPool::ExpireLocked(std::chrono::steady_clock::time_point now) {
+    std::chrono::steady_clock::time_point next = std::chrono::steady_clock::time_point::max();
+    if (_max_idle.count() == 0) {
+        return next;
+    }
+    for (std::unique_ptr<Destination>& destination : _destinations) {
+        // The oldest connections are in front.
+        while (!destination->idle.empty() && destination->idle.front().since + _max_idle <= now) {
+            destination->idle.front().connection->Close();
+            destination->idle.pop_front();
+            ++_discarded;
+        }
+        if (!destination->idle.empty()) {
+            next = std::min(next, destination->idle.front().since + _max_idle);
+        }
+    }
+    return next;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "config.h"
+#include "status.h"
+#include "transport.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Connections established ahead of the transfers using them.
+ *
+ * A destination is added with Warm(), then the pool keeps up to size idle
+ * connections to it, connecting new ones in a background thread as they are
+ * taken, so a transfer starts without waiting for a handshake. Every
+ * connection carries a single transfer. A receiver accepts connections in
+ * the order they were established, so Acquire() hands out the oldest idle
+ * connection first; closed idle connections are skipped by FISocket.
+ *
+ * Set in TransferConfig::connection_pool, must outlive the transfers using it.
+ * TCP and Unix domain sockets only.
+ */
+class ConnectionPool {
+public:
+    /**
+     * @brief Constructs a pool and starts its connecting thread.
+     *
+     * @param config Configuration of the connections: channel, and fast_open for the connects of Acquire().
+     * @param size Idle connections kept per destination.
+     * @param max_idle_ms Age at which an idle connection is replaced, 0 to keep it.
+     */
+    ConnectionPool(const TransferConfig& config, size_t size, uint32_t max_idle_ms = 0);
+    ~ConnectionPool();
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    /**
+     * @brief Adds a destination and fills its idle connections.
+     *
+     * @param dst_addr Destination IP address, or the path of the socket file.
+     * @param dst_port Destination port, ignored for socket files.
+     * @return status Error status of the first failed connect, OK if all connected.
+     */
+    status Warm(const std::string& dst_addr, uint16_t dst_port);
+
+    /**
+     * @brief Takes a healthy idle connection to a destination, or connects a new one.
+     *
+     * Idle connections closed or reset by the peer are discarded. The
+     * destination is refilled in the background if it was warmed.
+     *
+     * @param dst_addr Destination IP address, or the path of the socket file.
+     * @param dst_port Destination port, ignored for socket files.
+     * @param connection Connected connection, nullptr on error.
+     * @return status Error status.
+     */
+    status Acquire(const std::string& dst_addr, uint16_t dst_port, std::unique_ptr<Connection>& connection);
+
+    /**
+     * @brief Returns the number of idle connections to a destination.
+     */
+    size_t idle(const std::string& dst_addr, uint16_t dst_port) const;
+
+    /**
+     * @brief Returns the number of Acquire() calls served by an idle connection.
+     */
+    uint64_t hits() const;
+
+    /**
+     * @brief Returns the number of Acquire() calls that had to connect.
+     */
+    uint64_t misses() const;
+
+    /**
+     * @brief Returns the number of idle connections discarded as closed or too old.
+     */
+    uint64_t discarded() const;
+
+private:
+    struct Idle {
+        std::unique_ptr<Connection> connection;
+        std::chrono::steady_clock::time_point since;
+    };
+
+    struct Destination {
+        std::string addr;
+        uint16_t port = 0;
+        // Oldest first.
+        std::deque<Idle> idle;
+        // Connects in progress, counted against size.
+        size_t connecting = 0;
+        // No background connects before this time after a failure.
+        std::chrono::steady_clock::time_point retry_at;
+    };
+
+    void ConnectLoop();
+    status ConnectTo(const TransferConfig& config, const std::string& dst_addr, uint16_t dst_port,
+                     std::unique_ptr<Connection>& connection);
+    Destination* findLocked(const std::string& dst_addr, uint16_t dst_port) const;
+    // Drops idle connections that are too old, returns when the next one expires.
+    std::chrono::steady_clock::time_point ExpireLocked(std::chrono::steady_clock::time_point now);
+
+    const TransferConfig _config;
+    // Idle connections complete their handshake at once, without Fast Open.
+    TransferConfig _idle_config;
+    const size_t _size;
+    const std::chrono::milliseconds _max_idle;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    std::vector<std::unique_ptr<Destination>> _destinations;
+    uint64_t _hits;
+    uint64_t _misses;
+    uint64_t _discarded;
+    bool _is_stopping;
+    std::thread _connector;
+};
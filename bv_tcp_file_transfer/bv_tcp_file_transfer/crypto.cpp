@@ -0,0 +1,319 @@
+#include "crypto.h"
+#include "worker.h"
+#include "affinity.h"
+
+#include <stdexcept>
+
+#ifdef TCPFT_WITH_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#ifdef _WIN32
+#pragma comment(lib, "libcrypto.lib")
+#endif
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+namespace {
+    // Chunks queued per worker in each direction.
+    const size_t lane_depth = 4;
+
+    bool hasAesInstructions() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        int info[4] = {};
+        __cpuid(info, 1);
+        return (info[2] & (1 << 25)) != 0;
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+        return __builtin_cpu_supports("aes");
+#else
+        return false;
+#endif
+    }
+
+#ifdef TCPFT_WITH_OPENSSL
+    const EVP_CIPHER* evpCipher(cipher type) {
+        switch (type) {
+        case cipher::AES_256_GCM:
+            return EVP_aes_256_gcm();
+        case cipher::CHACHA20_POLY1305:
+            return EVP_chacha20_poly1305();
+        default:
+            return nullptr;
+        }
+    }
+
+    void makeNonce(uint64_t seq, unsigned char* nonce) {
+        memset(nonce, 0, AeadCipher::nonce_size);
+        encodeUint(reinterpret_cast<char*>(nonce) + AeadCipher::nonce_size - 8, seq, 8);
+    }
+#endif
+}
+
+AeadCipher::AeadCipher(cipher type, const std::string& key, bool is_encrypt)
+    : _ctx(nullptr), _is_encrypt(is_encrypt)
+{
+#ifdef TCPFT_WITH_OPENSSL
+    const EVP_CIPHER* evp = evpCipher(type);
+    if (evp == nullptr || key.size() != key_size) {
+        throw std::runtime_error("unsupported cipher");
+    }
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    if (ctx == nullptr
+        || EVP_CipherInit_ex(ctx, evp, nullptr, nullptr, nullptr, is_encrypt ? 1 : 0) != 1
+        || EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_IVLEN, static_cast<int>(nonce_size), nullptr) != 1
+        || EVP_CipherInit_ex(ctx, nullptr, nullptr, reinterpret_cast<const unsigned char*>(key.data()), nullptr, -1) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        throw std::runtime_error("cipher init failed");
+    }
+    _ctx = ctx;
+#else
+    (void)type;
+    (void)key;
+    throw std::runtime_error("encryption is not available, build with TCPFT_WITH_OPENSSL");
+#endif
+}
+
+AeadCipher::~AeadCipher() {
+#ifdef TCPFT_WITH_OPENSSL
+    EVP_CIPHER_CTX_free(static_cast<EVP_CIPHER_CTX*>(_ctx));
+#endif
+}
+
+bool AeadCipher::Seal(uint64_t seq, const std::string& aad, const char* in, size_t len, char* out) {
+#ifdef TCPFT_WITH_OPENSSL
+    EVP_CIPHER_CTX* ctx = static_cast<EVP_CIPHER_CTX*>(_ctx);
+    unsigned char nonce[nonce_size];
+    makeNonce(seq, nonce);
+    unsigned char* dst = reinterpret_cast<unsigned char*>(out);
+    int nb = 0;
+    int tail = 0;
+    return _is_encrypt
+        && EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce) == 1
+        && EVP_EncryptUpdate(ctx, nullptr, &nb, reinterpret_cast<const unsigned char*>(aad.data()), static_cast<int>(aad.size())) == 1
+        && EVP_EncryptUpdate(ctx, dst, &nb, reinterpret_cast<const unsigned char*>(in), static_cast<int>(len)) == 1
+        && EVP_EncryptFinal_ex(ctx, dst + nb, &tail) == 1
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, static_cast<int>(CryptoHeader::tag_size), dst + len) == 1;
+#else
+    (void)seq; (void)aad; (void)in; (void)len; (void)out;
+    return false;
+#endif
+}
+
+bool AeadCipher::Open(uint64_t seq, const std::string& aad, const char* in, size_t len, char* out) {
+#ifdef TCPFT_WITH_OPENSSL
+    EVP_CIPHER_CTX* ctx = static_cast<EVP_CIPHER_CTX*>(_ctx);
+    unsigned char nonce[nonce_size];
+    makeNonce(seq, nonce);
+    unsigned char* dst = reinterpret_cast<unsigned char*>(out);
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(in);
+    int nb = 0;
+    int tail = 0;
+    return !_is_encrypt
+        && EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, nonce) == 1
+        && EVP_DecryptUpdate(ctx, nullptr, &nb, reinterpret_cast<const unsigned char*>(aad.data()), static_cast<int>(aad.size())) == 1
+        && EVP_DecryptUpdate(ctx, dst, &nb, src, static_cast<int>(len)) == 1
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, static_cast<int>(CryptoHeader::tag_size),
+                               const_cast<unsigned char*>(src + len)) == 1
+        && EVP_DecryptFinal_ex(ctx, dst + nb, &tail) == 1;
+#else
+    (void)seq; (void)aad; (void)in; (void)len; (void)out;
+    return false;
+#endif
+}
+
+bool AeadCipher::isAvailable() {
+#ifdef TCPFT_WITH_OPENSSL
+    return true;
+#else
+    return false;
+#endif
+}
+
+cipher AeadCipher::Resolve(cipher type) {
+    if (type != cipher::AUTO) {
+        return type;
+    }
+    return hasAesInstructions() ? cipher::AES_256_GCM : cipher::CHACHA20_POLY1305;
+}
+
+void AeadCipher::RandomSalt(CryptoHeader& header) {
+#ifdef TCPFT_WITH_OPENSSL
+    if (RAND_bytes(reinterpret_cast<unsigned char*>(header.salt), sizeof(header.salt)) == 1) {
+        return;
+    }
+    throw std::runtime_error("no random source");
+#else
+    (void)header;
+    throw std::runtime_error("encryption is not available, build with TCPFT_WITH_OPENSSL");
+#endif
+}
+
+std::string AeadCipher::DeriveKey(const std::string& psk, const CryptoHeader& header) {
+    if (psk.size() != key_size) {
+        throw std::runtime_error("pre-shared key must be 32 bytes");
+    }
+#ifdef TCPFT_WITH_OPENSSL
+    unsigned char key[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (HMAC(EVP_sha256(), psk.data(), static_cast<int>(psk.size()),
+             reinterpret_cast<const unsigned char*>(header.salt), sizeof(header.salt), key, &len) == nullptr
+        || len < key_size) {
+        throw std::runtime_error("key derivation failed");
+    }
+    return std::string(reinterpret_cast<const char*>(key), key_size);
+#else
+    (void)header;
+    throw std::runtime_error("encryption is not available, build with TCPFT_WITH_OPENSSL");
+#endif
+}
+
+/**
+ * @brief Worker that encrypts or decrypts the chunks of one pipeline lane.
+ *
+ * Lane k of n processes the frames with sequence numbers k, k + n, k + 2n, ...
+ */
+class CryptoPipeline::Lane : public Worker {
+public:
+    explicit Lane(const CryptoHeader& header, const std::string& key, const std::string& aad, bool is_encrypt,
+                  size_t index, size_t count, int cpu, ChunkAllocator* allocator, std::atomic<bool>& is_failed,
+                  Tracer* tracer)
+        : _cipher(static_cast<cipher>(header.cipher), key, is_encrypt), _aad(aad), _is_encrypt(is_encrypt),
+          _seq(index), _count(count), _cpu(cpu), _allocator(allocator), _is_failed(is_failed), _tracer(tracer)
+    {
+        in.setCapacity(lane_depth);
+        out.setCapacity(lane_depth);
+    }
+
+    void Work() override {
+        ThreadAffinity affinity(_cpu);
+        TraceThread trace(_tracer, "crypto lane");
+        for (;;) {
+            in.waitForNotEmpty();
+            Chunk chunk = in.Pop();
+            if (chunk.isEmpty()) {
+                break;
+            }
+            // After a failure chunks are passed through and discarded by the collector.
+            if (!_is_failed.load()) {
+                TraceSpan span(_is_encrypt ? "encrypt" : "decrypt");
+                chunk = _is_encrypt ? Seal(chunk) : Open(chunk);
+            }
+            _seq += _count;
+            out.PushWait(std::move(chunk));
+        }
+        out.PushEnd();
+    }
+
+    Pool in;
+    Pool out;
+
+private:
+    Chunk Seal(const Chunk& plain) {
+        const size_t prefix = CryptoHeader::frame_prefix_size;
+        Chunk frame(prefix + plain.Count() + CryptoHeader::tag_size, _allocator);
+        encodeUint(frame.data(), plain.Count(), prefix);
+        if (!_cipher.Seal(_seq, _aad, plain.data(), plain.Count(), frame.data() + prefix)) {
+            _is_failed.store(true);
+        }
+        frame.Resize(frame.capacity());
+        return frame;
+    }
+
+    Chunk Open(Chunk& frame) {
+        // The frame holds ciphertext and tag, the length prefix is consumed by the socket thread.
+        size_t len = frame.Count() - CryptoHeader::tag_size;
+        Chunk plain(len, _allocator);
+        if (!_cipher.Open(_seq, _aad, frame.data(), len, plain.data())) {
+            _is_failed.store(true);
+            return std::move(frame);
+        }
+        plain.Resize(len);
+        return plain;
+    }
+
+    AeadCipher _cipher;
+    const std::string& _aad;
+    const bool _is_encrypt;
+    uint64_t _seq;
+    const size_t _count;
+    const int _cpu;
+    ChunkAllocator* _allocator;
+    std::atomic<bool>& _is_failed;
+    Tracer* _tracer;
+};
+
+CryptoPipeline::CryptoPipeline(const TransferConfig& config, const CryptoHeader& header, const std::string& key,
+                               const std::string& aad, bool is_encrypt, Pool& in, Pool& out)
+    : _in(in), _out(out), _tracer(config.tracer), _is_failed(false)
+{
+    size_t count = config.crypto_threads;
+    if (count == 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t idx = 0; idx < count; ++idx) {
+        // Roles 0 and 1 are the socket and file threads.
+        _lanes.emplace_back(new Lane(header, key, aad, is_encrypt, idx, count,
+                                     ThreadAffinity::Select(config, 2 + idx), out.allocator(), _is_failed,
+                                     _tracer));
+    }
+}
+
+CryptoPipeline::~CryptoPipeline() {
+    Join();
+}
+
+void CryptoPipeline::Start() {
+    for (std::unique_ptr<Lane>& lane : _lanes) {
+        _threads.emplace_back(std::ref(*lane));
+    }
+    _threads.emplace_back(&CryptoPipeline::Dispatch, this);
+    _threads.emplace_back(&CryptoPipeline::Collect, this);
+}
+
+void CryptoPipeline::Join() {
+    for (std::thread& thread : _threads) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    _threads.clear();
+}
+
+void CryptoPipeline::Dispatch() {
+    TraceThread trace(_tracer, "crypto dispatch");
+    size_t idx = 0;
+    for (;;) {
+        _in.waitForNotEmpty();
+        Chunk chunk = _in.Pop();
+        if (chunk.isEmpty()) {
+            break;
+        }
+        _lanes[idx]->in.PushWait(std::move(chunk));
+        idx = (idx + 1) % _lanes.size();
+    }
+    for (std::unique_ptr<Lane>& lane : _lanes) {
+        lane->in.PushEnd();
+    }
+}
+
+void CryptoPipeline::Collect() {
+    TraceThread trace(_tracer, "crypto collect");
+    size_t idx = 0;
+    for (;;) {
+        Pool& lane_out = _lanes[idx]->out;
+        lane_out.waitForNotEmpty();
+        Chunk chunk = lane_out.Pop();
+        if (chunk.isEmpty()) {
+            // The lanes are ended in order, the first end marker follows the last chunk.
+            break;
+        }
+        if (!_is_failed.load()) {
+            _out.PushWait(std::move(chunk));
+        }
+        idx = (idx + 1) % _lanes.size();
+    }
+    _out.PushEnd();
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include "buffer.h"
+#include "config.h"
+#include "protocol.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief AEAD cipher context for one direction of a transfer.
+ *
+ * Not thread-safe: every thread uses its own instance.
+ * Requires OpenSSL (TCPFT_WITH_OPENSSL), otherwise construction throws.
+ */
+class AeadCipher {
+public:
+    static const size_t key_size = 32;
+    static const size_t nonce_size = 12;
+
+    /**
+     * @brief Creates a cipher context.
+     *
+     * @param type Cipher algorithm, not NONE or AUTO.
+     * @param key Per-transfer key of key_size bytes, see DeriveKey().
+     * @param is_encrypt true to encrypt, false to decrypt.
+     * @throws std::runtime_error if the cipher is not available.
+     */
+    AeadCipher(cipher type, const std::string& key, bool is_encrypt);
+    ~AeadCipher();
+
+    AeadCipher(const AeadCipher&) = delete;
+    AeadCipher& operator=(const AeadCipher&) = delete;
+
+    /**
+     * @brief Encrypts a frame.
+     *
+     * @param seq Sequence number of the frame, used as nonce.
+     * @param aad Additional authenticated data.
+     * @param in Plaintext of len bytes.
+     * @param out Ciphertext of len bytes followed by the tag.
+     * @return true on success, false otherwise.
+     */
+    bool Seal(uint64_t seq, const std::string& aad, const char* in, size_t len, char* out);
+
+    /**
+     * @brief Decrypts and authenticates a frame.
+     *
+     * @param seq Sequence number of the frame, used as nonce.
+     * @param aad Additional authenticated data.
+     * @param in Ciphertext of len bytes followed by the tag.
+     * @param out Plaintext of len bytes.
+     * @return true if the frame is authentic, false otherwise.
+     */
+    bool Open(uint64_t seq, const std::string& aad, const char* in, size_t len, char* out);
+
+    /**
+     * @brief Checks whether encryption support is compiled in.
+     *
+     * @return true if available, false otherwise.
+     */
+    static bool isAvailable();
+
+    /**
+     * @brief Resolves cipher::AUTO to a concrete algorithm.
+     *
+     * @param type Requested cipher.
+     * @return cipher AES_256_GCM if AES instructions are present, CHACHA20_POLY1305 otherwise.
+     */
+    static cipher Resolve(cipher type);
+
+    /**
+     * @brief Fills the salt with random bytes.
+     *
+     * @param header Crypto header to fill.
+     * @throws std::runtime_error if no random source is available.
+     */
+    static void RandomSalt(CryptoHeader& header);
+
+    /**
+     * @brief Derives the per-transfer key as HMAC-SHA256(psk, salt).
+     *
+     * @param psk Pre-shared key of key_size bytes.
+     * @param header Crypto header with the salt.
+     * @return std::string Per-transfer key.
+     * @throws std::runtime_error if the pre-shared key is invalid.
+     */
+    static std::string DeriveKey(const std::string& psk, const CryptoHeader& header);
+
+private:
+    void* _ctx;
+    bool _is_encrypt;
+};
+
+/**
+ * @brief Encrypts or decrypts a stream of chunks on several threads.
+ *
+ * A dispatcher thread pops chunks from the input pool and hands them out to
+ * the workers round-robin, a collector thread takes the results back in the
+ * same round-robin order, so the output pool receives them in stream order.
+ * Encrypted chunks hold whole frames (length, ciphertext, tag).
+ */
+class CryptoPipeline {
+public:
+    /**
+     * @brief Constructs a CryptoPipeline.
+     *
+     * @param config Transfer configuration (thread count, CPU pinning and tracer).
+     * @param header Crypto header of the transfer.
+     * @param key Per-transfer key.
+     * @param aad Additional authenticated data of every frame.
+     * @param is_encrypt true to encrypt, false to decrypt.
+     * @param in Pool of input chunks, terminated by an empty chunk.
+     * @param out Pool receiving output chunks, terminated by an empty chunk.
+     */
+    CryptoPipeline(const TransferConfig& config, const CryptoHeader& header, const std::string& key,
+                   const std::string& aad, bool is_encrypt, Pool& in, Pool& out);
+    ~CryptoPipeline();
+
+    /**
+     * @brief Starts the threads.
+     */
+    void Start();
+
+    /**
+     * @brief Waits for the threads to finish.
+     */
+    void Join();
+
+    /**
+     * @brief Checks whether a frame failed to encrypt or decrypt.
+     *
+     * After a failure the remaining chunks are discarded.
+     *
+     * @return true if failed, false otherwise.
+     */
+    bool isFailed() const { return _is_failed.load(); }
+
+private:
+    class Lane;
+
+    void Dispatch();
+    void Collect();
+
+    Pool& _in;
+    Pool& _out;
+    Tracer* _tracer;
+    std::vector<std::unique_ptr<Lane>> _lanes;
+    std::vector<std::thread> _threads;
+    std::atomic<bool> _is_failed;
+};
@@ -0,0 +1,236 @@
+#include "event_loop.h"
+
+#ifdef TCPFT_HAS_COROUTINES
+
+#include "log.h"
+
+#include <climits>
+#include <stdexcept>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
+
+namespace {
+    // Events handled per epoll_wait() call.
+    const int max_events = 256;
+}
+
+/**
+ * @brief Fire-and-forget coroutine wrapping a spawned task, destroyed on completion.
+ */
+struct EventLoop::Detached {
+    struct promise_type {
+        Detached get_return_object() {
+            return Detached{ std::coroutine_handle<promise_type>::from_promise(*this) };
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+EventLoop::EventLoop() : _tasks(0) {
+#ifdef __linux__
+    _epoll = epoll_create1(0);
+    if (_epoll < 0) {
+        throw std::runtime_error("epoll_create1 failed");
+    }
+#endif
+}
+
+EventLoop::~EventLoop() {
+#ifdef __linux__
+    close(_epoll);
+#endif
+}
+
+void EventLoop::Spawn(Task<void> task) {
+    ++_tasks;
+    _ready.push_back(RunDetached(std::move(task)).handle);
+}
+
+EventLoop::Detached EventLoop::RunDetached(Task<void> task) {
+    try {
+        co_await task;
+    }
+    catch (const std::exception& e) {
+        tcpft_logCritical("task failed: ", e.what());
+    }
+    --_tasks;
+}
+
+void EventLoop::Run() {
+    while (_tasks > 0) {
+        // Tasks yielding now run on the next iteration, after the sockets are polled.
+        for (size_t count = _ready.size(); count > 0; --count) {
+            std::coroutine_handle<> handle = _ready.front();
+            _ready.pop_front();
+            handle.resume();
+        }
+        if (_tasks == 0) {
+            break;
+        }
+        if (_watches.empty() && _ready.empty()) {
+            tcpft_logCritical("event loop stalled: ", _tasks, " tasks wait for nothing");
+            break;
+        }
+        Poll(_ready.empty() ? -1 : 0);
+    }
+}
+
+Task<int> EventLoop::Receive(tcpft_sock sock, char* buf, size_t len) {
+    for (;;) {
+        int nb = recv(sock, buf, static_cast<int>(std::min<size_t>(len, INT_MAX)), 0);
+        if (nb >= 0 || !tcpft_istimeout(tcpft_lasterror())) {
+            co_return nb;
+        }
+        co_await Readable(sock);
+    }
+}
+
+Task<bool> EventLoop::ReceiveExact(tcpft_sock sock, char* buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        int nb = co_await Receive(sock, buf + received, len - received);
+        if (nb <= 0) {
+            co_return false;
+        }
+        received += nb;
+    }
+    co_return true;
+}
+
+Task<bool> EventLoop::Send(tcpft_sock sock, const char* buf, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        int nb = send(sock, buf + sent, static_cast<int>(std::min<size_t>(len - sent, INT_MAX)), tcpft_nosignal);
+        if (nb > 0) {
+            sent += nb;
+        }
+        else if (nb < 0 && tcpft_istimeout(tcpft_lasterror())) {
+            co_await Writable(sock);
+        }
+        else {
+            co_return false;
+        }
+    }
+    co_return true;
+}
+
+Task<tcpft_sock> EventLoop::Accept(tcpft_sock listener) {
+    for (;;) {
+        tcpft_sock sock = accept(listener, nullptr, nullptr);
+        if (sock != static_cast<tcpft_sock>(-1)) {
+            tcpft_setnonblocking(sock);
+            co_return sock;
+        }
+        if (!tcpft_istimeout(tcpft_lasterror())) {
+            co_return static_cast<tcpft_sock>(-1);
+        }
+        co_await Readable(listener);
+    }
+}
+
+Task<bool> EventLoop::Connect(tcpft_sock sock) {
+    co_await Writable(sock);
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &len) != 0) {
+        co_return false;
+    }
+    co_return error == 0;
+}
+
+void EventLoop::Watch(tcpft_sock sock, bool is_write, std::coroutine_handle<> handle) {
+    std::unordered_map<tcpft_sock, Waiters>::iterator it = _watches.find(sock);
+    bool is_new = it == _watches.end();
+    if (is_new) {
+        it = _watches.emplace(sock, Waiters()).first;
+    }
+    (is_write ? it->second.writers : it->second.readers).push_back(handle);
+    UpdateInterest(sock, is_new);
+}
+
+void EventLoop::Dispatch(tcpft_sock sock, bool is_readable, bool is_writable) {
+    std::unordered_map<tcpft_sock, Waiters>::iterator it = _watches.find(sock);
+    if (it == _watches.end()) {
+        return;
+    }
+    // Resumed coroutines retry their call and wait again if it would still block.
+    if (is_readable) {
+        _ready.insert(_ready.end(), it->second.readers.begin(), it->second.readers.end());
+        it->second.readers.clear();
+    }
+    if (is_writable) {
+        _ready.insert(_ready.end(), it->second.writers.begin(), it->second.writers.end());
+        it->second.writers.clear();
+    }
+    UpdateInterest(sock, false);
+}
+
+void EventLoop::UpdateInterest(tcpft_sock sock, bool is_new) {
+    std::unordered_map<tcpft_sock, Waiters>::iterator it = _watches.find(sock);
+    bool is_empty = it->second.readers.empty() && it->second.writers.empty();
+#ifdef __linux__
+    struct epoll_event event = {};
+    event.data.fd = sock;
+    event.events = (it->second.readers.empty() ? 0u : static_cast<uint32_t>(EPOLLIN))
+                   | (it->second.writers.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+    if (is_empty) {
+        epoll_ctl(_epoll, EPOLL_CTL_DEL, sock, &event);
+    }
+    else if (epoll_ctl(_epoll, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, sock, &event) != 0 && !is_new) {
+        // The socket was closed and reopened under the same descriptor.
+        epoll_ctl(_epoll, EPOLL_CTL_ADD, sock, &event);
+    }
+#else
+    // poll() takes the whole set on every call, nothing to update.
+    (void)is_new;
+#endif
+    if (is_empty) {
+        _watches.erase(it);
+    }
+}
+
+void EventLoop::Poll(int timeout_ms) {
+#ifdef __linux__
+    struct epoll_event events[max_events];
+    int count = epoll_wait(_epoll, events, max_events, timeout_ms);
+    for (int idx = 0; idx < count; ++idx) {
+        uint32_t flags = events[idx].events;
+        bool is_error = (flags & (EPOLLERR | EPOLLHUP)) != 0;
+        Dispatch(events[idx].data.fd, is_error || (flags & EPOLLIN), is_error || (flags & EPOLLOUT));
+    }
+#else
+    (void)max_events;
+    std::vector<pollfd> fds;
+    fds.reserve(_watches.size());
+    for (const std::pair<const tcpft_sock, Waiters>& watch : _watches) {
+        pollfd fd = {};
+        fd.fd = watch.first;
+        fd.events = static_cast<short>((watch.second.readers.empty() ? 0 : POLLIN)
+                                       | (watch.second.writers.empty() ? 0 : POLLOUT));
+        fds.push_back(fd);
+    }
+#ifdef _WIN32
+    int count = WSAPoll(fds.data(), static_cast<ULONG>(fds.size()), timeout_ms);
+#else
+    int count = poll(fds.data(), static_cast<nfds_t>(fds.size()), timeout_ms);
+#endif
+    for (size_t idx = 0; count > 0 && idx < fds.size(); ++idx) {
+        if (fds[idx].revents == 0) {
+            continue;
+        }
+        bool is_error = (fds[idx].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0;
+        Dispatch(fds[idx].fd, is_error || (fds[idx].revents & POLLIN), is_error || (fds[idx].revents & POLLOUT));
+    }
+#endif
+}
+
+#endif // TCPFT_HAS_COROUTINES
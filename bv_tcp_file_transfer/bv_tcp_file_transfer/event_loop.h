@@ -0,0 +1,261 @@
+#pragma once
+
+#include "tcp_client_server.h"
+
+// The asynchronous API requires C++20 coroutines (/std:c++20, -std=c++20).
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define TCPFT_HAS_COROUTINES 1
+#endif
+#endif
+
+#ifdef TCPFT_HAS_COROUTINES
+
+#include <stddef.h>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Promise part shared by all Task types.
+ *
+ * A task starts suspended and runs when awaited; on completion it resumes
+ * the awaiting coroutine directly (symmetric transfer).
+ */
+class TaskPromiseBase {
+public:
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+            std::coroutine_handle<> continuation = handle.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = std::current_exception(); }
+
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+};
+
+/**
+ * @brief Lazily started coroutine producing a value of type T.
+ *
+ * Exceptions thrown by the coroutine are rethrown by co_await.
+ *
+ * @tparam T Result type, default constructible.
+ */
+template <typename T>
+class Task {
+public:
+    class promise_type : public TaskPromiseBase {
+    public:
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+        template <typename U>
+        void return_value(U&& result) { value = std::forward<U>(result); }
+
+        T value{};
+    };
+
+    Task(Task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !_handle || _handle.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        _handle.promise().continuation = caller;
+        return _handle;
+    }
+
+    T await_resume() {
+        if (_handle.promise().error) {
+            std::rethrow_exception(_handle.promise().error);
+        }
+        return std::move(_handle.promise().value);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+/**
+ * @brief Lazily started coroutine without a result.
+ */
+template <>
+class Task<void> {
+public:
+    class promise_type : public TaskPromiseBase {
+    public:
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_void() {}
+    };
+
+    Task(Task&& other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return !_handle || _handle.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept {
+        _handle.promise().continuation = caller;
+        return _handle;
+    }
+
+    void await_resume() {
+        if (_handle.promise().error) {
+            std::rethrow_exception(_handle.promise().error);
+        }
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+/**
+ * @brief Single-threaded event loop over non-blocking sockets.
+ *
+ * Coroutines suspend on socket readiness and are resumed by Run() when the
+ * socket becomes readable or writable (epoll on Linux, poll/WSAPoll
+ * elsewhere). A suspended transfer holds only its coroutine frame and its
+ * I/O buffer, so one thread can drive thousands of transfers.
+ * Not thread-safe: all tasks are spawned and run on the thread calling Run().
+ */
+class EventLoop {
+public:
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    /**
+     * @brief Schedules a top-level task, it starts on the next Run() iteration.
+     *
+     * Exceptions escaping the task are logged.
+     *
+     * @param task Task to run.
+     */
+    void Spawn(Task<void> task);
+
+    /**
+     * @brief Runs the scheduled tasks until all of them complete.
+     */
+    void Run();
+
+    /**
+     * @brief Waits until the socket is readable.
+     */
+    auto Readable(tcpft_sock sock) { return IoAwaiter{ *this, sock, false }; }
+
+    /**
+     * @brief Waits until the socket is writable.
+     */
+    auto Writable(tcpft_sock sock) { return IoAwaiter{ *this, sock, true }; }
+
+    /**
+     * @brief Lets the other ready tasks run before continuing.
+     */
+    auto Yield() { return YieldAwaiter{ *this }; }
+
+    /**
+     * @brief Receives up to len bytes.
+     *
+     * @return int Number of bytes received, 0 if closed, -1 on error.
+     */
+    Task<int> Receive(tcpft_sock sock, char* buf, size_t len);
+
+    /**
+     * @brief Receives exactly len bytes.
+     *
+     * @return true on success, false if the connection was closed or failed.
+     */
+    Task<bool> ReceiveExact(tcpft_sock sock, char* buf, size_t len);
+
+    /**
+     * @brief Sends len bytes.
+     *
+     * @return true on success, false on error.
+     */
+    Task<bool> Send(tcpft_sock sock, const char* buf, size_t len);
+
+    /**
+     * @brief Accepts a connection on a non-blocking listening socket.
+     *
+     * @return tcpft_sock Non-blocking accepted socket, -1 on error.
+     */
+    Task<tcpft_sock> Accept(tcpft_sock listener);
+
+    /**
+     * @brief Waits for a non-blocking connect() to complete.
+     *
+     * @return true if connected, false otherwise.
+     */
+    Task<bool> Connect(tcpft_sock sock);
+
+private:
+    struct IoAwaiter {
+        EventLoop& loop;
+        tcpft_sock sock;
+        bool is_write;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { loop.Watch(sock, is_write, handle); }
+        void await_resume() const noexcept {}
+    };
+
+    struct YieldAwaiter {
+        EventLoop& loop;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { loop._ready.push_back(handle); }
+        void await_resume() const noexcept {}
+    };
+
+    // Coroutines waiting for a socket, several tasks may wait on one listening socket.
+    struct Waiters {
+        std::vector<std::coroutine_handle<>> readers;
+        std::vector<std::coroutine_handle<>> writers;
+    };
+
+    struct Detached;
+
+    Detached RunDetached(Task<void> task);
+    void Watch(tcpft_sock sock, bool is_write, std::coroutine_handle<> handle);
+    void Dispatch(tcpft_sock sock, bool is_readable, bool is_writable);
+    void UpdateInterest(tcpft_sock sock, bool is_new);
+    void Poll(int timeout_ms);
+
+    std::deque<std::coroutine_handle<>> _ready;
+    std::unordered_map<tcpft_sock, Waiters> _watches;
+    size_t _tasks;
+#ifdef __linux__
+    int _epoll;
+#endif
+};
+
+#endif // TCPFT_HAS_COROUTINES
@@ -1,4 +1,884 @@
 #include "file.h"
+#include "buffer.h"
+#include "memory.h"
+#include "trace.h"
+#include "log.h"
+
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <winioctl.h>
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#elif defined(__APPLE__)
+#include <copyfile.h>
+#endif
+
+namespace {
+#ifdef _WIN32
+    using native_file = HANDLE;
+#else
+    using native_file = int;
+#endif
+
+    /**
+     * @brief Writes a block at the given offset, retrying partial writes.
+     *
+     * @return true on success, false on error.
+     */
+    bool writeAt(native_file file, const char* buf, size_t len, uint64_t offset) {
+        while (len > 0) {
+#ifdef _WIN32
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = static_cast<DWORD>(offset & 0xffffffff);
+            overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+            DWORD nb = 0;
+            if (!WriteFile(file, buf, static_cast<DWORD>(std::min<size_t>(len, 1u << 30)), &nb, &overlapped)) {
+                return false;
+            }
+#else
+            ssize_t nb = pwrite(file, buf, len, static_cast<off_t>(offset));
+            if (nb < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nb <= 0) {
+                return false;
+            }
+#endif
+            buf += nb;
+            len -= nb;
+            offset += nb;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Sets the size of the file.
+     *
+     * @return true on success, false on error.
+     */
+    bool truncateFile(native_file file, uint64_t size) {
+#ifdef _WIN32
+        FILE_END_OF_FILE_INFO info = {};
+        info.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+        return SetFileInformationByHandle(file, FileEndOfFileInfo, &info, sizeof(info)) != 0;
+#else
+        return ftruncate(file, static_cast<off_t>(size)) == 0;
+#endif
+    }
+}
+
+/**
+ * @brief Writer of a regular file, passing batches of blocks to one gather write.
+ */
+class GatherWriter {
+public:
+    explicit GatherWriter(const std::string& file_path);
+    ~GatherWriter() { Close(); }
+
+    void Write(const Chunk* chunks, size_t count);
+    void Write(const char* buf, size_t len);
+    void Close();
+    bool isFailed() const { return _is_failed; }
+
+private:
+    // File offset of the next write.
+    uint64_t _offset;
+    bool _is_failed;
+    bool _is_open;
+    native_file _file;
+#ifndef _WIN32
+    std::vector<struct iovec> _iov;
+#endif
+};
+
+GatherWriter::GatherWriter(const std::string& file_path) : _offset(0), _is_failed(false), _is_open(false) {
+#ifdef _WIN32
+    _file = CreateFileA(file_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("file not open");
+    }
+#else
+    _file = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_file < 0) {
+        throw std::runtime_error("file not open");
+    }
+#endif
+    _is_open = true;
+}
+
+void GatherWriter::Write(const Chunk* chunks, size_t count) {
+    if (_is_failed) {
+        return;
+    }
+#ifdef _WIN32
+    // WriteFileGather() needs unbuffered page-sized blocks, chunks are written one by one.
+    for (size_t idx = 0; idx < count; ++idx) {
+        Write(chunks[idx].data(), chunks[idx].Count());
+    }
+#else
+    _iov.clear();
+    for (size_t idx = 0; idx < count; ++idx) {
+        if (!chunks[idx].isEmpty()) {
+            struct iovec iov = { const_cast<char*>(chunks[idx].data()), chunks[idx].Count() };
+            _iov.push_back(iov);
+        }
+    }
+
+    size_t idx = 0;
+    while (idx < _iov.size()) {
+        ssize_t nb = pwritev(_file, &_iov[idx], static_cast<int>(std::min<size_t>(_iov.size() - idx, IOV_MAX)),
+                             static_cast<off_t>(_offset));
+        if (nb < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nb <= 0) {
+            tcpft_logCritical("write failed at offset ", _offset);
+            _is_failed = true;
+            return;
+        }
+        _offset += nb;
+
+        // Skip the blocks written completely and advance inside the partially written one.
+        size_t left = static_cast<size_t>(nb);
+        while (idx < _iov.size() && left >= _iov[idx].iov_len) {
+            left -= _iov[idx].iov_len;
+            ++idx;
+        }
+        if (idx < _iov.size()) {
+            _iov[idx].iov_base = static_cast<char*>(_iov[idx].iov_base) + left;
+            _iov[idx].iov_len -= left;
+        }
+    }
+#endif
+}
+
+void GatherWriter::Write(const char* buf, size_t len) {
+    if (_is_failed || len == 0) {
+        return;
+    }
+    if (!writeAt(_file, buf, len, _offset)) {
+        tcpft_logCritical("write failed at offset ", _offset);
+        _is_failed = true;
+        return;
+    }
+    _offset += len;
+}
+
+void GatherWriter::Close() {
+    if (!_is_open) {
+        return;
+    }
+#ifdef _WIN32
+    CloseHandle(_file);
+#else
+    close(_file);
+#endif
+    _is_open = false;
+}
+
+/**
+ * @brief Direct (unbuffered) writer with double-buffered aligned blocks.
+ */
+class DirectWriter {
+public:
+    DirectWriter(const std::string& file_path, size_t block_size, ChunkAllocator* allocator);
+    ~DirectWriter() { Close(); }
+
+    void Write(const char* buf, size_t len);
+    void Close();
+    bool isFailed() const { return _is_failed.load(); }
+
+private:
+    struct Block {
+        char* data;
+        size_t len;
+        uint64_t offset;
+    };
+
+    // Blocks in flight: one filled by the caller, one written by the I/O thread.
+    static const size_t block_count = 2;
+
+    void Submit();
+    void WriteBlocks();
+    char* AllocateBlock();
+    void FreeBlock(char* data);
+
+    native_file nativeFile() const {
+#ifdef _WIN32
+        return _handle;
+#else
+        return _fd;
+#endif
+    }
+
+    const size_t _block_size;
+    ChunkAllocator* _allocator;
+    Buffer<Block, block_count> _free;
+    Buffer<Block, block_count + 1> _full;
+    Block _current;
+    uint64_t _size;
+    std::atomic<bool> _is_failed;
+    bool _is_open;
+    std::thread _io_thread;
+#ifdef _WIN32
+    HANDLE _handle;
+#else
+    int _fd;
+#endif
+};
+
+DirectWriter::DirectWriter(const std::string& file_path, size_t block_size, ChunkAllocator* allocator)
+    : _block_size((std::max(block_size, FileWriter::direct_alignment) + FileWriter::direct_alignment - 1)
+                  / FileWriter::direct_alignment * FileWriter::direct_alignment),
+      _allocator(allocator), _current{ nullptr, 0, 0 }, _size(0), _is_failed(false), _is_open(false)
+{
+#ifdef _WIN32
+    _handle = CreateFileA(file_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, nullptr);
+    if (_handle == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("file not open");
+    }
+#else
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+    _fd = open(file_path.c_str(), flags | O_DIRECT, 0644);
+    if (_fd < 0 && errno == EINVAL) {
+        tcpft_logWarning("direct I/O is not supported for \"", file_path, "\", using regular writes");
+        _fd = open(file_path.c_str(), flags, 0644);
+    }
+#else
+    _fd = open(file_path.c_str(), flags, 0644);
+#ifdef F_NOCACHE
+    if (_fd >= 0) {
+        fcntl(_fd, F_NOCACHE, 1);
+    }
+#endif
+#endif
+    if (_fd < 0) {
+        throw std::runtime_error("file not open");
+    }
+#endif
+    _is_open = true;
+
+    for (size_t idx = 0; idx < block_count; ++idx) {
+        _free.Push(Block{ AllocateBlock(), 0, 0 });
+    }
+    _current = _free.Pop();
+    _io_thread = std::thread(&DirectWriter::WriteBlocks, this);
+}
+
+void DirectWriter::Write(const char* buf, size_t len) {
+    while (len > 0) {
+        size_t nb = std::min(len, _block_size - _current.len);
+        std::memcpy(_current.data + _current.len, buf, nb);
+        _current.len += nb;
+        _size += nb;
+        buf += nb;
+        len -= nb;
+        if (_current.len == _block_size) {
+            Submit();
+        }
+    }
+}
+
+void DirectWriter::Submit() {
+    uint64_t next_offset = _current.offset + _current.len;
+    _full.Push(_current);
+    // Waits only if the I/O thread still writes the other block.
+    _free.waitForNotEmpty();
+    _current = _free.Pop();
+    _current.len = 0;
+    _current.offset = next_offset;
+}
+
+void DirectWriter::WriteBlocks() {
+    for (;;) {
+        _full.waitForNotEmpty();
+        Block block = _full.Pop();
+        if (block.data == nullptr) {
+            break;
+        }
+        // The tail block is padded up to the alignment, the file is truncated on close.
+        size_t len = (block.len + FileWriter::direct_alignment - 1) / FileWriter::direct_alignment
+                     * FileWriter::direct_alignment;
+        std::memset(block.data + block.len, 0, len - block.len);
+        if (!_is_failed.load() && !writeAt(nativeFile(), block.data, len, block.offset)) {
+            tcpft_logCritical("direct write failed at offset ", block.offset);
+            _is_failed.store(true);
+        }
+        _free.Push(block);
+    }
+}
+
+void DirectWriter::Close() {
+    if (!_is_open) {
+        return;
+    }
+    if (_current.len > 0) {
+        Submit();
+    }
+    _full.Push(Block{ nullptr, 0, 0 });
+    _io_thread.join();
+
+    if (!truncateFile(nativeFile(), _size)) {
+        tcpft_logCritical("truncate failed");
+        _is_failed.store(true);
+    }
+#ifdef _WIN32
+    CloseHandle(_handle);
+#else
+    close(_fd);
+#endif
+    _is_open = false;
+
+    FreeBlock(_current.data);
+    while (!_free.isEmpty()) {
+        FreeBlock(_free.Pop().data);
+    }
+}
+
+char* DirectWriter::AllocateBlock() {
+    // Allocator blocks of a power of two size are aligned to their size within page-aligned slabs.
+    if (_allocator != nullptr) {
+        return _allocator->Allocate(_block_size);
+    }
+#ifdef _WIN32
+    void* data = _aligned_malloc(_block_size, FileWriter::direct_alignment);
+#else
+    void* data = nullptr;
+    if (posix_memalign(&data, FileWriter::direct_alignment, _block_size) != 0) {
+        data = nullptr;
+    }
+#endif
+    if (data == nullptr) {
+        throw std::bad_alloc();
+    }
+    return static_cast<char*>(data);
+}
+
+void DirectWriter::FreeBlock(char* data) {
+    if (_allocator != nullptr) {
+        _allocator->Deallocate(data, _block_size);
+        return;
+    }
+#ifdef _WIN32
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+/**
+ * @brief Writer that coalesces writes and keeps the dirty page cache bounded.
+ */
+class WriteBehindWriter {
+public:
+    WriteBehindWriter(const std::string& file_path, size_t block_size, durability policy, uint64_t sync_interval);
+    ~WriteBehindWriter() { Close(); }
+
+    void Write(const char* buf, size_t len);
+    void Close();
+    bool isFailed() const { return _is_failed; }
+
+private:
+    void Flush();
+    void Writeback(uint64_t offset, uint64_t len);
+    void Sync();
+
+    const durability _policy;
+    const uint64_t _sync_interval;
+    std::vector<char> _block;
+    size_t _block_len;
+    uint64_t _offset;
+    uint64_t _unsynced;
+    // Range whose writeback was started by the previous flush.
+    uint64_t _pending_offset;
+    uint64_t _pending_len;
+    bool _is_failed;
+    bool _is_open;
+#ifdef _WIN32
+    HANDLE _handle;
+#else
+    int _fd;
+#endif
+};
+
+WriteBehindWriter::WriteBehindWriter(const std::string& file_path, size_t block_size, durability policy,
+                                     uint64_t sync_interval)
+    : _policy(policy), _sync_interval(sync_interval), _block(std::max<size_t>(block_size, 1)), _block_len(0),
+      _offset(0), _unsynced(0), _pending_offset(0), _pending_len(0), _is_failed(false), _is_open(false)
+{
+#ifdef _WIN32
+    _handle = CreateFileA(file_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (_handle == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("file not open");
+    }
+#else
+    _fd = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_fd < 0) {
+        throw std::runtime_error("file not open");
+    }
+#endif
+    _is_open = true;
+}
+
+void WriteBehindWriter::Write(const char* buf, size_t len) {
+    while (len > 0) {
+        size_t nb = std::min(len, _block.size() - _block_len);
+        std::memcpy(&_block[_block_len], buf, nb);
+        _block_len += nb;
+        buf += nb;
+        len -= nb;
+        if (_block_len == _block.size()) {
+            Flush();
+        }
+    }
+}
+
+void WriteBehindWriter::Flush() {
+    const char* buf = _block.data();
+    size_t len = _block_len;
+    _block_len = 0;
+    if (_is_failed || len == 0) {
+        return;
+    }
+
+    uint64_t offset = _offset;
+    while (len > 0) {
+#ifdef _WIN32
+        DWORD nb = 0;
+        if (!WriteFile(_handle, buf, static_cast<DWORD>(std::min<size_t>(len, 1u << 30)), &nb, nullptr)) {
+            nb = 0;
+        }
+#else
+        ssize_t nb = write(_fd, buf, len);
+        if (nb < 0 && errno == EINTR) {
+            continue;
+        }
+#endif
+        if (nb <= 0) {
+            tcpft_logCritical("write failed at offset ", _offset);
+            _is_failed = true;
+            return;
+        }
+        buf += nb;
+        len -= nb;
+        _offset += nb;
+    }
+    Writeback(offset, _offset - offset);
+
+    if (_policy == durability::PERIODIC) {
+        _unsynced += _offset - offset;
+        if (_unsynced >= _sync_interval) {
+            Sync();
+        }
+    }
+}
+
+void WriteBehindWriter::Writeback(uint64_t offset, uint64_t len) {
+#if defined(__linux__)
+    // Start writing the new range, then wait for the previous one and evict it:
+    // the disk stays busy while at most two blocks are dirty or under writeback.
+    sync_file_range(_fd, static_cast<off64_t>(offset), static_cast<off64_t>(len), SYNC_FILE_RANGE_WRITE);
+    if (_pending_len > 0) {
+        sync_file_range(_fd, static_cast<off64_t>(_pending_offset), static_cast<off64_t>(_pending_len),
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(_fd, static_cast<off_t>(_pending_offset), static_cast<off_t>(_pending_len),
+                      POSIX_FADV_DONTNEED);
+    }
+#endif
+    _pending_offset = offset;
+    _pending_len = len;
+}
+
+void WriteBehindWriter::Sync() {
+    _unsynced = 0;
+#if defined(_WIN32)
+    bool is_synced = FlushFileBuffers(_handle) != 0;
+#elif defined(__APPLE__)
+    bool is_synced = fsync(_fd) == 0;
+#else
+    bool is_synced = fdatasync(_fd) == 0;
+#endif
+    if (!is_synced) {
+        tcpft_logCritical("sync failed");
+        _is_failed = true;
+    }
+}
+
+void WriteBehindWriter::Close() {
+    if (!_is_open) {
+        return;
+    }
+    Flush();
+    if (!_is_failed && _policy != durability::NONE) {
+        Sync();
+    }
+#if defined(POSIX_FADV_DONTNEED) && !defined(_WIN32)
+    // After a sync every page is clean and can be evicted, otherwise only the
+    // pages already written back are.
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+#ifdef _WIN32
+    CloseHandle(_handle);
+#else
+    close(_fd);
+#endif
+    _is_open = false;
+}
+
+/**
+ * @brief Writer of a file with holes, coalescing contiguous writes.
+ */
+class SparseWriter {
+public:
+    // Contiguous data is collected into writes of this size.
+    static const size_t block_size = 1024 * 1024;
+
+    explicit SparseWriter(const std::string& file_path);
+    ~SparseWriter() { Close(); }
+
+    void Write(const char* buf, size_t len);
+    void Seek(uint64_t offset);
+    void Resize(uint64_t size);
+    void Close();
+    bool isFailed() const { return _is_failed; }
+
+private:
+    void Flush();
+    void PunchHole(uint64_t offset, uint64_t len);
+
+    std::vector<char> _block;
+    size_t _block_len;
+    // File offset of the first byte in _block.
+    uint64_t _offset;
+    bool _is_failed;
+    bool _is_open;
+    native_file _file;
+};
+
+SparseWriter::SparseWriter(const std::string& file_path)
+    : _block(block_size), _block_len(0), _offset(0), _is_failed(false), _is_open(false)
+{
+#ifdef _WIN32
+    _file = CreateFileA(file_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("file not open");
+    }
+    // NTFS allocates every range of a file unless it is marked sparse.
+    DWORD nb = 0;
+    if (!DeviceIoControl(_file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &nb, nullptr)) {
+        tcpft_logWarning("sparse files are not supported for \"", file_path, "\", holes are written as zeros");
+    }
+#else
+    // A new file is one hole, ftruncate() extends it without allocating.
+    _file = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (_file < 0) {
+        throw std::runtime_error("file not open");
+    }
+#endif
+    _is_open = true;
+}
+
+void SparseWriter::Write(const char* buf, size_t len) {
+    while (len > 0) {
+        size_t nb = std::min(len, _block.size() - _block_len);
+        std::memcpy(&_block[_block_len], buf, nb);
+        _block_len += nb;
+        buf += nb;
+        len -= nb;
+        if (_block_len == _block.size()) {
+            Flush();
+        }
+    }
+}
+
+void SparseWriter::Seek(uint64_t offset) {
+    Flush();
+    if (offset > _offset) {
+        PunchHole(_offset, offset - _offset);
+    }
+    _offset = offset;
+}
+
+void SparseWriter::Resize(uint64_t size) {
+    Flush();
+    if (!_is_failed && !truncateFile(_file, size)) {
+        tcpft_logCritical("truncate failed");
+        _is_failed = true;
+    }
+    if (size > _offset) {
+        PunchHole(_offset, size - _offset);
+    }
+}
+
+void SparseWriter::Flush() {
+    if (_block_len > 0 && !_is_failed && !writeAt(_file, _block.data(), _block_len, _offset)) {
+        tcpft_logCritical("write failed at offset ", _offset);
+        _is_failed = true;
+    }
+    _offset += _block_len;
+    _block_len = 0;
+}
+
+void SparseWriter::PunchHole(uint64_t offset, uint64_t len) {
+    // The skipped ranges of a new file are holes already, deallocating them
+    // explicitly keeps them holes if the file system preallocated the file.
+#if defined(_WIN32)
+    FILE_ZERO_DATA_INFORMATION info = {};
+    info.FileOffset.QuadPart = static_cast<LONGLONG>(offset);
+    info.BeyondFinalZero.QuadPart = static_cast<LONGLONG>(offset + len);
+    DWORD nb = 0;
+    DeviceIoControl(_file, FSCTL_SET_ZERO_DATA, &info, sizeof(info), nullptr, 0, &nb, nullptr);
+#elif defined(FALLOC_FL_PUNCH_HOLE)
+    fallocate(_file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(len));
+#else
+    (void)offset;
+    (void)len;
+#endif
+}
+
+void SparseWriter::Close() {
+    if (!_is_open) {
+        return;
+    }
+    Flush();
+#ifdef _WIN32
+    CloseHandle(_file);
+#else
+    close(_file);
+#endif
+    _is_open = false;
+}
+
+/**
+ * @brief Sequential reader that keeps the kernel reading ahead of the caller.
+ */
+class SequentialReader {
+public:
+    SequentialReader(const std::string& file_path, size_t depth);
+    ~SequentialReader() { Close(); }
+
+    size_t Read(char* buf, size_t len);
+    void Seek(uint64_t offset);
+    std::vector<FileExtent> DataExtents();
+    void Close();
+    uint64_t size() const { return _size; }
+    bool isEndOfFile() const { return _offset >= _size; }
+
+private:
+    void Prefetch(uint64_t offset, uint64_t len);
+
+    const size_t _depth;
+    uint64_t _size;
+    uint64_t _offset;
+    // End of the range already requested from the disk.
+    uint64_t _prefetched;
+    bool _is_open;
+#ifdef _WIN32
+    HANDLE _handle;
+#else
+    int _fd;
+#endif
+};
+
+SequentialReader::SequentialReader(const std::string& file_path, size_t depth)
+    : _depth(depth), _size(0), _offset(0), _prefetched(0), _is_open(false)
+{
+#ifdef _WIN32
+    // Windows has no per-range hint, the flag makes the cache manager read ahead aggressively.
+    _handle = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                          FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    LARGE_INTEGER size = {};
+    if (_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(_handle, &size)) {
+        if (_handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(_handle);
+        }
+        throw std::runtime_error("file not open");
+    }
+    _size = static_cast<uint64_t>(size.QuadPart);
+#else
+    _fd = open(file_path.c_str(), O_RDONLY);
+    struct stat st;
+    if (_fd < 0 || fstat(_fd, &st) != 0) {
+        if (_fd >= 0) {
+            close(_fd);
+        }
+        throw std::runtime_error("file not open");
+    }
+    _size = static_cast<uint64_t>(st.st_size);
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#endif
+    _is_open = true;
+}
+
+size_t SequentialReader::Read(char* buf, size_t len) {
+    // Keep depth reads of this size requested ahead of the current position.
+    uint64_t target = std::min<uint64_t>(_size, _offset + static_cast<uint64_t>(len) * (_depth + 1));
+    if (_depth > 0 && target > _prefetched) {
+        uint64_t from = std::max(_prefetched, _offset);
+        Prefetch(from, target - from);
+        _prefetched = target;
+    }
+
+    size_t total = 0;
+    while (total < len) {
+#ifdef _WIN32
+        DWORD nb = 0;
+        DWORD part = static_cast<DWORD>(std::min<size_t>(len - total, 1u << 30));
+        if (!ReadFile(_handle, buf + total, part, &nb, nullptr)) {
+            tcpft_logCritical("read failed at offset ", _offset);
+            break;
+        }
+#else
+        ssize_t nb = read(_fd, buf + total, len - total);
+        if (nb < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nb < 0) {
+            tcpft_logCritical("read failed at offset ", _offset);
+            break;
+        }
+#endif
+        if (nb == 0) {
+            break;
+        }
+        total += nb;
+        _offset += nb;
+    }
+    return total;
+}
+
+void SequentialReader::Seek(uint64_t offset) {
+#ifdef _WIN32
+    LARGE_INTEGER position = {};
+    position.QuadPart = static_cast<LONGLONG>(offset);
+    bool is_moved = SetFilePointerEx(_handle, position, nullptr, FILE_BEGIN) != 0;
+#else
+    bool is_moved = lseek(_fd, static_cast<off_t>(offset), SEEK_SET) >= 0;
+#endif
+    if (!is_moved) {
+        throw std::runtime_error("seek failed");
+    }
+    // Read-ahead restarts from the new position.
+    _offset = offset;
+    _prefetched = offset;
+}
+
+std::vector<FileExtent> SequentialReader::DataExtents() {
+    std::vector<FileExtent> extents;
+#if defined(_WIN32)
+    FILE_ALLOCATED_RANGE_BUFFER query = {};
+    query.Length.QuadPart = static_cast<LONGLONG>(_size);
+    std::vector<FILE_ALLOCATED_RANGE_BUFFER> ranges(256);
+    while (_size > 0) {
+        DWORD nb = 0;
+        bool is_done = DeviceIoControl(_handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges.data(),
+                                       static_cast<DWORD>(ranges.size() * sizeof(ranges[0])), &nb, nullptr) != 0;
+        size_t count = nb / sizeof(ranges[0]);
+        if (!is_done && (GetLastError() != ERROR_MORE_DATA || count == 0)) {
+            extents.assign(1, FileExtent{ 0, _size });
+            break;
+        }
+        for (size_t idx = 0; idx < count; ++idx) {
+            extents.push_back(FileExtent{ static_cast<uint64_t>(ranges[idx].FileOffset.QuadPart),
+                                          static_cast<uint64_t>(ranges[idx].Length.QuadPart) });
+        }
+        if (is_done) {
+            break;
+        }
+        // The output buffer was full, continue after the last range.
+        uint64_t next = extents.back().offset + extents.back().len;
+        query.FileOffset.QuadPart = static_cast<LONGLONG>(next);
+        query.Length.QuadPart = static_cast<LONGLONG>(_size - next);
+    }
+#elif defined(SEEK_DATA) && defined(SEEK_HOLE)
+    uint64_t offset = 0;
+    while (offset < _size) {
+        off_t data = lseek(_fd, static_cast<off_t>(offset), SEEK_DATA);
+        if (data < 0) {
+            // ENXIO: only a hole is left, anything else: holes are not reported.
+            if (errno != ENXIO) {
+                extents.assign(1, FileExtent{ 0, _size });
+            }
+            break;
+        }
+        off_t hole = lseek(_fd, data, SEEK_HOLE);
+        uint64_t end = hole < 0 ? _size : std::min<uint64_t>(static_cast<uint64_t>(hole), _size);
+        if (end > static_cast<uint64_t>(data)) {
+            extents.push_back(FileExtent{ static_cast<uint64_t>(data), end - static_cast<uint64_t>(data) });
+        }
+        offset = std::max<uint64_t>(end, static_cast<uint64_t>(data) + 1);
+    }
+    lseek(_fd, static_cast<off_t>(_offset), SEEK_SET);
+#else
+    if (_size > 0) {
+        extents.push_back(FileExtent{ 0, _size });
+    }
+#endif
+    return extents;
+}
+
+void SequentialReader::Prefetch(uint64_t offset, uint64_t len) {
+#if defined(_WIN32)
+    (void)offset;
+    (void)len;
+#elif defined(__linux__)
+    // Queues the reads and returns, the pages arrive while the caller works on earlier blocks.
+    readahead(_fd, static_cast<off64_t>(offset), static_cast<size_t>(len));
+#elif defined(POSIX_FADV_WILLNEED)
+    posix_fadvise(_fd, static_cast<off_t>(offset), static_cast<off_t>(len), POSIX_FADV_WILLNEED);
+#elif defined(F_RDADVISE)
+    struct radvisory advice;
+    advice.ra_offset = static_cast<off_t>(offset);
+    advice.ra_count = static_cast<int>(std::min<uint64_t>(len, INT_MAX));
+    fcntl(_fd, F_RDADVISE, &advice);
+#else
+    (void)offset;
+    (void)len;
+#endif
+}
+
+void SequentialReader::Close() {
+    if (!_is_open) {
+        return;
+    }
+#ifdef _WIN32
+    CloseHandle(_handle);
+#else
+    close(_fd);
+#endif
+    _is_open = false;
+}
+
+FileReader::FileReader() = default;
+
+FileReader::~FileReader() {
+    Close();
+}
 
 void FileReader::Open(const std::string& file_path) {
     _file.open(file_path, std::ios::binary);
@@ -8,36 +888,310 @@ void FileReader::Open(const std::string& file_path) {
 }
     
 void FileReader::Read(std::string& buf) {
+    if (_sequential) {
+        buf.resize(static_cast<size_t>(_sequential->size()));
+        buf.resize(buf.empty() ? 0 : _sequential->Read(&buf[0], buf.size()));
+        return;
+    }
     std::stringstream sstr;
     sstr << _file.rdbuf();
     buf = sstr.str();
 }
 
+void FileReader::OpenSequential(const std::string& file_path, size_t depth) {
+    _sequential.reset(new SequentialReader(file_path, depth));
+}
+
+size_t FileReader::Read(char* buf, size_t len) {
+    TraceSpan span("file read");
+    if (_sequential) {
+        return _sequential->Read(buf, len);
+    }
+    _file.read(buf, static_cast<std::streamsize>(len));
+    return static_cast<size_t>(_file.gcount());
+}
+
+void FileReader::Seek(uint64_t offset) {
+    if (!_sequential) {
+        throw std::runtime_error("file not open for sequential reading");
+    }
+    _sequential->Seek(offset);
+}
+
+std::vector<FileExtent> FileReader::dataExtents() {
+    if (!_sequential) {
+        throw std::runtime_error("file not open for sequential reading");
+    }
+    return _sequential->DataExtents();
+}
+
 void FileReader::Close() {
+    if (_sequential) {
+        _sequential->Close();
+        _sequential.reset();
+    }
     if (_file.is_open())
         _file.close();
 }
 
 bool FileReader::isEndOfFile() {
+    if (_sequential) {
+        return _sequential->isEndOfFile();
+    }
     return _file.eof();
 }
 
+uint64_t FileReader::size() {
+    if (_sequential) {
+        return _sequential->size();
+    }
+    std::streampos pos = _file.tellg();
+    _file.seekg(0, std::ios::end);
+    std::streampos end = _file.tellg();
+    _file.seekg(pos);
+    return static_cast<uint64_t>(end);
+}
+
+// Bound to a reference by std::max(), needs a definition before C++17.
+constexpr size_t FileWriter::direct_alignment;
+
+FileWriter::FileWriter() : _is_failed(false) {}
+
+FileWriter::~FileWriter() {
+    Close();
+}
+
 void FileWriter::Open(const std::string& file_path) {
-    _file.open(file_path, std::ios::binary);
-    if (!_file.is_open()) {
-        throw std::runtime_error("file not open");
+    _gather.reset(new GatherWriter(file_path));
+    _is_failed = false;
+}
+
+void FileWriter::OpenDirect(const std::string& file_path, size_t block_size, ChunkAllocator* allocator) {
+    _direct.reset(new DirectWriter(file_path, block_size, allocator));
+    _is_failed = false;
+}
+
+void FileWriter::OpenWriteBehind(const std::string& file_path, size_t block_size, durability policy,
+                                 uint64_t sync_interval) {
+    _behind.reset(new WriteBehindWriter(file_path, block_size, policy, sync_interval));
+    _is_failed = false;
+}
+
+void FileWriter::OpenSparse(const std::string& file_path) {
+    _sparse.reset(new SparseWriter(file_path));
+    _is_failed = false;
+}
+
+void FileWriter::Seek(uint64_t offset) {
+    if (!_sparse) {
+        throw std::runtime_error("file not open for sparse writing");
+    }
+    _sparse->Seek(offset);
+}
+
+void FileWriter::Resize(uint64_t size) {
+    if (!_sparse) {
+        throw std::runtime_error("file not open for sparse writing");
     }
+    _sparse->Resize(size);
 }
 
 void FileWriter::Write(const std::string& buf) {
-    _file << buf;
+    Write(buf.data(), buf.size());
 }
 
 void FileWriter::Write(const char& buf) {
-    _file << buf;
+    Write(&buf, 1);
+}
+
+void FileWriter::Write(const char* buf, size_t len) {
+    TraceSpan span("file write");
+    if (_direct) {
+        _direct->Write(buf, len);
+        return;
+    }
+    if (_behind) {
+        _behind->Write(buf, len);
+        return;
+    }
+    if (_sparse) {
+        _sparse->Write(buf, len);
+        return;
+    }
+    if (_gather) {
+        _gather->Write(buf, len);
+    }
+}
+
+void FileWriter::Write(const Chunk* chunks, size_t count) {
+    if (_gather) {
+        TraceSpan span("file write");
+        _gather->Write(chunks, count);
+        return;
+    }
+    for (size_t idx = 0; idx < count; ++idx) {
+        Write(chunks[idx].data(), chunks[idx].Count());
+    }
 }
 
 void FileWriter::Close() {
-    if (_file.is_open())
-        _file.close();
+    // Closing flushes and syncs, which may fail too.
+    if (_direct) {
+        _direct->Close();
+        _is_failed = _is_failed || _direct->isFailed();
+        _direct.reset();
+    }
+    if (_behind) {
+        _behind->Close();
+        _is_failed = _is_failed || _behind->isFailed();
+        _behind.reset();
+    }
+    if (_sparse) {
+        _sparse->Close();
+        _is_failed = _is_failed || _sparse->isFailed();
+        _sparse.reset();
+    }
+    if (_gather) {
+        _gather->Close();
+        _is_failed = _is_failed || _gather->isFailed();
+        _gather.reset();
+    }
+}
+
+bool FileWriter::isFailed() const {
+    return _is_failed || (_direct && _direct->isFailed()) || (_behind && _behind->isFailed()) ||
+           (_sparse && _sparse->isFailed()) || (_gather && _gather->isFailed());
+}
+
+bool FileIdentity::Load(const std::string& file_path) {
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    BY_HANDLE_FILE_INFORMATION info = {};
+    char full_path[MAX_PATH];
+    DWORD full_len = GetFullPathNameA(file_path.c_str(), sizeof(full_path), full_path, nullptr);
+    bool is_loaded = GetFileInformationByHandle(handle, &info) != 0 && full_len > 0 && full_len < sizeof(full_path);
+    CloseHandle(handle);
+    if (!is_loaded) {
+        return false;
+    }
+    path.assign(full_path, full_len);
+    device = info.dwVolumeSerialNumber;
+    inode = (static_cast<uint64_t>(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+    size = (static_cast<uint64_t>(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+#else
+    struct stat st;
+    char* full_path = realpath(file_path.c_str(), nullptr);
+    bool is_loaded = full_path != nullptr && stat(full_path, &st) == 0 && S_ISREG(st.st_mode);
+    if (is_loaded) {
+        path = full_path;
+        device = static_cast<uint64_t>(st.st_dev);
+        inode = static_cast<uint64_t>(st.st_ino);
+        size = static_cast<uint64_t>(st.st_size);
+    }
+    free(full_path);
+    if (!is_loaded) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+bool copyLocalFile(const FileIdentity& source, const std::string& file_path) {
+#ifdef _WIN32
+    FileIdentity current;
+    if (!current.Load(source.path) || current.device != source.device || current.inode != source.inode
+        || current.size != source.size) {
+        return false;
+    }
+    // CopyFile clones the blocks on file systems with block cloning (ReFS).
+    if (!CopyFileA(source.path.c_str(), file_path.c_str(), FALSE)) {
+        std::remove(file_path.c_str());
+        return false;
+    }
+    return true;
+#else
+    // The opened source is checked, so a file replaced after the offer is not copied.
+    int in = open(source.path.c_str(), O_RDONLY);
+    if (in < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode) || static_cast<uint64_t>(st.st_dev) != source.device
+        || static_cast<uint64_t>(st.st_ino) != source.inode || static_cast<uint64_t>(st.st_size) != source.size) {
+        close(in);
+        return false;
+    }
+    int out = open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+
+    bool is_copied = false;
+#if defined(__linux__)
+#ifdef FICLONE
+    is_copied = ioctl(out, FICLONE, in) == 0;
+    if (is_copied) {
+        tcpft_logInfo("local copy: cloned \"", source.path, "\"");
+    }
+#endif
+    // Only the data extents are copied and the size is set at the end, so holes stay holes.
+    bool is_sendfile = false;
+    bool is_failed = false;
+    uint64_t offset = 0;
+    while (!is_copied && !is_failed && offset < source.size) {
+        off_t data = lseek(in, static_cast<off_t>(offset), SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break;
+            }
+            data = static_cast<off_t>(offset);
+        }
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        uint64_t end = hole < 0 ? source.size : std::min<uint64_t>(static_cast<uint64_t>(hole), source.size);
+        loff_t in_offset = data;
+        loff_t out_offset = data;
+        while (!is_failed && static_cast<uint64_t>(in_offset) < end) {
+            size_t len = static_cast<size_t>(std::min<uint64_t>(end - in_offset, 1u << 30));
+            ssize_t nb = 0;
+            if (is_sendfile) {
+                off_t sendfile_offset = in_offset;
+                nb = lseek(out, in_offset, SEEK_SET) < 0 ? -1 : sendfile(out, in, &sendfile_offset, len);
+                if (nb > 0) {
+                    in_offset += nb;
+                }
+            }
+            else {
+                nb = copy_file_range(in, &in_offset, out, &out_offset, len, 0);
+            }
+            if (nb < 0 && errno == EINTR) {
+                continue;
+            }
+            if (nb < 0 && !is_sendfile && (errno == EXDEV || errno == ENOSYS || errno == EINVAL)) {
+                // copy_file_range() across file systems needs Linux 5.3, sendfile() copies in the kernel too.
+                is_sendfile = true;
+                continue;
+            }
+            is_failed = nb <= 0;
+        }
+        offset = std::max<uint64_t>(end, static_cast<uint64_t>(data) + 1);
+    }
+    if (!is_copied && !is_failed && ftruncate(out, static_cast<off_t>(source.size)) == 0) {
+        is_copied = true;
+        tcpft_logInfo("local copy: copied \"", source.path, "\" with ", is_sendfile ? "sendfile" : "copy_file_range");
+    }
+#elif defined(__APPLE__)
+    is_copied = fcopyfile(in, out, nullptr, COPYFILE_DATA) == 0;
+#endif
+    close(in);
+    close(out);
+    if (!is_copied) {
+        std::remove(file_path.c_str());
+    }
+    return is_copied;
+#endif
 }
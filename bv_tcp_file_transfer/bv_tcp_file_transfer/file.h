@@ -1,25 +1,146 @@
 #pragma once
 
+#include <stdint.h>
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <memory>
+#include <vector>
+
+#include "config.h"
+
+class ChunkAllocator;
+class GatherWriter;
+class DirectWriter;
+class WriteBehindWriter;
+class SparseWriter;
+class SequentialReader;
+
+/**
+ * @brief Range of a file that holds data, the rest of the file are holes.
+ */
+struct FileExtent {
+    uint64_t offset;
+    uint64_t len;
+};
+
+/**
+ * @brief Identity of a file on this host, tells whether two paths name the same file.
+ */
+struct FileIdentity {
+    // Absolute path of the file.
+    std::string path;
+    // Device and inode, volume serial number and file index on Windows.
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    uint64_t size = 0;
+
+    /**
+     * @brief Reads the identity of a regular file.
+     *
+     * @param file_path Path to the file.
+     * @return true on success, false if the file cannot be opened.
+     */
+    bool Load(const std::string& file_path);
+};
+
+/**
+ * @brief Copies a file on this host without passing the data through user space.
+ *
+ * The source is opened by its path and checked against its identity, then
+ * cloned (FICLONE reflink, the copy shares the blocks of the source) or
+ * copied by the kernel (copy_file_range, sendfile). Uses fcopyfile() on
+ * macOS and CopyFileA() on Windows, which clones on ReFS.
+ *
+ * @param source Identity of the source file.
+ * @param file_path Path to the output file.
+ * @return true on success, false if the source does not match or the copy failed,
+ *         the output file is then removed.
+ */
+bool copyLocalFile(const FileIdentity& source, const std::string& file_path);
 
 /**
  * @brief Class for writing to a file.
  */
 class FileWriter {
 public:
-    FileWriter() = default;
-    ~FileWriter() { Close(); }
+    // Alignment of buffers, offsets and sizes in direct mode.
+    static constexpr size_t direct_alignment = 4096;
+
+    FileWriter();
+    ~FileWriter();
 
     /**
      * @brief Opens the file for writing.
      *
+     * Data is written as given, without copies: Write(const Chunk*, size_t)
+     * takes a batch of chunks with a single vectored write (pwritev).
+     *
      * @param file_path Path to the output file.
      * @throws std::runtime_error if file cannot be opened.
      */
     void Open(const std::string& file_path);
 
+    /**
+     * @brief Opens the file for direct writing, bypassing the page cache.
+     *
+     * Data is staged in two aligned blocks: one is written by a background
+     * thread while the other is filled. On close the unaligned tail is written
+     * padded and the file is truncated to the exact size. Falls back to
+     * regular writes of aligned blocks if the file system has no direct I/O.
+     *
+     * @param file_path Path to the output file.
+     * @param block_size Size of a block, a multiple of direct_alignment.
+     * @param allocator Allocator of the blocks, nullptr for the heap.
+     * @throws std::runtime_error if file cannot be opened.
+     */
+    void OpenDirect(const std::string& file_path, size_t block_size, ChunkAllocator* allocator = nullptr);
+
+    /**
+     * @brief Opens the file for write-behind writing.
+     *
+     * Writes are coalesced into blocks of block_size bytes. After a block is
+     * written its writeback is started (sync_file_range), the previous block
+     * is waited for and dropped from the page cache (POSIX_FADV_DONTNEED), so
+     * dirty data stays bounded to about two blocks. The file is flushed
+     * (fdatasync/FlushFileBuffers) according to the policy, once per batch.
+     *
+     * @param file_path Path to the output file.
+     * @param block_size Size of a coalesced write.
+     * @param policy Durability policy.
+     * @param sync_interval Bytes per flush with durability::PERIODIC.
+     * @throws std::runtime_error if file cannot be opened.
+     */
+    void OpenWriteBehind(const std::string& file_path, size_t block_size, durability policy, uint64_t sync_interval);
+
+    /**
+     * @brief Opens the file for sparse writing.
+     *
+     * Data is written at the positions set by Seek(), the ranges skipped over
+     * and the tail added by Resize() are left as holes (deallocated with
+     * FALLOC_FL_PUNCH_HOLE/FSCTL_SET_ZERO_DATA).
+     *
+     * @param file_path Path to the output file.
+     * @throws std::runtime_error if file cannot be opened.
+     */
+    void OpenSparse(const std::string& file_path);
+
+    /**
+     * @brief Moves the write position forward, leaving a hole.
+     *
+     * @param offset New write position, not before the current one.
+     * @throws std::runtime_error if the file is not opened by OpenSparse().
+     */
+    void Seek(uint64_t offset);
+
+    /**
+     * @brief Sets the size of the file, a larger size adds a hole at the end.
+     *
+     * @param size New size in bytes.
+     * @throws std::runtime_error if the file is not opened by OpenSparse().
+     */
+    void Resize(uint64_t size);
+
     /**
      * @brief Writes a string to the file.
      *
@@ -34,13 +155,55 @@ public:
      */
     void Write(const char& buf);
 
+    /**
+     * @brief Writes a block of data to the file.
+     *
+     * @param buf Pointer to the data.
+     * @param len Length of the data.
+     */
+    void Write(const char* buf, size_t len);
+
+    /**
+     * @brief Writes the data of several chunks in order.
+     *
+     * A file opened by Open() takes them with one vectored write (pwritev,
+     * one write per chunk on Windows), the other modes copy them into their
+     * blocks.
+     *
+     * @param chunks Array of chunks.
+     * @param count Number of chunks.
+     */
+    void Write(const Chunk* chunks, size_t count);
+
     /**
      * @brief Closes the file.
      */
     void Close();
 
+    /**
+     * @brief Checks whether a write, sync or truncate of the file failed.
+     *
+     * Failed writers skip the rest of the data, the file is incomplete.
+     * Still valid after Close(), reset by the next open.
+     *
+     * @return true if the file is incomplete, false otherwise.
+     */
+    bool isFailed() const;
+
+    /**
+     * @brief Checks whether the file is written in direct mode.
+     *
+     * @return true if opened by OpenDirect(), false otherwise.
+     */
+    bool isDirect() const { return _direct != nullptr; }
+
 private:
-    std::ofstream _file;
+    std::unique_ptr<GatherWriter> _gather;
+    std::unique_ptr<DirectWriter> _direct;
+    std::unique_ptr<WriteBehindWriter> _behind;
+    std::unique_ptr<SparseWriter> _sparse;
+    // Failure of the writers already closed.
+    bool _is_failed;
 };
 
 /**
@@ -48,8 +211,8 @@ private:
  */
 class FileReader {
 public:
-    FileReader() = default;
-    ~FileReader() { Close(); }
+    FileReader();
+    ~FileReader();
 
     /**
      * @brief Opens the file at the given path.
@@ -59,6 +222,20 @@ public:
      */
     void Open(const std::string& file_path);
 
+    /**
+     * @brief Opens the file for sequential reading with prefetch.
+     *
+     * The operating system is told the file is read sequentially, and every
+     * Read() of len bytes keeps the next depth * len bytes requested from the
+     * disk (readahead/POSIX_FADV_WILLNEED), so disk reads overlap with the
+     * processing of earlier blocks.
+     *
+     * @param file_path Path to the file.
+     * @param depth Number of reads to prefetch ahead, 0 for the system default.
+     * @throws std::runtime_error if file cannot be opened.
+     */
+    void OpenSequential(const std::string& file_path, size_t depth);
+
     /**
      * @brief Reads the entire file content into a string.
      *
@@ -66,6 +243,34 @@ public:
      */
     void Read(std::string& buf);
 
+    /**
+     * @brief Reads up to len bytes from the current position.
+     *
+     * @param buf Destination buffer.
+     * @param len Maximum number of bytes to read.
+     * @return size_t Number of bytes read, 0 at the end of file.
+     */
+    size_t Read(char* buf, size_t len);
+
+    /**
+     * @brief Moves the read position.
+     *
+     * @param offset New read position.
+     * @throws std::runtime_error if the file is not opened by OpenSequential().
+     */
+    void Seek(uint64_t offset);
+
+    /**
+     * @brief Lists the ranges of the file that hold data, skipping holes.
+     *
+     * Uses SEEK_DATA/SEEK_HOLE (FSCTL_QUERY_ALLOCATED_RANGES on Windows); if
+     * the file system cannot report holes, the whole file is one extent.
+     *
+     * @return std::vector<FileExtent> Data extents in ascending order.
+     * @throws std::runtime_error if the file is not opened by OpenSequential().
+     */
+    std::vector<FileExtent> dataExtents();
+
     /**
      * @brief Closes the file.
      */
@@ -78,6 +283,14 @@ public:
      */
     bool isEndOfFile();
 
+    /**
+     * @brief Returns the size of the open file.
+     *
+     * @return uint64_t Size in bytes.
+     */
+    uint64_t size();
+
 private:
     std::ifstream _file;
+    std::unique_ptr<SequentialReader> _sequential;
 };
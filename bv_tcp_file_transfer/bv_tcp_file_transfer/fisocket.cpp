@@ -1,8 +1,92 @@
 #include "fsocket.h"
+#include "session.h"
 #include "worker.h"
 #include "file.h"
+#include "affinity.h"
+#include "protocol.h"
+#include "crypto.h"
 #include "log.h"
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace {
+#ifdef TCPFT_HAS_COROUTINES
+    /**
+     * @brief Keeps a listener non-blocking while asynchronous receives use it.
+     *
+     * The first receive switches it to non-blocking mode, the last one back,
+     * so that a later blocking Accept() waits again.
+     */
+    class AsyncListenerScope {
+    public:
+        AsyncListenerScope(tcpft_sock sock, size_t& users) : _sock(sock), _users(users) {
+            if (_users++ == 0) {
+                tcpft_setnonblocking(_sock);
+            }
+        }
+
+        ~AsyncListenerScope() {
+            if (--_users == 0) {
+                tcpft_setblocking(_sock);
+            }
+        }
+
+        AsyncListenerScope(const AsyncListenerScope&) = delete;
+        AsyncListenerScope& operator=(const AsyncListenerScope&) = delete;
+
+    private:
+        const tcpft_sock _sock;
+        size_t& _users;
+    };
+
+    /**
+     * @brief Closes the accepted socket of an asynchronous receive, also when it throws.
+     */
+    class AsyncSocketScope {
+    public:
+        explicit AsyncSocketScope(tcpft_sock sock) : _sock(sock) {}
+        ~AsyncSocketScope() { tcpft_closesocket(_sock); }
+
+        AsyncSocketScope(const AsyncSocketScope&) = delete;
+        AsyncSocketScope& operator=(const AsyncSocketScope&) = delete;
+
+    private:
+        const tcpft_sock _sock;
+    };
+#endif
+
+    /**
+     * @brief Opens the output file in the write mode selected by the configuration.
+     *
+     * @param fw Writer to open.
+     * @param location Path to the output file.
+     * @param config Transfer configuration (direct I/O and write-behind modes).
+     * @param allocator Allocator of direct I/O blocks, nullptr for the heap.
+     * @param max_block_size Upper bound of the block size, e.g. the file size.
+     */
+    void openWriter(FileWriter& fw, const std::string& location, const TransferConfig& config,
+                    ChunkAllocator* allocator, uint64_t max_block_size = UINT64_MAX) {
+        if (config.direct_io) {
+            fw.OpenDirect(location, static_cast<size_t>(std::min<uint64_t>(config.direct_io_block_size, max_block_size)),
+                          allocator);
+        }
+        else if (config.write_behind) {
+            fw.OpenWriteBehind(location, static_cast<size_t>(std::min<uint64_t>(config.write_behind_size, max_block_size)),
+                               config.sync, config.sync_interval);
+        }
+        else {
+            fw.Open(location);
+        }
+    }
+}
+
 /**
  * @brief Worker that writes file content from a Pool to an output file.
  */
@@ -13,18 +97,38 @@ public:
      *
      * @param location Path to the output file.
      * @param pool Reference to the Pool to read chunks from.
+     * @param config Transfer configuration (direct I/O and write-behind modes).
+     * @param is_sparse Whether the chunks are a sparse stream of extent records.
+     * @param cpu CPU to pin the worker thread to, -1 for none.
      */
-    explicit FileWriterWorker(const std::string& location, Pool& pool)
-        : _location(location), _pool(pool), _is_finished(false), _is_finish_requested(false)
+    explicit FileWriterWorker(const std::string& location, Pool& pool, const TransferConfig& config,
+                              bool is_sparse = false, int cpu = -1)
+        : _location(location), _pool(pool), _config(config), _is_sparse(is_sparse), _cpu(cpu), _extent_left(0),
+          _position(0), _is_complete(false), _is_failed(false), _is_finished(false)
     {}
 
     void Work() override {
-        while (!(_is_finish_requested.load() && _pool.isEmpty())) {
+        std::vector<Chunk> batch;
+        for (;;) {
+            // The chunks of the last batch are freed before waiting, they may be needed by the reader.
+            batch.clear();
             _pool.waitForNotEmpty();
-            Chunk chunk = _pool.Pop();
-
-            while (!chunk.isEmpty()) {
-                _fw.Write(chunk.Pop());
+            _pool.PopRange(std::back_inserter(batch), _pool.batchSize());
+            // Empty terminator chunk marks the end of the file.
+            std::vector<Chunk>::const_iterator end = std::find_if(batch.begin(), batch.end(),
+                                                                  [](const Chunk& chunk) { return chunk.isEmpty(); });
+            if (!_is_sparse) {
+                // The whole batch goes to the file in one vectored write.
+                _fw.Write(batch.data(), static_cast<size_t>(end - batch.cbegin()));
+            }
+            for (std::vector<Chunk>::const_iterator it = batch.cbegin(); _is_sparse && it != end; ++it) {
+                if (!_is_failed) {
+                    // After an error the pool is still drained so that the socket thread is not blocked.
+                    _is_failed = !WriteExtents(it->data(), it->Count());
+                }
+            }
+            if (end != batch.cend()) {
+                return;
             }
         }
     }
@@ -39,66 +143,799 @@ public:
     }
 
     /**
-     * @brief Finish worker.
+     * @brief Checks whether the file was written without errors, a sparse stream up to its end record.
      *
+     * @return true if complete, false otherwise.
      */
-    void Finish() {
-        _is_finish_requested.store(true);
+    bool isComplete() const {
+        return !_fw.isFailed() && (!_is_sparse || (_is_complete && !_is_failed));
     }
 
 protected:
     void onPrepareWork() override {
         _is_finished.store(false);
-        _fw.Open(_location);
+        _affinity.reset(new ThreadAffinity(_cpu));
+        _trace.reset(new TraceThread(_config.tracer, "file writer"));
+        if (_is_sparse) {
+            _fw.OpenSparse(_location);
+        }
+        else {
+            openWriter(_fw, _location, _config, _pool.allocator());
+        }
     }
 
     void onFinishWork() override {
         _fw.Close();
+        _trace.reset();
+        _affinity.reset();
         _is_finished.store(true);
     }
 
 private:
+    // Writes the data of the extents at their offsets, records may span chunks.
+    bool WriteExtents(const char* buf, size_t len) {
+        while (len > 0) {
+            if (_is_complete) {
+                tcpft_logCritical("data after the end of a sparse file");
+                return false;
+            }
+            if (_extent_left > 0) {
+                size_t nb = static_cast<size_t>(std::min<uint64_t>(len, _extent_left));
+                _fw.Write(buf, nb);
+                buf += nb;
+                len -= nb;
+                _extent_left -= nb;
+                continue;
+            }
+
+            size_t nb = std::min(len, ExtentHeader::encoded_size - _record.size());
+            _record.append(buf, nb);
+            buf += nb;
+            len -= nb;
+            if (_record.size() < ExtentHeader::encoded_size) {
+                break;
+            }
+            ExtentHeader extent;
+            extent.Decode(_record.data());
+            _record.clear();
+            if (extent.offset < _position || extent.len > UINT64_MAX - extent.offset) {
+                tcpft_logCritical("invalid extent at offset ", extent.offset);
+                return false;
+            }
+            if (extent.isEnd()) {
+                _fw.Resize(extent.offset);
+                _is_complete = true;
+            }
+            else {
+                _fw.Seek(extent.offset);
+                _extent_left = extent.len;
+                _position = extent.offset + extent.len;
+            }
+        }
+        return true;
+    }
+
     const std::string _location;
     Pool& _pool;
+    const TransferConfig& _config;
+    const bool _is_sparse;
+    const int _cpu;
+    std::unique_ptr<ThreadAffinity> _affinity;
+    std::unique_ptr<TraceThread> _trace;
     FileWriter _fw;
+    // Sparse stream state: partial extent record, data left of the current extent.
+    std::string _record;
+    uint64_t _extent_left;
+    uint64_t _position;
+    bool _is_complete;
+    bool _is_failed;
     std::atomic<bool> _is_finished;
-    std::atomic<bool> _is_finish_requested;
+};
+
+/**
+ * @brief A file received by a session.
+ */
+struct SessionStream {
+    uint32_t id = 0;
+    std::string location;
+    uint64_t size = 0;
+    // Set by the socket thread for an invalid name, by the writer if the file cannot be opened.
+    bool is_failed = false;
+    // DATA bytes received and not yet returned to the sender by a WINDOW frame.
+    std::atomic<uint64_t> queued{ 0 };
+    // Used by the writer thread only.
+    FileWriter fw;
+    bool is_open = false;
+    bool is_ended = false;
+    uint64_t written = 0;
+    uint64_t ungranted = 0;
+};
+
+/**
+ * @brief Frame of a session passed from the socket thread to the writer.
+ */
+struct SessionItem {
+    // FrameHeader::OPEN, DATA or END, CLOSE ends the session.
+    uint8_t type = FrameHeader::CLOSE;
+    std::shared_ptr<SessionStream> stream;
+    Chunk chunk = Chunk(0);
+};
+
+using SessionQueue = Buffer<SessionItem, 1024>;
+
+/**
+ * @brief Worker that writes the streams of a session and replies to the sender.
+ *
+ * The data of a stream returns to its window once written, so a stream whose
+ * file is slow to write does not hold back the others.
+ */
+class SessionWriterWorker : public Worker {
+public:
+    /**
+     * @brief Constructs a SessionWriterWorker.
+     *
+     * @param items Queue of frames filled by the socket thread.
+     * @param connection Connection of the session, for WINDOW and DONE frames.
+     * @param config Transfer configuration (direct I/O and write-behind modes).
+     * @param allocator Allocator of direct I/O blocks, nullptr for the heap.
+     * @param active Number of open streams, decreased before DONE is sent.
+     * @param stats Counters of the session, finished streams are counted here.
+     * @param cpu CPU to pin the worker thread to, -1 for none.
+     */
+    explicit SessionWriterWorker(SessionQueue& items, Connection& connection, const TransferConfig& config,
+                                 ChunkAllocator* allocator, std::atomic<size_t>& active, TransferStats& stats,
+                                 int cpu = -1)
+        : _items(items), _connection(connection), _config(config), _allocator(allocator), _active(active),
+          _stats(stats), _cpu(cpu)
+    {}
+
+    void Work() override {
+        std::vector<SessionItem> batch;
+        for (;;) {
+            batch.clear();
+            _items.waitForNotEmpty();
+            _items.PopRange(std::back_inserter(batch), Pool::fit_batch_size);
+            bool is_closed = false;
+            for (SessionItem& item : batch) {
+                if (item.type == FrameHeader::DATA) {
+                    Append(item);
+                    continue;
+                }
+                WriteRun();
+                if (item.type == FrameHeader::OPEN) {
+                    Open(item.stream);
+                }
+                else if (item.type == FrameHeader::END) {
+                    Finish(*item.stream);
+                }
+                else {
+                    is_closed = true;
+                }
+            }
+            WriteRun();
+            Grant();
+            if (is_closed) {
+                return;
+            }
+        }
+    }
+
+protected:
+    void onPrepareWork() override {
+        _affinity.reset(new ThreadAffinity(_cpu));
+        _trace.reset(new TraceThread(_config.tracer, "session writer"));
+    }
+
+    void onFinishWork() override {
+        // Streams left open by a broken session are incomplete.
+        for (std::pair<const uint32_t, std::shared_ptr<SessionStream>>& entry : _open) {
+            SessionStream& stream = *entry.second;
+            if (stream.is_open) {
+                stream.fw.Close();
+                tcpft_logCritical("stream ", stream.id, " truncated, removing \"", stream.location, "\"");
+                std::remove(stream.location.c_str());
+            }
+        }
+        _open.clear();
+        _trace.reset();
+        _affinity.reset();
+    }
+
+private:
+    void Open(const std::shared_ptr<SessionStream>& stream) {
+        _open[stream->id] = stream;
+        if (stream->is_failed) {
+            return;
+        }
+        try {
+            openWriter(stream->fw, stream->location, _config, _allocator, stream->size);
+            stream->is_open = true;
+        }
+        catch (const std::runtime_error& e) {
+            tcpft_logCritical("stream ", stream->id, " \"", stream->location, "\": ", e.what());
+            stream->is_failed = true;
+        }
+    }
+
+    // Consecutive chunks of a stream are written together.
+    void Append(SessionItem& item) {
+        if (_run_stream != item.stream) {
+            WriteRun();
+            _run_stream = item.stream;
+        }
+        _run.push_back(std::move(item.chunk));
+    }
+
+    void WriteRun() {
+        if (_run.empty()) {
+            return;
+        }
+        SessionStream& stream = *_run_stream;
+        uint64_t bytes = 0;
+        for (const Chunk& chunk : _run) {
+            bytes += chunk.Count();
+        }
+        if (stream.is_open) {
+            stream.fw.Write(_run.data(), _run.size());
+        }
+        stream.written += bytes;
+        if (stream.ungranted == 0) {
+            _granted.push_back(_run_stream);
+        }
+        stream.ungranted += bytes;
+        _run.clear();
+        _run_stream.reset();
+    }
+
+    // Returns the written data of the batch to the windows of the streams still open.
+    void Grant() {
+        for (const std::shared_ptr<SessionStream>& stream : _granted) {
+            if (!stream->is_ended) {
+                // Decreased first: the sender may reply with new data right away.
+                stream->queued -= stream->ungranted;
+                char credit[4];
+                encodeUint(credit, stream->ungranted, sizeof(credit));
+                if (!sendFrame(_connection, FrameHeader::WINDOW, stream->id, credit, sizeof(credit))) {
+                    tcpft_logCritical("send failed");
+                }
+            }
+            stream->ungranted = 0;
+        }
+        _granted.clear();
+    }
+
+    void Finish(SessionStream& stream) {
+        bool is_ok = false;
+        if (stream.is_open) {
+            // Closing flushes and syncs the file, which may fail too.
+            stream.fw.Close();
+            is_ok = stream.written == stream.size && !stream.fw.isFailed();
+            if (!is_ok) {
+                tcpft_logCritical("stream ", stream.id, " truncated or not written, removing \"", stream.location, "\"");
+                std::remove(stream.location.c_str());
+            }
+        }
+        stream.is_open = false;
+        stream.is_ended = true;
+        --_active;
+        if (is_ok) {
+            ++_stats.streams;
+        }
+        char reply = is_ok ? 1 : 0;
+        if (!sendFrame(_connection, FrameHeader::DONE, stream.id, &reply, 1)) {
+            tcpft_logCritical("send failed");
+        }
+        tcpft_logInfo("stream ", stream.id, " \"", stream.location, "\" ", is_ok ? "done" : "failed");
+        _open.erase(stream.id);
+    }
+
+    SessionQueue& _items;
+    Connection& _connection;
+    const TransferConfig& _config;
+    ChunkAllocator* _allocator;
+    std::atomic<size_t>& _active;
+    TransferStats& _stats;
+    const int _cpu;
+    std::unique_ptr<ThreadAffinity> _affinity;
+    std::unique_ptr<TraceThread> _trace;
+    // Streams opened and not yet ended.
+    std::map<uint32_t, std::shared_ptr<SessionStream>> _open;
+    std::vector<Chunk> _run;
+    std::shared_ptr<SessionStream> _run_stream;
+    std::vector<std::shared_ptr<SessionStream>> _granted;
 };
 
 status FISocket::Init(const std::string& src_addr, const uint16_t src_port) {
-    return _server.Init(src_addr, src_port);
+    _listener = Listener::Create(config());
+    if (!_listener) {
+        return status::TRANSPORT_NOT_SUPPORTED;
+    }
+    return _listener->Init(src_addr, src_port);
 }
 
 void FISocket::Receive(const std::string& location) {
-    FileWriterWorker fww(location, pool());
-    std::thread fwwt(std::ref(fww));
+    Prepare();
+    ThreadAffinity affinity(ThreadAffinity::Select(config(), 0));
+    TraceThread trace(config().tracer, "receiver socket");
+    TransferStats& st = transferStats();
+    st = TransferStats();
 
-    tcpft_sock sock = _server.Accept();
-    std::string buf(Chunk::size, '\0');
-    size_t chunk_cnt = 0;
+    std::string prologue(FileHeader::encoded_size, '\0');
+    std::unique_ptr<Connection> connection = AcceptTransfer(&prologue[0]);
+    if (!connection) {
+        tcpft_logCritical("accept failed");
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
     tcpft_logInfo("receive ", "\"", location, "\" starting...");
 
-    while (!fww.isFinished()) {
-        int nb = _server.Receive(sock, &buf[0], Chunk::size, 0);
+    FileHeader header;
+    bool is_valid = connection->ReceiveExact(&prologue[1], prologue.size() - 1) && header.Decode(prologue.data());
+    if (is_valid && header.hasFlag(FileHeader::LOCAL_COPY)) {
+        if (ReceiveLocalCopy(*connection, location, header)) {
+            st.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+            tcpft_logInfo("receive finished");
+            connection->Close();
+            return;
+        }
+        // The offer was declined, the sender starts over with a regular header.
+        is_valid = connection->ReceiveExact(&prologue[0], prologue.size()) && header.Decode(prologue.data())
+                   && !header.hasFlag(FileHeader::LOCAL_COPY);
+    }
+    if (!is_valid || header.hasFlag(FileHeader::SESSION)) {
+        tcpft_logCritical("invalid file header");
+        connection->Close();
+        return;
+    }
+
+    CryptoHeader crypto;
+    std::string key;
+    if (header.hasFlag(FileHeader::ENCRYPTED)) {
+        prologue.resize(FileHeader::encoded_size + CryptoHeader::encoded_size);
+        if (!connection->ReceiveExact(&prologue[FileHeader::encoded_size], CryptoHeader::encoded_size)) {
+            tcpft_logCritical("invalid crypto header");
+            connection->Close();
+            return;
+        }
+        crypto.Decode(&prologue[FileHeader::encoded_size]);
+        key = AeadCipher::DeriveKey(config().key, crypto);
+    }
+    else if (config().encryption != cipher::NONE) {
+        tcpft_logCritical("unencrypted transfer rejected");
+        connection->Close();
+        return;
+    }
+
+    // An inline file is received whole into memory, its size is bounded before the allocation.
+    if (header.hasFlag(FileHeader::INLINE) && header.size > config().small_file_threshold) {
+        tcpft_logCritical("inline file too large");
+        connection->Close();
+        return;
+    }
+
+    if (header.hasFlag(FileHeader::INLINE)) {
+        ReceiveInline(*connection, location, header, crypto, key, prologue);
+    }
+    else if (header.hasFlag(FileHeader::ENCRYPTED)) {
+        ReceiveEncryptedStream(*connection, location, header, crypto, key, prologue);
+    }
+    else {
+        ReceiveStream(*connection, location, header);
+    }
+
+    st.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    st.memory_reserved = pool().allocator()->reserved();
+    st.budget_wait_us = pool().allocator()->budgetWaitTime();
+    st.is_hugepage_backed = pool().allocator()->isHugepageBacked();
+
+    tcpft_logInfo("receive finished");
+    connection->Close();
+}
+
+void FISocket::ReceiveSession(const std::string& directory) {
+    Prepare();
+    const TransferConfig& cfg = config();
+    ThreadAffinity affinity(ThreadAffinity::Select(cfg, 0));
+    TraceThread trace(cfg.tracer, "session socket");
+    TransferStats& st = transferStats();
+    st = TransferStats();
+
+    char prologue[FileHeader::encoded_size];
+    std::unique_ptr<Connection> connection = AcceptTransfer(prologue);
+    if (!connection) {
+        tcpft_logCritical("accept failed");
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    tcpft_logInfo("session into \"", directory, "\" starting...");
+
+    FileHeader header;
+    if (!connection->ReceiveExact(prologue + 1, sizeof(prologue) - 1) || !header.Decode(prologue)
+        || !header.hasFlag(FileHeader::SESSION)) {
+        tcpft_logCritical("invalid session header");
+        connection->Close();
+        return;
+    }
+    if (cfg.encryption != cipher::NONE) {
+        tcpft_logCritical("encryption is not supported by sessions");
+        connection->Close();
+        return;
+    }
+    const uint32_t window = static_cast<uint32_t>(std::min<size_t>(std::max<size_t>(cfg.stream_window, 1), UINT32_MAX));
+    const uint32_t max_streams = static_cast<uint32_t>(std::min<size_t>(std::max<size_t>(cfg.max_streams, 1), UINT32_MAX));
+    char settings[FrameHeader::settings_size];
+    encodeUint(settings, window, 4);
+    encodeUint(settings + 4, max_streams, 4);
+    if (!sendFrame(*connection, FrameHeader::SETTINGS, 0, settings, sizeof(settings))) {
+        tcpft_logCritical("send failed");
+        connection->Close();
+        return;
+    }
+
+    SessionQueue items;
+    items.setCapacity(pool().capacity());
+    std::atomic<size_t> active(0);
+    SessionWriterWorker sww(items, *connection, cfg, pool().allocator(), active, st, ThreadAffinity::Select(cfg, 1));
+    std::thread swwt(std::ref(sww));
+
+    // Streams opened and not yet ended, only the window and the order of numbers are checked here.
+    std::map<uint32_t, std::shared_ptr<SessionStream>> streams;
+    uint32_t last_stream = 0;
+    bool is_closed = false;
+    std::string payload;
+    for (;;) {
+        char buf[FrameHeader::encoded_size];
+        FrameHeader frame;
+        if (!connection->ReceiveExact(buf, sizeof(buf))) {
+            break;
+        }
+        frame.Decode(buf);
+        std::map<uint32_t, std::shared_ptr<SessionStream>>::iterator it = streams.find(frame.stream);
+        SessionItem item;
+        item.type = frame.type;
+        if (frame.type == FrameHeader::DATA && it != streams.end() && frame.len > 0
+            && it->second->queued.load() + frame.len <= window) {
+            item.chunk = Chunk(frame.len, pool().allocator(), true);
+            if (!connection->ReceiveExact(item.chunk.data(), frame.len)) {
+                break;
+            }
+            item.chunk.Resize(frame.len);
+            item.stream = it->second;
+            item.stream->queued += frame.len;
+            ++st.chunks;
+            st.bytes += frame.len;
+        }
+        else if (frame.type == FrameHeader::OPEN && frame.stream > last_stream && frame.len >= FrameHeader::open_size
+                 && frame.len <= FrameHeader::open_size + FrameHeader::max_name_size && active.load() < max_streams) {
+            payload.resize(frame.len);
+            if (!connection->ReceiveExact(&payload[0], payload.size())) {
+                break;
+            }
+            std::string name = payload.substr(FrameHeader::open_size);
+            item.stream.reset(new SessionStream());
+            item.stream->id = frame.stream;
+            item.stream->size = decodeUint(payload.data(), FrameHeader::open_size);
+            item.stream->location = directory + "/" + name;
+            // The name must stay inside the directory.
+            item.stream->is_failed = name.empty() || name == "." || name == ".."
+                                     || name.find_first_of(std::string("/\\:\0", 4)) != std::string::npos;
+            if (item.stream->is_failed) {
+                tcpft_logCritical("stream ", frame.stream, ": invalid name \"", name, "\"");
+            }
+            last_stream = frame.stream;
+            streams[frame.stream] = item.stream;
+            ++active;
+        }
+        else if (frame.type == FrameHeader::END && it != streams.end() && frame.len == 0) {
+            item.stream = it->second;
+            streams.erase(it);
+        }
+        else if (frame.type == FrameHeader::CLOSE && frame.stream == 0 && frame.len == 0 && streams.empty()) {
+            is_closed = true;
+            break;
+        }
+        else {
+            tcpft_logCritical("invalid frame: type ", static_cast<int>(frame.type), ", stream ", frame.stream,
+                              ", length ", frame.len);
+            break;
+        }
+        items.PushRange(&item, &item + 1);
+    }
+    if (!is_closed) {
+        tcpft_logCritical("session closed before the end");
+    }
+    // The default item ends the session.
+    SessionItem end;
+    items.PushRange(&end, &end + 1);
+    items.Flush();
+    swwt.join();
+
+    st.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    st.chunk_size = cfg.chunk_size;
+    st.queue_depth = items.capacity();
+    st.memory_reserved = pool().allocator()->reserved();
+    st.budget_wait_us = pool().allocator()->budgetWaitTime();
+    st.is_hugepage_backed = pool().allocator()->isHugepageBacked();
+
+    tcpft_logInfo("session finished: ", st.streams, " streams, ", st.bytes, " bytes");
+    connection->Close();
+}
+
+std::unique_ptr<Connection> FISocket::AcceptTransfer(char* prologue) {
+    for (;;) {
+        std::unique_ptr<Connection> connection = _listener ? _listener->Accept() : nullptr;
+        if (!connection) {
+            return connection;
+        }
+        connection->setBusyPoll(config().busy_poll_us);
+        if (connection->ReceiveExact(prologue, 1)) {
+            return connection;
+        }
+        tcpft_logInfo("connection closed before a transfer, skipped");
+        connection->Close();
+    }
+}
+
+bool FISocket::ReceiveLocalCopy(Connection& connection, const std::string& location, const FileHeader& header) {
+    char buf[LocalCopyHeader::encoded_size];
+    LocalCopyHeader offer;
+    if (!connection.ReceiveExact(buf, sizeof(buf))) {
+        return false;
+    }
+    size_t path_size = offer.Decode(buf);
+    if (path_size > LocalCopyHeader::max_path_size) {
+        tcpft_logCritical("invalid local copy header");
+        return false;
+    }
+    offer.path.resize(path_size);
+    if (path_size > 0 && !connection.ReceiveExact(&offer.path[0], path_size)) {
+        return false;
+    }
+
+    // The sender names a file on this host, accepted only from local peers and without encryption.
+    FileIdentity source;
+    source.path = offer.path;
+    source.device = offer.device;
+    source.inode = offer.inode;
+    source.size = header.size;
+    bool is_copied = config().local_copy && config().encryption == cipher::NONE && connection.isPeerLocal()
+                     && copyLocalFile(source, location);
+    char reply = is_copied ? LocalCopyHeader::reply_copied : LocalCopyHeader::reply_declined;
+    if (connection.Send(&reply, 1) != 1) {
+        tcpft_logCritical("send failed");
+    }
+    tcpft_logInfo("local copy of \"", offer.path, "\" ", is_copied ? "done" : "declined");
+
+    if (is_copied) {
+        TransferStats& st = transferStats();
+        st.bytes = header.size;
+        st.is_local_copy = true;
+    }
+    return is_copied;
+}
+
+void FISocket::ReceiveInline(Connection& connection, const std::string& location, const FileHeader& header,
+                             const CryptoHeader& crypto, const std::string& key, const std::string& aad) {
+    std::string buf(static_cast<size_t>(header.size), '\0');
+    if (header.hasFlag(FileHeader::ENCRYPTED)) {
+        char prefix[CryptoHeader::frame_prefix_size];
+        std::string frame(buf.size() + CryptoHeader::tag_size, '\0');
+        if (!connection.ReceiveExact(prefix, sizeof(prefix)) || decodeUint(prefix, sizeof(prefix)) != header.size
+            || !connection.ReceiveExact(&frame[0], frame.size())) {
+            tcpft_logCritical("connection closed before end of file");
+            return;
+        }
+        if (!AeadCipher(static_cast<cipher>(crypto.cipher), key, false).Open(0, aad, frame.data(), buf.size(), &buf[0])) {
+            tcpft_logCritical("authentication failed");
+            return;
+        }
+    }
+    else if (!buf.empty() && !connection.ReceiveExact(&buf[0], buf.size())) {
+        tcpft_logCritical("connection closed before end of file");
+        return;
+    }
+
+    // Written in one call from the socket thread, no writer thread needed.
+    FileWriter fw;
+    openWriter(fw, location, config(), pool().allocator(), buf.size());
+    fw.Write(buf.data(), buf.size());
+    fw.Close();
+    if (fw.isFailed()) {
+        tcpft_logCritical("write failed, removing \"", location, "\"");
+        std::remove(location.c_str());
+        return;
+    }
+
+    TransferStats& st = transferStats();
+    st.bytes = buf.size();
+    st.chunks = 1;
+    st.chunk_size = buf.size();
+    tcpft_logInfo("receive inline: ", buf.size(), " bytes");
+}
+
+void FISocket::ReceiveStream(Connection& connection, const std::string& location, const FileHeader& header) {
+    const TransferConfig& cfg = config();
+    FileWriterWorker fww(location, pool(), cfg, header.hasFlag(FileHeader::SPARSE), ThreadAffinity::Select(cfg, 1));
+    std::thread fwwt(std::ref(fww));
+
+    size_t recv_size = cfg.chunk_size;
+    TransferStats& st = transferStats();
+
+    for (;;) {
+        // Received straight into a chunk of the pool allocator, the writer takes it without a copy.
+        // Out of memory budget the socket is not read, so flow control slows down the sender.
+        Chunk chunk(recv_size, pool().allocator(), true);
+        int nb = connection.Receive(chunk.data(), static_cast<int>(recv_size));
         if (nb > 0) {
-            if (nb < static_cast<int>(Chunk::size)) {
-                buf.resize(nb);
+            ++st.chunks;
+            st.bytes += nb;
+            tcpft_logInfo("receive chunk: ", st.chunks, ", size: ", nb);
+            chunk.Resize(nb);
+            pool().PushWait(std::move(chunk));
+
+            // A full read means more data is pending: read larger pieces next time.
+            if (cfg.auto_tune && static_cast<size_t>(nb) == recv_size && recv_size < cfg.max_chunk_size) {
+                recv_size = std::min(recv_size * 2, cfg.max_chunk_size);
+                tcpft_logInfo("auto-tune: receive size ", recv_size);
             }
-            ++chunk_cnt;
-            tcpft_logInfo("receive chunk: ", chunk_cnt, ", size: ", nb);
-            pool().Fit(buf);
         }
-        else if (nb == 0) {
-            fww.Finish();
+        else if (nb == 0 || !tcpft_istimeout(tcpft_lasterror())) {
             break;
         }
     }
+    pool().PushEnd();
 
-    tcpft_logInfo("receive finished");
+    st.chunk_size = recv_size;
+    st.queue_depth = pool().capacity();
+    fwwt.join();
+
+    // A sparse stream carries extents, a plain one exactly the bytes of the file.
+    if (!fww.isComplete() || (!header.hasFlag(FileHeader::SPARSE) && st.bytes != header.size)) {
+        tcpft_logCritical("file truncated, invalid or not written, removing \"", location, "\"");
+        std::remove(location.c_str());
+    }
+}
+
+void FISocket::ReceiveEncryptedStream(Connection& connection, const std::string& location, const FileHeader& header,
+                                      const CryptoHeader& crypto, const std::string& key, const std::string& aad) {
+    const TransferConfig& cfg = config();
+    // Frames are decrypted by the crypto pipeline from a pool of frames into the writer pool.
+    Pool frames;
+    frames.setAllocator(pool().allocator());
+    setQueueDepth(frames, pool().capacity());
+    CryptoPipeline pipeline(cfg, crypto, key, aad, false, frames, pool());
+    pipeline.Start();
+
+    FileWriterWorker fww(location, pool(), cfg, header.hasFlag(FileHeader::SPARSE), ThreadAffinity::Select(cfg, 1));
+    std::thread fwwt(std::ref(fww));
+    TransferStats& st = transferStats();
+    uint64_t plain_bytes = 0;
+    // The sender seals at most one chunk per frame, also while auto-tuning.
+    const uint64_t max_frame_len = std::max(cfg.chunk_size, cfg.max_chunk_size);
+
+    while (!pipeline.isFailed()) {
+        char prefix[CryptoHeader::frame_prefix_size];
+        if (!connection.ReceiveExact(prefix, sizeof(prefix))) {
+            break;
+        }
+        uint64_t len = decodeUint(prefix, sizeof(prefix));
+        if (len == 0 || len > max_frame_len || len > header.size - plain_bytes) {
+            tcpft_logCritical("invalid frame length: ", len);
+            break;
+        }
+
+        Chunk frame(static_cast<size_t>(len) + CryptoHeader::tag_size, pool().allocator(), true);
+        if (!connection.ReceiveExact(frame.data(), frame.capacity())) {
+            break;
+        }
+        frame.Resize(frame.capacity());
+        plain_bytes += len;
+        ++st.chunks;
+        st.bytes += sizeof(prefix) + frame.Count();
+        tcpft_logInfo("receive frame: ", st.chunks, ", size: ", len);
+        frames.PushWait(std::move(frame));
+    }
+    frames.PushEnd();
+    pipeline.Join();
+
+    st.chunk_size = cfg.chunk_size;
+    st.queue_depth = pool().capacity();
     fwwt.join();
+
+    if (pipeline.isFailed() || plain_bytes != header.size || !fww.isComplete()) {
+        tcpft_logCritical("authentication failed or file truncated, removing \"", location, "\"");
+        std::remove(location.c_str());
+    }
 }
 
+#ifdef TCPFT_HAS_COROUTINES
+Task<TransferStats> FISocket::ReceiveAsync(EventLoop& loop, std::string location) {
+    TransferStats st;
+    // The data must go through the listening side's socket to be polled by the loop.
+    if (!_listener || config().channel == transport::SHARED_MEMORY) {
+        tcpft_logCritical("not listening or transport not supported by the asynchronous API");
+        co_return st;
+    }
+    AsyncListenerScope listener_scope(_listener->sock(), _async_receives);
+    char prologue[FileHeader::encoded_size];
+    tcpft_sock sock = static_cast<tcpft_sock>(-1);
+    // Connections closed before their first byte (e.g. idle ones of a ConnectionPool) are skipped.
+    for (;;) {
+        sock = co_await loop.Accept(_listener->sock());
+        if (sock == static_cast<tcpft_sock>(-1) || co_await loop.ReceiveExact(sock, prologue, 1)) {
+            break;
+        }
+        tcpft_closesocket(sock);
+    }
+    if (sock == static_cast<tcpft_sock>(-1)) {
+        tcpft_logCritical("accept failed");
+        co_return st;
+    }
+    AsyncSocketScope socket_scope(sock);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    tcpft_logInfo("receive ", "\"", location, "\" starting...");
+
+    FileHeader header;
+    bool is_valid = co_await loop.ReceiveExact(sock, prologue + 1, sizeof(prologue) - 1) && header.Decode(prologue);
+    if (is_valid && header.hasFlag(FileHeader::LOCAL_COPY)) {
+        // Local copies are declined, the sender starts over with a regular header.
+        char buf[LocalCopyHeader::encoded_size];
+        LocalCopyHeader offer;
+        char reply = LocalCopyHeader::reply_declined;
+        is_valid = co_await loop.ReceiveExact(sock, buf, sizeof(buf));
+        offer.path.resize(is_valid ? offer.Decode(buf) : 0);
+        is_valid = is_valid && offer.path.size() <= LocalCopyHeader::max_path_size
+                   && (offer.path.empty() || co_await loop.ReceiveExact(sock, &offer.path[0], offer.path.size()))
+                   && co_await loop.Send(sock, &reply, 1)
+                   && co_await loop.ReceiveExact(sock, prologue, sizeof(prologue)) && header.Decode(prologue)
+                   && !header.hasFlag(FileHeader::LOCAL_COPY);
+    }
+    if (!is_valid || header.hasFlag(FileHeader::SESSION)) {
+        tcpft_logCritical("invalid file header");
+        co_return st;
+    }
+    if (header.hasFlag(FileHeader::ENCRYPTED) || config().encryption != cipher::NONE) {
+        tcpft_logCritical("encryption is not supported by the asynchronous API");
+        co_return st;
+    }
+    if (header.hasFlag(FileHeader::SPARSE)) {
+        tcpft_logCritical("sparse files are not supported by the asynchronous API");
+        co_return st;
+    }
+
+    FileWriter fw;
+    openWriter(fw, location, config(), nullptr, header.size);
+    std::string buf(static_cast<size_t>(std::min<uint64_t>(config().chunk_size, std::max<uint64_t>(header.size, 1))), '\0');
+    while (st.bytes < header.size) {
+        int nb = co_await loop.Receive(sock, &buf[0], static_cast<size_t>(std::min<uint64_t>(buf.size(), header.size - st.bytes)));
+        if (nb <= 0) {
+            break;
+        }
+        fw.Write(buf.data(), nb);
+        st.bytes += nb;
+        ++st.chunks;
+    }
+    fw.Close();
+    if (st.bytes != header.size || fw.isFailed()) {
+        tcpft_logCritical("file truncated or not written, removing \"", location, "\"");
+        std::remove(location.c_str());
+    }
+
+    st.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    st.chunk_size = buf.size();
+    transferStats() = st;
+    tcpft_logInfo("receive finished");
+    co_return st;
+}
+#endif
+
 int FISocket::Close() {
-    return _server.Close();
-}
\ No newline at end of file
+    return _listener ? _listener->Close() : 0;
+}
@@ -1,28 +1,60 @@
 #include "fsocket.h"
 #include "worker.h"
 #include "file.h"
+#include "tuner.h"
+#include "affinity.h"
+#include "protocol.h"
+#include "crypto.h"
+#include "connection_pool.h"
 #include "log.h"
 
+#include <chrono>
+#include <iterator>
+#include <memory>
+#include <vector>
+
 /**
  * @brief Worker that reads a file and fills a Pool with its content.
  */
 class FileReaderWorker : public Worker {
 public:
+    // Size of a single read from the file, split into chunks afterwards.
+    static constexpr size_t read_block_size = 1024 * 1024;
+
     /**
      * @brief Constructs a FileReaderWorker.
      *
      * @param location Path to the input file.
      * @param pool Reference to the Pool to fill.
+     * @param tuner Source of the current chunk size.
+     * @param prefetch_depth Number of blocks read ahead by the disk.
+     * @param extents Data extents to send as a sparse stream, nullptr to send the whole file.
+     * @param cpu CPU to pin the worker thread to, -1 for none.
+     * @param tracer Tracer of the worker thread, nullptr for none.
      */
-    explicit FileReaderWorker(const std::string& location, Pool& pool)
-        : _location(location), _pool(pool), _is_finished(false)
+    explicit FileReaderWorker(const std::string& location, Pool& pool, const AutoTuner& tuner,
+                              size_t prefetch_depth, const std::vector<FileExtent>* extents, int cpu = -1,
+                              Tracer* tracer = nullptr)
+        : _location(location), _pool(pool), _tuner(tuner), _prefetch_depth(prefetch_depth), _extents(extents),
+          _cpu(cpu), _tracer(tracer), _is_finished(false)
     {}
 
     void Work() override {
-        // Create a terminator chunk with a '\0' character.
+        if (_extents != nullptr) {
+            WorkSparse();
+            return;
+        }
         std::string buf;
-        _fr.Read(buf);
-        _pool.Fit(buf);
+        size_t nb = 0;
+        do {
+            // The chunk size may change between reads when auto-tuning is enabled.
+            size_t chunk_size = _tuner.chunkSize();
+            buf.resize(std::max(read_block_size, chunk_size));
+            nb = _fr.Read(&buf[0], buf.size());
+            _pool.Fit(buf.data(), nb, chunk_size);
+        } while (nb == buf.size());
+        // Empty terminator chunk marks the end of the file.
+        _pool.PushEnd();
     }
 
     /**
@@ -37,51 +69,400 @@ public:
 protected:
     void onPrepareWork() override {
         _is_finished.store(false);
-        _fr.Open(_location);
+        _affinity.reset(new ThreadAffinity(_cpu));
+        _trace.reset(new TraceThread(_tracer, "file reader"));
+        _fr.OpenSequential(_location, _prefetch_depth);
     }
 
     void onFinishWork() override {
         _fr.Close();
+        _trace.reset();
+        _affinity.reset();
         _is_finished.store(true);
     }
 
 private:
+    // Sends every extent as its record followed by its data, then the end record.
+    void WorkSparse() {
+        const size_t prefix_size = ExtentHeader::encoded_size;
+        std::string buf;
+        for (const FileExtent& extent : *_extents) {
+            _fr.Seek(extent.offset);
+            // The record goes out in front of the first block of the extent.
+            size_t prefix = prefix_size;
+            uint64_t left = extent.len;
+            while (left > 0) {
+                size_t chunk_size = _tuner.chunkSize();
+                buf.resize(std::max(read_block_size, chunk_size) + prefix_size);
+                if (prefix > 0) {
+                    ExtentHeader header;
+                    header.offset = extent.offset;
+                    header.len = extent.len;
+                    header.Encode(&buf[0]);
+                }
+                size_t nb = _fr.Read(&buf[prefix], static_cast<size_t>(std::min<uint64_t>(left, buf.size() - prefix)));
+                if (nb == 0) {
+                    // The stream stays short, the receiver discards the file.
+                    tcpft_logCritical("file shrank during transfer at offset ", extent.offset + extent.len - left);
+                    _pool.PushEnd();
+                    return;
+                }
+                _pool.Fit(buf.data(), prefix + nb, chunk_size);
+                left -= nb;
+                prefix = 0;
+            }
+        }
+        char record[ExtentHeader::encoded_size];
+        ExtentHeader end;
+        end.offset = _fr.size();
+        end.Encode(record);
+        _pool.Fit(record, sizeof(record), _tuner.chunkSize());
+        _pool.PushEnd();
+    }
+
     const std::string _location;
     Pool& _pool;
+    const AutoTuner& _tuner;
+    const size_t _prefetch_depth;
+    const std::vector<FileExtent>* _extents;
+    const int _cpu;
+    Tracer* _tracer;
+    std::unique_ptr<ThreadAffinity> _affinity;
+    std::unique_ptr<TraceThread> _trace;
     FileReader _fr;
     std::atomic<bool> _is_finished;
 };
 
+// Bound to a reference by std::max(), needs a definition before C++17.
+constexpr size_t FileReaderWorker::read_block_size;
+
 status FOSocket::Connect(const std::string& dst_addr, const uint16_t dst_port) {
-    return _client.Connect(dst_addr, dst_port);
+    status result = status::OK;
+    if (config().connection_pool != nullptr) {
+        result = config().connection_pool->Acquire(dst_addr, dst_port, _connection);
+    }
+    else {
+        _connection = Connection::Create(config());
+        if (!_connection) {
+            return status::TRANSPORT_NOT_SUPPORTED;
+        }
+        result = _connection->Connect(dst_addr, dst_port);
+    }
+    if (result == status::OK) {
+        _connection->setBusyPoll(config().busy_poll_us);
+    }
+    return result;
 }
 
 void FOSocket::Transmit(const std::string& location) {
-    FileReaderWorker frw(location, pool());
-    std::thread frwt(std::ref(frw));
-    size_t chunk_cnt = 0;
+    if (!_connection) {
+        tcpft_logCritical("not connected");
+        return;
+    }
+    Prepare();
+    ThreadAffinity affinity(ThreadAffinity::Select(config(), 0));
+    TraceThread trace(config().tracer, "sender socket");
+    TransferStats& st = transferStats();
+    st = TransferStats();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
     tcpft_logInfo("transmit ", "\"", location, "\" starting...");
 
-    while (!(frw.isFinished() && pool().isEmpty())) {
-        pool().waitForNotEmpty();
-        Chunk chunk = pool().Pop();
+    if (config().local_copy && config().encryption == cipher::NONE && _connection->isPeerLocal()
+        && TransmitLocalCopy(location)) {
+        st.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        tcpft_logInfo("transmit finished");
+        _connection->Close();
+        return;
+    }
+
+    FileReader fr;
+    fr.OpenSequential(location, config().prefetch_depth);
+    FileHeader header;
+    header.size = fr.size();
+    if (header.size <= config().small_file_threshold) {
+        header.flags |= FileHeader::INLINE;
+    }
 
-        std::string buf;
-        while (!chunk.isEmpty()) {
-            buf.push_back(chunk.Pop());
+    // A file with holes is sent as its data extents, size becomes the length of the records.
+    std::vector<FileExtent> extents;
+    if (config().sparse && !header.hasFlag(FileHeader::INLINE)) {
+        extents = fr.dataExtents();
+        uint64_t data_bytes = 0;
+        for (const FileExtent& extent : extents) {
+            data_bytes += extent.len;
         }
+        if (data_bytes < header.size) {
+            header.flags |= FileHeader::SPARSE;
+            st.hole_bytes = header.size - data_bytes;
+            header.size = data_bytes + (extents.size() + 1) * ExtentHeader::encoded_size;
+            tcpft_logInfo("sparse: ", extents.size(), " extents, ", data_bytes, " data bytes");
+        }
+    }
 
-        ++chunk_cnt;
-        tcpft_logInfo("send chunk: ", chunk_cnt, ", size: ", buf.size());
-        _client.Send(&buf[0], buf.size(), 0);
+    CryptoHeader crypto;
+    std::string key;
+    if (config().encryption != cipher::NONE) {
+        header.flags |= FileHeader::ENCRYPTED;
+        crypto.cipher = static_cast<uint8_t>(AeadCipher::Resolve(config().encryption));
+        AeadCipher::RandomSalt(crypto);
+        key = AeadCipher::DeriveKey(config().key, crypto);
     }
 
+    if (header.hasFlag(FileHeader::INLINE)) {
+        TransmitInline(fr, header, crypto, key);
+    }
+    else {
+        fr.Close();
+        TransmitStream(location, header, crypto, key, extents);
+    }
+
+    st.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    st.memory_reserved = pool().allocator()->reserved();
+    st.budget_wait_us = pool().allocator()->budgetWaitTime();
+    st.is_hugepage_backed = pool().allocator()->isHugepageBacked();
+
     tcpft_logInfo("transmit finished");
+    _connection->Close();
+}
+
+bool FOSocket::TransmitLocalCopy(const std::string& location) {
+    FileIdentity source;
+    if (!source.Load(location)) {
+        return false;
+    }
+    FileHeader header;
+    header.flags = FileHeader::LOCAL_COPY;
+    header.size = source.size;
+    LocalCopyHeader offer;
+    offer.device = source.device;
+    offer.inode = source.inode;
+    offer.path = source.path;
+    std::string prologue = encodePrologue(header, CryptoHeader());
+    offer.Encode(prologue);
+
+    tcpft_iovec iov = { prologue.data(), prologue.size() };
+    char reply = LocalCopyHeader::reply_declined;
+    if (_connection->SendV(&iov, 1) < 0) {
+        tcpft_logCritical("send failed");
+        return false;
+    }
+    // The receiver copies the whole file before it replies.
+    int nb = 0;
+    do {
+        nb = _connection->Receive(&reply, 1);
+    } while (nb < 0 && tcpft_istimeout(tcpft_lasterror()));
+    if (nb != 1 || reply != LocalCopyHeader::reply_copied) {
+        tcpft_logInfo("local copy declined, sending the data");
+        return false;
+    }
+
+    TransferStats& st = transferStats();
+    st.bytes = source.size;
+    st.is_local_copy = true;
+    tcpft_logInfo("local copy: ", source.size, " bytes copied by the receiver");
+    return true;
+}
+
+void FOSocket::TransmitInline(FileReader& fr, const FileHeader& header, const CryptoHeader& crypto,
+                              const std::string& key) {
+    std::string buf(static_cast<size_t>(header.size), '\0');
+    size_t nb = buf.empty() ? 0 : fr.Read(&buf[0], buf.size());
+    fr.Close();
+    if (nb != buf.size()) {
+        // Nothing is sent, the header would announce more data than follows.
+        tcpft_logCritical("file changed during the transfer");
+        return;
+    }
+
+    std::string prologue = encodePrologue(header, crypto);
+    if (header.hasFlag(FileHeader::ENCRYPTED)) {
+        // The whole file is a single frame with sequence number 0.
+        const size_t prefix = CryptoHeader::frame_prefix_size;
+        std::string frame(prefix + nb + CryptoHeader::tag_size, '\0');
+        encodeUint(&frame[0], nb, prefix);
+        if (!AeadCipher(static_cast<cipher>(crypto.cipher), key, true).Seal(0, prologue, buf.data(), nb, &frame[prefix])) {
+            tcpft_logCritical("encryption failed");
+            return;
+        }
+        buf.swap(frame);
+    }
+
+    tcpft_iovec iov[] = { { prologue.data(), prologue.size() }, { buf.data(), buf.size() } };
+    if (_connection->SendV(iov, buf.empty() ? 1 : 2) < 0) {
+        tcpft_logCritical("send failed");
+        return;
+    }
+
+    TransferStats& st = transferStats();
+    st.bytes = buf.size();
+    st.chunks = 1;
+    st.chunk_size = buf.size();
+    tcpft_logInfo("send inline: ", buf.size(), " bytes");
+}
+
+void FOSocket::TransmitStream(const std::string& location, const FileHeader& header, const CryptoHeader& crypto,
+                              const std::string& key, const std::vector<FileExtent>& extents) {
+    std::string prologue = encodePrologue(header, crypto);
+    tcpft_iovec prologue_iov = { prologue.data(), prologue.size() };
+    bool is_failed = _connection->SendV(&prologue_iov, 1) < 0;
+    if (is_failed) {
+        tcpft_logCritical("send failed");
+        return;
+    }
+
+    // With encryption the chunks go through the crypto pipeline into a second pool of frames.
+    Pool frames;
+    frames.setAllocator(pool().allocator());
+    setQueueDepth(frames, pool().capacity());
+    std::unique_ptr<CryptoPipeline> pipeline;
+    if (header.hasFlag(FileHeader::ENCRYPTED)) {
+        pipeline.reset(new CryptoPipeline(config(), crypto, key, prologue, true, pool(), frames));
+        pipeline->Start();
+    }
+    Pool& source = pipeline ? frames : pool();
+
+    AutoTuner tuner(config());
+    FileReaderWorker frw(location, pool(), tuner, config().prefetch_depth,
+                         header.hasFlag(FileHeader::SPARSE) ? &extents : nullptr, ThreadAffinity::Select(config(), 1),
+                         config().tracer);
+    std::thread frwt(std::ref(frw));
+    TransferStats& st = transferStats();
+
+    // Chunks are taken in batches under one lock and sent with one vectored call.
+    std::vector<Chunk> batch;
+    std::vector<tcpft_iovec> iov;
+    bool is_end = false;
+    while (!is_end) {
+        // The chunks of the last batch are freed before waiting, they may be needed by the reader.
+        batch.clear();
+        source.waitForNotEmpty();
+        source.PopRange(std::back_inserter(batch), source.batchSize());
+        iov.clear();
+        for (const Chunk& chunk : batch) {
+            if (chunk.isEmpty()) {
+                is_end = true;
+                break;
+            }
+            iov.push_back(tcpft_iovec{ chunk.data(), chunk.Count() });
+        }
+        if (!is_failed && pipeline && pipeline->isFailed()) {
+            // The stream is cut short, the receiver drops the incomplete file.
+            tcpft_logCritical("encryption failed");
+            is_failed = true;
+        }
+        if (is_failed || iov.empty()) {
+            // Drain the pool so that the reader is not blocked on a full pool.
+            continue;
+        }
+
+        int64_t sent = _connection->SendV(iov.data(), iov.size());
+        if (sent < 0) {
+            tcpft_logCritical("send failed");
+            is_failed = true;
+            continue;
+        }
+        st.chunks += iov.size();
+        st.bytes += sent;
+        tcpft_logInfo("send chunks: ", st.chunks, ", size: ", sent);
+
+        tuner.onTransferred(static_cast<size_t>(sent));
+        if (tuner.isSampleDue() && tuner.Update(_connection->rtt())) {
+            setQueueDepth(pool(), tuner.queueDepth());
+            setQueueDepth(frames, tuner.queueDepth());
+            tcpft_logInfo("auto-tune: chunk size ", tuner.chunkSize(), ", queue depth ", tuner.queueDepth(),
+                          ", rtt ", tuner.rtt(), " us");
+        }
+    }
+
+    st.chunk_size = tuner.chunkSize();
+    st.queue_depth = tuner.queueDepth();
+    st.rtt_us = tuner.rtt();
+    st.prefetch_depth = config().prefetch_depth;
     frwt.join();
-    _client.Close();
+    if (pipeline) {
+        pipeline->Join();
+    }
+}
+
+#ifdef TCPFT_HAS_COROUTINES
+Task<status> FOSocket::ConnectAsync(EventLoop& loop, std::string dst_addr, uint16_t dst_port) {
+    _loop = &loop;
+    _connection = Connection::Create(config());
+    if (!_connection) {
+        co_return status::TRANSPORT_NOT_SUPPORTED;
+    }
+    // Transports without a socket for the event loop refuse non-blocking connects.
+    status st = _connection->Connect(dst_addr, dst_port, true);
+    if (st != status::OK) {
+        co_return st;
+    }
+    if (!co_await loop.Connect(_connection->sock())) {
+        co_return status::SOCKET_CONNECT_FAILED;
+    }
+    co_return status::OK;
+}
+
+Task<TransferStats> FOSocket::TransmitAsync(std::string location) {
+    if (_loop == nullptr || !_connection) {
+        throw std::runtime_error("not connected by ConnectAsync()");
+    }
+    if (config().encryption != cipher::NONE) {
+        throw std::runtime_error("encryption is not supported by the asynchronous API");
+    }
+    TransferStats st;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    tcpft_logInfo("transmit ", "\"", location, "\" starting...");
+
+    FileReader fr;
+    fr.OpenSequential(location, config().prefetch_depth);
+    FileHeader header;
+    header.size = fr.size();
+    if (header.size <= config().small_file_threshold) {
+        header.flags |= FileHeader::INLINE;
+    }
+
+    // The header goes out with the first block, a small file is sent whole.
+    std::string prologue = encodePrologue(header, CryptoHeader());
+    size_t block_size = header.hasFlag(FileHeader::INLINE) ? static_cast<size_t>(header.size) : config().chunk_size;
+    std::string buf(prologue.size() + block_size, '\0');
+    memcpy(&buf[0], prologue.data(), prologue.size());
+    size_t offset = prologue.size();
+
+    for (;;) {
+        size_t nb = buf.size() > offset ? fr.Read(&buf[offset], buf.size() - offset) : 0;
+        if (offset + nb == 0) {
+            break;
+        }
+        if (!co_await _loop->Send(_connection->sock(), buf.data(), offset + nb)) {
+            tcpft_logCritical("send failed");
+            break;
+        }
+        st.bytes += nb;
+        st.chunks += nb > 0 ? 1 : 0;
+        if (offset + nb < buf.size()) {
+            break;
+        }
+        offset = 0;
+        // Let the other transfers run between blocks.
+        co_await _loop->Yield();
+    }
+    fr.Close();
+    _connection->Close();
+
+    st.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    st.chunk_size = block_size;
+    st.prefetch_depth = config().prefetch_depth;
+    transferStats() = st;
+    tcpft_logInfo("transmit finished");
+    co_return st;
 }
+#endif
 
 int FOSocket::Close() {
-    return _client.Close();
-}
\ No newline at end of file
+    return _connection ? _connection->Close() : 0;
+}
@@ -1,10 +1,20 @@
 #pragma once
 
 #include "buffer.h"
-#include "tcp_client_server.h"
+#include "memory.h"
+#include "config.h"
+#include "stats.h"
+#include "protocol.h"
+#include "transport.h"
+#include "event_loop.h"
 
 #include <stdint.h>
+#include <memory>
 #include <string>
+#include <vector>
+
+class FileReader;
+struct FileExtent;
 
 /**
  * @brief Socket-based file receiver/transmitter base class.
@@ -21,17 +31,65 @@ public:
      */
     virtual int Close() = 0;
 
+    /**
+     * @brief Sets the configuration used by the following transfers.
+     *
+     * @param config Transfer configuration.
+     */
+    void setConfig(const TransferConfig& config) { _config = config; }
+
+    const TransferConfig& config() const { return _config; }
+
+    /**
+     * @brief Returns the counters of the last transfer.
+     *
+     * @return const TransferStats& Transfer statistics.
+     */
+    const TransferStats& stats() const { return _stats; }
+
 protected:
     Pool& pool() { return _pool; }
+    TransferStats& transferStats() { return _stats; }
+
+    /**
+     * @brief Applies the configuration to the pool and its chunk allocator.
+     *
+     * Called at the start of every transfer, when no chunks are outstanding.
+     */
+    void Prepare() {
+        _allocator.Configure(_config.use_hugepages, _config.numa_node);
+        _allocator.setBudget(_config.memory_budget, _config.memory_minimum);
+        _pool.setAllocator(&_allocator);
+        setQueueDepth(_pool, _config.queue_depth);
+    }
+
+    /**
+     * @brief Sets the capacity of a pool, with batch_wakeups its watermarks and
+     * with busy_poll_us the spin time of its consumers.
+     *
+     * @param pool Pool to resize.
+     * @param depth Maximum number of chunks.
+     */
+    void setQueueDepth(Pool& pool, size_t depth) const {
+        pool.setCapacity(depth);
+        if (_config.batch_wakeups) {
+            pool.setWatermarks(depth / 4, depth - depth / 4);
+        }
+        pool.setSpinTime(_config.busy_poll_us);
+    }
 
 private:
+    // Declared before the pool: chunks must be released before their allocator.
+    ChunkAllocator _allocator;
     Pool _pool;
+    TransferConfig _config;
+    TransferStats _stats;
 };
 
 /**
  * @brief Socket-based file receiver.
  *
- * Receives data over TCP and writes it to a file using a FileWriterWorker.
+ * Receives data over a Connection and writes it to a file using a FileWriterWorker.
  */
 class FISocket : public FSocket {
 public:
@@ -39,10 +97,12 @@ public:
     ~FISocket() { Close(); }
 
     /**
-     * @brief Initializes the server socket.
+     * @brief Initializes the server socket of the configured transport.
      *
-     * @param src_addr Source IP address.
-     * @param src_port Source port.
+     * Call setConfig() first, TransferConfig::channel selects the transport.
+     *
+     * @param src_addr Source IP address, or the path of the socket file.
+     * @param src_port Source port, ignored for socket files.
      * @return status Error status.
      */
     status Init(const std::string& src_addr, const uint16_t src_port);
@@ -54,6 +114,35 @@ public:
      */
     void Receive(const std::string& location);
 
+    /**
+     * @brief Receives the files of a session opened by FOSession::Connect().
+     *
+     * Each file is written into the directory under the name given by the
+     * sender. Returns when the sender closes the session or the connection
+     * fails, incomplete files are removed. stats() counts the whole session.
+     *
+     * @param directory Directory of the output files.
+     */
+    void ReceiveSession(const std::string& directory);
+
+#ifdef TCPFT_HAS_COROUTINES
+    /**
+     * @brief Accepts a connection and receives a file without blocking the thread.
+     *
+     * Driven by the event loop, several receives may wait on one server socket.
+     * The server socket is non-blocking while they run, Receive() may use it
+     * again once they have finished.
+     * The data goes from the socket to the file through a single buffer of
+     * chunk_size bytes. Encrypted transfers and the shared-memory transport
+     * are not supported and rejected.
+     *
+     * @param loop Event loop running the transfer.
+     * @param location Path to the output file.
+     * @return Task<TransferStats> Counters of this transfer, also stored in stats().
+     */
+    Task<TransferStats> ReceiveAsync(EventLoop& loop, std::string location);
+#endif
+
     /**
      * @brief Closes the server socket.
      *
@@ -62,13 +151,27 @@ public:
     int Close() override;
 
 private:
-    TCPServer _server;
+    // Accepts a connection and receives the first byte of its header into
+    // prologue, skipping connections closed unused (e.g. by a ConnectionPool).
+    std::unique_ptr<Connection> AcceptTransfer(char* prologue);
+    bool ReceiveLocalCopy(Connection& connection, const std::string& location, const FileHeader& header);
+    void ReceiveInline(Connection& connection, const std::string& location, const FileHeader& header,
+                       const CryptoHeader& crypto, const std::string& key, const std::string& aad);
+    void ReceiveStream(Connection& connection, const std::string& location, const FileHeader& header);
+    void ReceiveEncryptedStream(Connection& connection, const std::string& location, const FileHeader& header,
+                                const CryptoHeader& crypto, const std::string& key, const std::string& aad);
+
+    std::unique_ptr<Listener> _listener;
+    // Running ReceiveAsync() calls, the listener is non-blocking while there are any.
+    size_t _async_receives = 0;
 };
 
 /**
  * @brief Socket-based file transmitter.
  *
- * Reads a file and sends its data over TCP using a FileReaderWorker.
+ * Reads a file and sends its data over a Connection using a FileReaderWorker.
+ * Files up to TransferConfig::small_file_threshold are sent inline with the
+ * header in a single vectored send, without the worker thread.
  */
 class FOSocket : public FSocket {
 public:
@@ -76,10 +179,14 @@ public:
     ~FOSocket() { Close(); }
 
     /**
-     * @brief Connects to the destination server.
+     * @brief Connects to the destination server over the configured transport.
      *
-     * @param dst_addr Destination IP address.
-     * @param dst_port Destination port.
+     * Call setConfig() first, TransferConfig::channel selects the transport.
+     * With TransferConfig::connection_pool an idle connection of the pool is
+     * taken instead, if there is one.
+     *
+     * @param dst_addr Destination IP address, or the path of the socket file.
+     * @param dst_port Destination port, ignored for socket files.
      * @return status Error status.
      */
     status Connect(const std::string& dst_addr, const uint16_t dst_port);
@@ -91,6 +198,33 @@ public:
      */
     void Transmit(const std::string& location);
 
+#ifdef TCPFT_HAS_COROUTINES
+    /**
+     * @brief Connects to the destination server without blocking the thread.
+     *
+     * The shared-memory transport is not supported.
+     *
+     * @param loop Event loop running the following asynchronous transfer.
+     * @param dst_addr Destination IP address.
+     * @param dst_port Destination port.
+     * @return Task<status> Error status.
+     */
+    Task<status> ConnectAsync(EventLoop& loop, std::string dst_addr, uint16_t dst_port);
+
+    /**
+     * @brief Transmits a file without blocking the thread, after ConnectAsync().
+     *
+     * The file is read in blocks of chunk_size bytes (with prefetch, see
+     * TransferConfig::prefetch_depth) into a single buffer, each block is sent
+     * as soon as the socket accepts it. Encryption is not supported.
+     *
+     * @param location Path to the input file.
+     * @return Task<TransferStats> Counters of this transfer, also stored in stats().
+     * @throws std::runtime_error if not connected asynchronously or encryption is enabled.
+     */
+    Task<TransferStats> TransmitAsync(std::string location);
+#endif
+
     /**
      * @brief Closes the client socket.
      *
@@ -99,5 +233,13 @@ public:
     int Close() override;
 
 private:
-    TCPClient _client;
+    bool TransmitLocalCopy(const std::string& location);
+    void TransmitInline(FileReader& fr, const FileHeader& header, const CryptoHeader& crypto, const std::string& key);
+    void TransmitStream(const std::string& location, const FileHeader& header, const CryptoHeader& crypto,
+                        const std::string& key, const std::vector<FileExtent>& extents);
+
+    std::unique_ptr<Connection> _connection;
+#ifdef TCPFT_HAS_COROUTINES
+    EventLoop* _loop = nullptr;
+#endif
 };
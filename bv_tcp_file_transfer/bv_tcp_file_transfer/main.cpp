@@ -10,22 +10,61 @@
 #include <atomic>
 #include <thread>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <cstdlib>
+#include <memory>
 
 #include "tcpft.h"
+#include "wan_proxy.h"
+
+namespace {
+    const char* const address = "127.0.0.1";
+    // The receiver listens on receiver_port, the proxy (if any) on proxy_port.
+    const uint16_t receiver_port = 55055;
+    const uint16_t proxy_port = 55056;
+    // Socket file of the receiver with the Unix domain socket and shared memory transports.
+    const char* const socket_path = "bv_tcp_file_transfer.sock";
+    // Busy-poll time of the latency comparison if --busy-poll-us is not given.
+    const uint32_t default_busy_poll_us = 50;
+}
+
+/**
+ * @brief Options of a benchmark run, parsed from the command line.
+ */
+struct BenchOptions {
+    std::string in_path = ".\\test_in.txt";
+    std::string out_path = ".\\test_out.txt";
+    TransferConfig config;
+    WanProfile wan;
+    bool use_proxy = false;
+    // Limit of the memory budget shared by the sender and the receiver, 0 for none.
+    size_t memory_budget = 0;
+    // Idle connections the sender keeps to the receiver, 0 for no pool.
+    size_t connection_pool = 0;
+    // Chrome trace-event file of the transfer, empty for none.
+    std::string trace_path;
+    // Transfers of the latency comparison of the default and busy-poll modes, 0 for a single transfer.
+    size_t latency_runs = 0;
+};
 
 /**
  * @brief Sender function.
  *
- * Reads a file and transmits it over TCP.
+ * Reads a file and transmits it over the configured transport.
  *
  * @param file_path Path to the input file.
+ * @param config Transfer configuration.
+ * @param port Port to connect to.
  */
-void sender(const std::string& file_path) {
+void sender(const std::string& file_path, const TransferConfig& config, uint16_t port) {
     try {
         FOSocket sock;
-        // Connect to server at 127.0.0.1:55055
-        sock.Connect("127.0.0.1", 55055);
+        sock.setConfig(config);
+        if (sock.Connect(config.channel == transport::TCP ? address : socket_path, port) != status::OK) {
+            tcpft_logFatal("connect failed");
+            return;
+        }
         sock.Transmit(file_path);
         sock.Close();
     }
@@ -37,15 +76,13 @@ void sender(const std::string& file_path) {
 /**
  * @brief Receiver function.
  *
- * Accepts a TCP connection and receives a file.
+ * Accepts a connection on an initialized socket and receives a file.
  *
+ * @param sock Socket initialized with FISocket::Init().
  * @param file_path Path to the output file.
  */
-void receiver(const std::string& file_path) {
+void receiver(FISocket& sock, const std::string& file_path) {
     try {
-        FISocket sock;
-        // Initialize server on 127.0.0.1:55055
-        sock.Init("127.0.0.1", 55055);
         sock.Receive(file_path);
         sock.Close();
     }
@@ -54,6 +91,73 @@ void receiver(const std::string& file_path) {
     }
 }
 
+/**
+ * @brief Measures the latency of back-to-back transfers.
+ *
+ * The sender starts a transfer once the previous one was received; the
+ * latency of a transfer runs from the sender's Connect() to the end of the
+ * receiver's Receive().
+ *
+ * @param sock Receiver socket initialized with FISocket::Init(), left open.
+ * @param options Benchmark options: input and output files.
+ * @param config Configuration of both sides.
+ * @param port Port to connect to.
+ * @param count Number of transfers.
+ * @return std::vector<double> Sorted latencies in microseconds.
+ */
+std::vector<double> measureLatency(FISocket& sock, const BenchOptions& options, const TransferConfig& config,
+                                   uint16_t port, size_t count) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t received = 0;
+    std::chrono::steady_clock::time_point received_at;
+
+    sock.setConfig(config);
+    std::thread rt([&] {
+        for (size_t idx = 0; idx < count; ++idx) {
+            // The listener stays open for the next transfer.
+            try {
+                sock.Receive(options.out_path);
+            }
+            catch (const std::runtime_error& e) {
+                tcpft_logFatal(e.what());
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            received_at = std::chrono::steady_clock::now();
+            ++received;
+            cv.notify_one();
+        }
+    });
+
+    std::vector<double> latencies;
+    latencies.reserve(count);
+    for (size_t idx = 0; idx < count; ++idx) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        sender(options.in_path, config, port);
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return received > idx; });
+        latencies.push_back(std::chrono::duration<double, std::micro>(received_at - start).count());
+    }
+    rt.join();
+    std::sort(latencies.begin(), latencies.end());
+    return latencies;
+}
+
+/**
+ * @brief Prints the median and tail of sorted latencies.
+ *
+ * @param mode Name of the measured mode.
+ * @param latencies Sorted latencies in microseconds, not empty.
+ */
+void printLatency(const std::string& mode, const std::vector<double>& latencies) {
+    auto percentile = [&latencies](double fraction) {
+        return latencies[std::min(latencies.size() - 1, static_cast<size_t>(fraction * latencies.size()))];
+    };
+    std::cout << mode << ": " << latencies.size() << " transfers, latency p50: " << std::fixed << std::setprecision(1)
+              << percentile(0.5) << " us, p99: " << percentile(0.99) << " us, p999: " << percentile(0.999) << " us"
+              << std::endl;
+}
+
 /**
  * @brief Compares two files for equality.
  *
@@ -101,23 +205,222 @@ bool compareFiles(const std::string& file1, const std::string& file2) {
     return true;
 }
 
+/**
+ * @brief Parses the command line.
+ *
+ * Options: --in PATH, --out PATH, --chunk-size BYTES, --queue-depth N, --auto-tune, --batch-wakeups, --sparse,
+ * --local-copy, --transport tcp|unix|shm, --memory-budget-mb MB, --fast-open, --connection-pool N, --trace PATH, --busy-poll-us US,
+ * --latency N, and the emulated network: --rtt-ms MS, --jitter-ms MS, --bandwidth-mbit MBIT,
+ * --stall-every-ms MS, --stall-ms MS, --window-kb KB. Any network option routes the transfer
+ * through a WanProxy, which needs the TCP transport.
+ *
+ * @param argc Argument count.
+ * @param argv Arguments.
+ * @param options Parsed options.
+ * @return true on success, false on an unknown option.
+ */
+bool parseOptions(int argc, char* argv[], BenchOptions& options) {
+    for (int idx = 1; idx < argc; ++idx) {
+        std::string name = argv[idx];
+        if (name == "--auto-tune") {
+            options.config.auto_tune = true;
+            continue;
+        }
+        if (name == "--batch-wakeups") {
+            options.config.batch_wakeups = true;
+            continue;
+        }
+        if (name == "--sparse") {
+            options.config.sparse = true;
+            continue;
+        }
+        if (name == "--local-copy") {
+            options.config.local_copy = true;
+            continue;
+        }
+        if (name == "--fast-open") {
+            options.config.fast_open = true;
+            continue;
+        }
+        if (idx + 1 >= argc) {
+            return false;
+        }
+        std::string value = argv[++idx];
+        uint64_t number = std::strtoull(value.c_str(), nullptr, 10);
+        if (name == "--in") {
+            options.in_path = value;
+        }
+        else if (name == "--out") {
+            options.out_path = value;
+        }
+        else if (name == "--chunk-size") {
+            options.config.chunk_size = static_cast<size_t>(number);
+        }
+        else if (name == "--queue-depth") {
+            options.config.queue_depth = static_cast<size_t>(number);
+        }
+        else if (name == "--transport") {
+            if (value == "tcp") {
+                options.config.channel = transport::TCP;
+            }
+            else if (value == "unix") {
+                options.config.channel = transport::UNIX;
+            }
+            else if (value == "shm") {
+                options.config.channel = transport::SHARED_MEMORY;
+            }
+            else {
+                return false;
+            }
+        }
+        else if (name == "--memory-budget-mb") {
+            options.memory_budget = static_cast<size_t>(number * 1024 * 1024);
+        }
+        else if (name == "--connection-pool") {
+            options.connection_pool = static_cast<size_t>(number);
+        }
+        else if (name == "--trace") {
+            options.trace_path = value;
+        }
+        else if (name == "--busy-poll-us") {
+            options.config.busy_poll_us = static_cast<uint32_t>(number);
+        }
+        else if (name == "--latency") {
+            options.latency_runs = static_cast<size_t>(number);
+        }
+        else if (name == "--rtt-ms") {
+            options.wan.rtt_us = static_cast<uint32_t>(number * 1000);
+            options.use_proxy = true;
+        }
+        else if (name == "--jitter-ms") {
+            options.wan.jitter_us = static_cast<uint32_t>(number * 1000);
+            options.use_proxy = true;
+        }
+        else if (name == "--bandwidth-mbit") {
+            options.wan.bandwidth = number * 1000 * 1000 / 8;
+            options.use_proxy = true;
+        }
+        else if (name == "--stall-every-ms") {
+            options.wan.stall_interval_ms = static_cast<uint32_t>(number);
+            options.use_proxy = true;
+        }
+        else if (name == "--stall-ms") {
+            options.wan.stall_ms = static_cast<uint32_t>(number);
+            options.use_proxy = true;
+        }
+        else if (name == "--window-kb") {
+            options.wan.queue_limit = static_cast<size_t>(number * 1024);
+            options.use_proxy = true;
+        }
+        else {
+            return false;
+        }
+    }
+    return !options.use_proxy || options.config.channel == transport::TCP;
+}
+
 /**
  * @brief Main function.
  *
- * Starts the sender and receiver threads, then compares the input and output files.
+ * Starts the receiver, the optional WAN proxy and the sender, then prints the
+ * transfer statistics and compares the input and output files. With --latency
+ * runs the transfers in the default mode, then busy polling, and prints their
+ * latency percentiles instead.
  */
-int main() {
-    // Define input and output file paths.
-    std::string in_path = ".\\test_in.txt";
-    std::string out_path = ".\\test_out.txt";
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "invalid arguments" << std::endl;
+        return 1;
+    }
+
+    std::unique_ptr<MemoryBudget> budget;
+    if (options.memory_budget > 0) {
+        budget.reset(new MemoryBudget(options.memory_budget));
+        options.config.memory_budget = budget.get();
+    }
+
+    std::unique_ptr<Tracer> tracer;
+    if (!options.trace_path.empty()) {
+        tracer.reset(new Tracer());
+        options.config.tracer = tracer.get();
+    }
 
-    // Sender transmits the source file, receiver writes to the output file.
-    std::thread st(sender, in_path);        // sender reads test_in.txt
-    std::thread rt(receiver, out_path);     // receiver writes to test_out.txt
+    // The receiver listens before the sender starts, so the connection cannot be refused.
+    FISocket rsock;
+    rsock.setConfig(options.config);
+    if (rsock.Init(options.config.channel == transport::TCP ? address : socket_path, receiver_port) != status::OK) {
+        std::cerr << "receiver init failed" << std::endl;
+        return 1;
+    }
+
+    WanProxy proxy(options.wan);
+    uint16_t port = receiver_port;
+    if (options.use_proxy) {
+        if (proxy.Start(address, proxy_port, address, receiver_port) != status::OK) {
+            std::cerr << "proxy start failed" << std::endl;
+            return 1;
+        }
+        port = proxy_port;
+    }
+
+    // Warmed before the transfer, so the sender starts on an established connection.
+    std::unique_ptr<ConnectionPool> pool;
+    if (options.connection_pool > 0) {
+        pool.reset(new ConnectionPool(options.config, options.connection_pool));
+        if (pool->Warm(options.config.channel == transport::TCP ? address : socket_path, port) != status::OK) {
+            std::cerr << "connection pool warm-up failed" << std::endl;
+            return 1;
+        }
+        options.config.connection_pool = pool.get();
+    }
+
+    if (options.latency_runs > 0) {
+        TransferConfig sleeping = options.config;
+        sleeping.busy_poll_us = 0;
+        TransferConfig polling = options.config;
+        if (polling.busy_poll_us == 0) {
+            polling.busy_poll_us = default_busy_poll_us;
+        }
+        printLatency("default", measureLatency(rsock, options, sleeping, port, options.latency_runs));
+        printLatency("busy poll " + std::to_string(polling.busy_poll_us) + " us",
+                     measureLatency(rsock, options, polling, port, options.latency_runs));
+        rsock.Close();
+        pool.reset();
+        proxy.Stop();
+        std::cout << "compareFiles: " << compareFiles(options.in_path, options.out_path) << std::endl;
+        return 0;
+    }
+
+    std::thread rt(receiver, std::ref(rsock), options.out_path);
+    std::thread st(sender, options.in_path, options.config, port);
 
     st.join();
+    // Closes the idle connections, the receiver may wait on one if the sender failed.
+    uint64_t pool_hits = pool ? pool->hits() : 0;
+    uint64_t pool_misses = pool ? pool->misses() : 0;
+    pool.reset();
     rt.join();
+    proxy.Stop();
 
-    std::cout << "compareFiles: " << compareFiles(in_path, out_path) << std::endl;
+    const TransferStats& stats = rsock.stats();
+    std::cout << "bytes: " << stats.bytes
+              << ", elapsed: " << stats.elapsed_us / 1000.0 << " ms"
+              << ", throughput: " << std::fixed << std::setprecision(2) << stats.throughput() * 8 / 1e6 << " Mbit/s"
+              << std::endl;
+    if (budget) {
+        std::cout << "memory budget: " << budget->limit() << " bytes, peak: " << budget->peak()
+                  << ", waits: " << budget->waits() << ", receiver waited: " << stats.budget_wait_us / 1000.0 << " ms"
+                  << std::endl;
+    }
+    if (tracer) {
+        bool is_exported = tracer->Export(options.trace_path);
+        std::cout << "trace: " << tracer->events() << " events, " << tracer->dropped() << " dropped, "
+                  << (is_exported ? "written to " : "failed to write ") << options.trace_path << std::endl;
+    }
+    if (options.connection_pool > 0) {
+        std::cout << "connection pool: hits: " << pool_hits << ", misses: " << pool_misses << std::endl;
+    }
+    std::cout << "compareFiles: " << compareFiles(options.in_path, options.out_path) << std::endl;
     return 0;
 }
@@ -0,0 +1,319 @@
+#include "memory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace {
+    // Granularity of slabs, equal to the common huge page size.
+    const size_t slab_size = 2 * 1024 * 1024;
+    const size_t min_block_size = 64;
+
+#if defined(__linux__) && defined(SYS_mbind)
+    const int mpol_preferred = 1;
+
+    void bindToNode(void* ptr, size_t size, int node) {
+        unsigned long nodemask[16] = {};
+        const size_t bits = sizeof(unsigned long) * 8;
+        if (node < 0 || static_cast<size_t>(node) >= bits * 16) {
+            return;
+        }
+        nodemask[node / bits] |= 1UL << (node % bits);
+        // Must be called before the pages are touched.
+        syscall(SYS_mbind, ptr, size, mpol_preferred, nodemask, bits * 16 + 1, 0);
+    }
+#endif
+}
+
+bool MemoryBudget::Acquire(Account& account, size_t size) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    ActivateLocked(account);
+    bool is_waiting = !canGrantLocked(account, size);
+    if (is_waiting) {
+        ++account.waiting;
+        ++_waiting;
+        ++_waits;
+        _cv.wait(lock, [this, &account, size] { return canGrantLocked(account, size); });
+        --account.waiting;
+        --_waiting;
+        // Transfers above an equal share may have waited for this one.
+        _cv.notify_all();
+    }
+    account.used += size;
+    _used += size;
+    _peak = std::max(_peak, _used);
+    return is_waiting;
+}
+
+bool MemoryBudget::TryAcquire(Account& account, size_t size) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    ActivateLocked(account);
+    if (!canGrantLocked(account, size)) {
+        return false;
+    }
+    account.used += size;
+    _used += size;
+    _peak = std::max(_peak, _used);
+    return true;
+}
+
+void MemoryBudget::Release(Account& account, size_t size) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    account.used -= size;
+    _used -= size;
+    if (account.is_active && account.used == 0 && account.waiting == 0) {
+        // An idle transfer neither keeps its minimum nor counts in the equal share.
+        _active.erase(std::find(_active.begin(), _active.end(), &account));
+        account.is_active = false;
+    }
+    if (_waiting > 0) {
+        _cv.notify_all();
+    }
+}
+
+void MemoryBudget::Leave(Account& account) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (account.is_active) {
+        _active.erase(std::find(_active.begin(), _active.end(), &account));
+        account.is_active = false;
+        _cv.notify_all();
+    }
+}
+
+size_t MemoryBudget::used() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _used;
+}
+
+size_t MemoryBudget::peak() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _peak;
+}
+
+size_t MemoryBudget::transfers() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _active.size();
+}
+
+uint64_t MemoryBudget::waits() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _waits;
+}
+
+bool MemoryBudget::canGrantLocked(const Account& account, size_t size) const {
+    if (account.used == 0) {
+        return true;
+    }
+    if (_used + size > _limit) {
+        return false;
+    }
+    if (account.used + size <= minimumLocked(account)) {
+        return true;
+    }
+    // Above its minimum a transfer leaves the unused minimums of the others free.
+    size_t reserved = 0;
+    for (const Account* other : _active) {
+        if (other != &account) {
+            reserved += minimumLocked(*other) - std::min(other->used, minimumLocked(*other));
+        }
+    }
+    if (_used + size + reserved > _limit) {
+        return false;
+    }
+    // Above an equal share it waits for the transfers below it.
+    size_t share = _limit / _active.size();
+    if (account.used + size > share) {
+        for (const Account* other : _active) {
+            if (other != &account && other->waiting > 0 && other->used < share) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+size_t MemoryBudget::minimumLocked(const Account& account) const {
+    return std::min(account.minimum, _limit / std::max<size_t>(_active.size(), 1));
+}
+
+void MemoryBudget::ActivateLocked(Account& account) {
+    if (!account.is_active) {
+        _active.push_back(&account);
+        account.is_active = true;
+    }
+}
+
+void ChunkAllocator::setBudget(MemoryBudget* budget, size_t minimum) {
+    if (_budget != nullptr) {
+        _budget->Leave(_account);
+    }
+    _budget = budget;
+    _account = MemoryBudget::Account();
+    _account.minimum = minimum;
+    _budget_wait_us.store(0);
+}
+
+void ChunkAllocator::AddListener(BudgetListener* listener) {
+    std::lock_guard<std::mutex> lock(_listener_mutex);
+    _listeners.push_back(listener);
+}
+
+void ChunkAllocator::RemoveListener(BudgetListener* listener) {
+    std::lock_guard<std::mutex> lock(_listener_mutex);
+    _listeners.erase(std::remove(_listeners.begin(), _listeners.end(), listener), _listeners.end());
+}
+
+void ChunkAllocator::Configure(bool use_hugepages, int numa_node) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (use_hugepages == _use_hugepages && numa_node == _numa_node) {
+        return;
+    }
+    Release();
+    _use_hugepages = use_hugepages;
+    _numa_node = numa_node;
+}
+
+char* ChunkAllocator::Allocate(size_t size, bool is_budgeted) {
+    size_t block_size = sizeClass(size);
+    if (is_budgeted && _budget != nullptr && !_budget->TryAcquire(_account, block_size)) {
+        {
+            std::lock_guard<std::mutex> lock(_listener_mutex);
+            for (BudgetListener* listener : _listeners) {
+                listener->onBudgetWait();
+            }
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (_budget->Acquire(_account, block_size)) {
+            _budget_wait_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::vector<char*>& free_list = _free[block_size];
+    if (free_list.empty()) {
+        size_t size_of_slab = (block_size + slab_size - 1) / slab_size * slab_size;
+        bool is_huge = false;
+        char* ptr = MapSlab(size_of_slab, is_huge);
+        if (ptr == nullptr) {
+            if (is_budgeted && _budget != nullptr) {
+                _budget->Release(_account, block_size);
+            }
+            throw std::bad_alloc();
+        }
+        _slabs.push_back(Slab{ ptr, size_of_slab });
+        _reserved += size_of_slab;
+        _is_hugepage_backed = _is_hugepage_backed || is_huge;
+
+        for (size_t offset = size_of_slab; offset >= block_size; offset -= block_size) {
+            free_list.push_back(ptr + offset - block_size);
+        }
+    }
+
+    char* block = free_list.back();
+    free_list.pop_back();
+    return block;
+}
+
+void ChunkAllocator::Deallocate(char* ptr, size_t size, bool is_budgeted) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _free[sizeClass(size)].push_back(ptr);
+    }
+    if (is_budgeted && _budget != nullptr) {
+        _budget->Release(_account, sizeClass(size));
+    }
+}
+
+size_t ChunkAllocator::reserved() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _reserved;
+}
+
+bool ChunkAllocator::isHugepageBacked() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _is_hugepage_backed;
+}
+
+size_t ChunkAllocator::sizeClass(size_t size) {
+    size_t block_size = min_block_size;
+    while (block_size < size) {
+        block_size <<= 1;
+    }
+    return block_size;
+}
+
+char* ChunkAllocator::MapSlab(size_t size, bool& is_huge) {
+#ifdef _WIN32
+    DWORD node = _numa_node >= 0 ? static_cast<DWORD>(_numa_node) : NUMA_NO_PREFERRED_NODE;
+    void* ptr = nullptr;
+    SIZE_T large_page = GetLargePageMinimum();
+    if (_use_hugepages && large_page != 0 && size % large_page == 0) {
+        // Requires the "Lock pages in memory" privilege, falls back to regular pages otherwise.
+        ptr = VirtualAllocExNuma(GetCurrentProcess(), nullptr, size,
+                                 MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+        is_huge = ptr != nullptr;
+    }
+    if (ptr == nullptr) {
+        ptr = VirtualAllocExNuma(GetCurrentProcess(), nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+    }
+    return static_cast<char*>(ptr);
+#else
+    void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (_use_hugepages) {
+        // Needs preallocated huge pages (vm.nr_hugepages), falls back to transparent huge pages.
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        is_huge = ptr != MAP_FAILED;
+    }
+#endif
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED) {
+            return nullptr;
+        }
+#ifdef MADV_HUGEPAGE
+        if (_use_hugepages) {
+            is_huge = madvise(ptr, size, MADV_HUGEPAGE) == 0;
+        }
+#endif
+    }
+#if defined(__linux__) && defined(SYS_mbind)
+    if (_numa_node >= 0) {
+        bindToNode(ptr, size, _numa_node);
+    }
+#endif
+    return static_cast<char*>(ptr);
+#endif
+}
+
+void ChunkAllocator::UnmapSlab(const Slab& slab) {
+#ifdef _WIN32
+    VirtualFree(slab.ptr, 0, MEM_RELEASE);
+#else
+    munmap(slab.ptr, slab.size);
+#endif
+}
+
+void ChunkAllocator::Release() {
+    for (const Slab& slab : _slabs) {
+        UnmapSlab(slab);
+    }
+    _slabs.clear();
+    _free.clear();
+    _reserved = 0;
+    _is_hugepage_backed = false;
+}
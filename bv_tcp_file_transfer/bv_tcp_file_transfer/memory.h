@@ -0,0 +1,251 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <map>
+#include <vector>
+
+/**
+ * @brief Limit on the chunk memory shared by concurrent transfers.
+ *
+ * Transfers set in TransferConfig::memory_budget draw from it the chunks
+ * holding data that entered them and is not yet consumed: chunks read from
+ * the socket on the receiver, from the file on the sender. A transfer out of
+ * budget waits before it reads more, so a receiver stops reading its socket
+ * and TCP flow control throttles the sender. Blocks of the consumers (e.g.
+ * direct I/O blocks) are not counted, so the consumers always make progress.
+ *
+ * Every transfer holding or waiting for memory is guaranteed its minimum, at
+ * most an equal share of the limit; the rest is shared. While transfers wait,
+ * memory freed goes first to those below an equal share, so the largest users
+ * shrink back to it. Must outlive the transfers using it.
+ */
+class MemoryBudget {
+public:
+    /**
+     * @brief Memory held by one transfer, managed by its ChunkAllocator.
+     */
+    struct Account {
+        size_t used = 0;
+        size_t minimum = 0;
+        size_t waiting = 0;
+        bool is_active = false;
+    };
+
+    /**
+     * @brief Constructs a budget.
+     *
+     * @param limit Bytes of chunk memory held by all transfers together.
+     */
+    explicit MemoryBudget(size_t limit) : _limit(limit), _used(0), _peak(0), _waiting(0), _waits(0) {}
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    /**
+     * @brief Waits until the account may take size more bytes and adds them.
+     *
+     * A transfer holding nothing is never kept waiting, so a block larger
+     * than the limit is still granted.
+     *
+     * @param account Account of the transfer.
+     * @param size Bytes to take.
+     * @return true if the call had to wait, false otherwise.
+     */
+    bool Acquire(Account& account, size_t size);
+
+    /**
+     * @brief Adds size bytes to the account if it may take them without waiting.
+     *
+     * @param account Account of the transfer.
+     * @param size Bytes to take.
+     * @return true if the bytes were taken, false otherwise.
+     */
+    bool TryAcquire(Account& account, size_t size);
+
+    /**
+     * @brief Returns bytes of the account to the budget.
+     *
+     * @param account Account of the transfer.
+     * @param size Bytes taken by Acquire().
+     */
+    void Release(Account& account, size_t size);
+
+    /**
+     * @brief Removes an account holding no memory from the transfers sharing the budget.
+     */
+    void Leave(Account& account);
+
+    size_t limit() const { return _limit; }
+
+    /**
+     * @brief Returns the bytes held by all transfers.
+     */
+    size_t used() const;
+
+    /**
+     * @brief Returns the highest value of used() so far.
+     */
+    size_t peak() const;
+
+    /**
+     * @brief Returns the number of transfers holding or waiting for memory.
+     */
+    size_t transfers() const;
+
+    /**
+     * @brief Returns the number of Acquire() calls that had to wait.
+     */
+    uint64_t waits() const;
+
+private:
+    bool canGrantLocked(const Account& account, size_t size) const;
+    size_t minimumLocked(const Account& account) const;
+    void ActivateLocked(Account& account);
+
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+    const size_t _limit;
+    size_t _used;
+    size_t _peak;
+    // Accounts blocked in Acquire(), and the calls that waited so far.
+    size_t _waiting;
+    uint64_t _waits;
+    std::vector<Account*> _active;
+};
+
+/**
+ * @brief Holder of budgeted blocks, told before an allocation waits for the budget.
+ *
+ * A pool batching its wakeups keeps chunks from its consumers until the high
+ * watermark; the memory an allocation waits for may be parked there.
+ */
+class BudgetListener {
+public:
+    /**
+     * @brief Called before a budgeted allocation of the ChunkAllocator waits.
+     */
+    virtual void onBudgetWait() = 0;
+
+protected:
+    ~BudgetListener() = default;
+};
+
+/**
+ * @brief Allocator of chunk storage.
+ *
+ * Blocks are carved from large slabs which can be backed by huge pages and
+ * placed on a given NUMA node. Freed blocks are kept in per-size free lists
+ * and reused, slabs are returned to the system by Configure() or on destruction.
+ */
+class ChunkAllocator {
+public:
+    ChunkAllocator()
+        : _use_hugepages(false), _numa_node(-1), _reserved(0), _is_hugepage_backed(false), _budget(nullptr),
+          _budget_wait_us(0)
+    {}
+    ~ChunkAllocator() { setBudget(nullptr, 0); Release(); }
+
+    ChunkAllocator(const ChunkAllocator&) = delete;
+    ChunkAllocator& operator=(const ChunkAllocator&) = delete;
+
+    /**
+     * @brief Sets the memory placement of new slabs.
+     *
+     * Cached memory is released, so no blocks may be outstanding.
+     *
+     * @param use_hugepages Back slabs with huge pages when possible.
+     * @param numa_node NUMA node to allocate on, -1 for any.
+     */
+    void Configure(bool use_hugepages, int numa_node);
+
+    /**
+     * @brief Sets the budget charged with the blocks of this allocator.
+     *
+     * No blocks may be outstanding. Also resets budgetWaitTime().
+     *
+     * @param budget Shared budget, nullptr for none.
+     * @param minimum Bytes guaranteed to this allocator, see MemoryBudget.
+     */
+    void setBudget(MemoryBudget* budget, size_t minimum);
+
+    /**
+     * @brief Returns the time spent waiting for the budget since setBudget().
+     *
+     * @return uint64_t Microseconds.
+     */
+    uint64_t budgetWaitTime() const { return _budget_wait_us.load(); }
+
+    bool isBudgeted() const { return _budget != nullptr; }
+
+    /**
+     * @brief Registers a listener told before a budgeted allocation waits.
+     *
+     * @param listener Listener, removed with RemoveListener() before it is destroyed.
+     */
+    void AddListener(BudgetListener* listener);
+    void RemoveListener(BudgetListener* listener);
+
+    /**
+     * @brief Allocates a block.
+     *
+     * @param size Requested size in bytes.
+     * @param is_budgeted Take the block from the budget, waiting while it is exhausted;
+     * the listeners are told before the wait.
+     * @return char* Pointer to the block.
+     * @throws std::bad_alloc if the system is out of memory.
+     */
+    char* Allocate(size_t size, bool is_budgeted = false);
+
+    /**
+     * @brief Returns a block to the free list.
+     *
+     * @param ptr Pointer returned by Allocate().
+     * @param size Size passed to Allocate().
+     * @param is_budgeted Value passed to Allocate().
+     */
+    void Deallocate(char* ptr, size_t size, bool is_budgeted = false);
+
+    /**
+     * @brief Returns the number of bytes reserved from the system.
+     *
+     * @return size_t Total size of the slabs.
+     */
+    size_t reserved() const;
+
+    /**
+     * @brief Checks whether any slab is backed by huge pages.
+     *
+     * @return true if huge pages are in use, false otherwise.
+     */
+    bool isHugepageBacked() const;
+
+private:
+    struct Slab {
+        char* ptr;
+        size_t size;
+    };
+
+    static size_t sizeClass(size_t size);
+    char* MapSlab(size_t size, bool& is_huge);
+    void UnmapSlab(const Slab& slab);
+    void Release();
+
+    mutable std::mutex _mutex;
+    bool _use_hugepages;
+    int _numa_node;
+    size_t _reserved;
+    bool _is_hugepage_backed;
+    std::map<size_t, std::vector<char*>> _free;
+    std::vector<Slab> _slabs;
+    // Changed only while no blocks are outstanding, the account is guarded by the budget.
+    MemoryBudget* _budget;
+    MemoryBudget::Account _account;
+    std::atomic<uint64_t> _budget_wait_us;
+    // Own lock: listeners take their own locks, which may be held while blocks are freed.
+    std::mutex _listener_mutex;
+    std::vector<BudgetListener*> _listeners;
+};
@@ -0,0 +1,276 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+
+/**
+ * @brief Writes an unsigned integer in network byte order.
+ *
+ * @param out Destination buffer of at least len bytes.
+ * @param value Value to write.
+ * @param len Number of bytes.
+ */
+inline void encodeUint(char* out, uint64_t value, size_t len) {
+    for (size_t idx = 0; idx < len; ++idx) {
+        out[idx] = static_cast<char>((value >> (8 * (len - 1 - idx))) & 0xff);
+    }
+}
+
+/**
+ * @brief Reads an unsigned integer in network byte order.
+ *
+ * @param in Source buffer of at least len bytes.
+ * @param len Number of bytes.
+ * @return uint64_t Decoded value.
+ */
+inline uint64_t decodeUint(const char* in, size_t len) {
+    uint64_t value = 0;
+    for (size_t idx = 0; idx < len; ++idx) {
+        value = (value << 8) | static_cast<unsigned char>(in[idx]);
+    }
+    return value;
+}
+
+/**
+ * @brief Header sent by FOSocket before the file data.
+ *
+ * Encoded as 16 bytes in network byte order:
+ * magic (4), version (2), flags (2), size (8).
+ */
+struct FileHeader {
+    static const uint32_t magic_value = 0x54434654; // "TCFT"
+    static const uint16_t version_value = 1;
+    static const size_t encoded_size = 16;
+
+    enum Flags : uint16_t {
+        // The whole file follows the header in a single message, no chunking.
+        INLINE = 1 << 0,
+        // A CryptoHeader follows, the data is sent as encrypted frames.
+        ENCRYPTED = 1 << 1,
+        // The data is a sequence of ExtentHeader records, each followed by the
+        // data of its extent, size is the length of this sequence.
+        SPARSE = 1 << 2,
+        // An offer to copy the file on the receiver's host: a LocalCopyHeader
+        // follows instead of the data, the receiver replies with one byte. If
+        // the offer is declined, the sender starts over with a regular header.
+        LOCAL_COPY = 1 << 3,
+        // Opens a multiplexed session (FOSession): FrameHeader frames follow
+        // in both directions instead of the data, size is 0.
+        SESSION = 1 << 4,
+    };
+
+    uint32_t magic = magic_value;
+    uint16_t version = version_value;
+    uint16_t flags = 0;
+    // Size of the file in bytes, of the extent records with SPARSE.
+    uint64_t size = 0;
+
+    bool hasFlag(Flags flag) const { return (flags & flag) != 0; }
+
+    /**
+     * @brief Writes the header to a buffer.
+     *
+     * @param out Buffer of at least encoded_size bytes.
+     */
+    void Encode(char* out) const {
+        encodeUint(out, magic, 4);
+        encodeUint(out + 4, version, 2);
+        encodeUint(out + 6, flags, 2);
+        encodeUint(out + 8, size, 8);
+    }
+
+    /**
+     * @brief Reads the header from a buffer.
+     *
+     * @param in Buffer of at least encoded_size bytes.
+     * @return true if the magic and version are valid, false otherwise.
+     */
+    bool Decode(const char* in) {
+        magic = static_cast<uint32_t>(decodeUint(in, 4));
+        version = static_cast<uint16_t>(decodeUint(in + 4, 2));
+        flags = static_cast<uint16_t>(decodeUint(in + 6, 2));
+        size = decodeUint(in + 8, 8);
+        return magic == magic_value && version == version_value;
+    }
+};
+
+/**
+ * @brief Data range of a sparse file, sent before the data of the range.
+ *
+ * Encoded as 16 bytes in network byte order: offset (8), length (8).
+ * Extents are sent in ascending order of offset, the ranges between them are
+ * holes. The last record has zero length, its offset is the size of the file.
+ */
+struct ExtentHeader {
+    static const size_t encoded_size = 16;
+
+    uint64_t offset = 0;
+    uint64_t len = 0;
+
+    bool isEnd() const { return len == 0; }
+
+    void Encode(char* out) const {
+        encodeUint(out, offset, 8);
+        encodeUint(out + 8, len, 8);
+    }
+
+    void Decode(const char* in) {
+        offset = decodeUint(in, 8);
+        len = decodeUint(in + 8, 8);
+    }
+};
+
+/**
+ * @brief Location of the file offered for a copy on the receiver's host.
+ *
+ * Encoded as 20 bytes in network byte order: device (8), inode (8), path
+ * length (4), followed by the absolute path. The receiver copies the file
+ * only if the path names the same file (device, inode and size).
+ */
+struct LocalCopyHeader {
+    static const size_t encoded_size = 20;
+    static const size_t max_path_size = 64 * 1024;
+    // Replies of the receiver.
+    static const char reply_declined = 0;
+    static const char reply_copied = 1;
+
+    uint64_t device = 0;
+    uint64_t inode = 0;
+    std::string path;
+
+    /**
+     * @brief Appends the header and the path to a buffer.
+     *
+     * @param out Buffer to append to.
+     */
+    void Encode(std::string& out) const {
+        size_t start = out.size();
+        out.resize(start + encoded_size);
+        encodeUint(&out[start], device, 8);
+        encodeUint(&out[start + 8], inode, 8);
+        encodeUint(&out[start + 16], path.size(), 4);
+        out += path;
+    }
+
+    /**
+     * @brief Reads the fixed part of the header.
+     *
+     * @param in Buffer of at least encoded_size bytes.
+     * @return size_t Length of the path that follows.
+     */
+    size_t Decode(const char* in) {
+        device = decodeUint(in, 8);
+        inode = decodeUint(in + 8, 8);
+        return static_cast<size_t>(decodeUint(in + 16, 4));
+    }
+};
+
+/**
+ * @brief Header of a frame of a multiplexed session.
+ *
+ * Encoded as 9 bytes in network byte order: type (1), stream (4), payload
+ * length (4), followed by the payload. Streams are numbered by the sender
+ * from 1 in increasing order, stream 0 is the session itself. A stream may
+ * have at most window bytes of DATA not yet confirmed by WINDOW frames.
+ */
+struct FrameHeader {
+    static const size_t encoded_size = 9;
+    // Payload of SETTINGS: window (4), max_streams (4).
+    static const size_t settings_size = 8;
+    // Payload of OPEN: file size (8), followed by the name.
+    static const size_t open_size = 8;
+    static const size_t max_name_size = 4096;
+
+    enum Type : uint8_t {
+        // Receiver, first frame: the window and the number of streams open at once.
+        SETTINGS = 0,
+        // Sender: starts a stream.
+        OPEN = 1,
+        // Sender: file data of a stream, at least one byte.
+        DATA = 2,
+        // Sender: all data of the stream is sent.
+        END = 3,
+        // Receiver: the stream may send more bytes, payload: count (4).
+        WINDOW = 4,
+        // Receiver: the stream is finished, payload: 1 if the file is written, 0 otherwise.
+        DONE = 5,
+        // Sender, stream 0: no more streams, the receiver closes after the open ones.
+        CLOSE = 6,
+    };
+
+    uint8_t type = 0;
+    uint32_t stream = 0;
+    uint32_t len = 0;
+
+    /**
+     * @brief Writes the header to a buffer.
+     *
+     * @param out Buffer of at least encoded_size bytes.
+     */
+    void Encode(char* out) const {
+        out[0] = static_cast<char>(type);
+        encodeUint(out + 1, stream, 4);
+        encodeUint(out + 5, len, 4);
+    }
+
+    /**
+     * @brief Reads the header from a buffer.
+     *
+     * @param in Buffer of at least encoded_size bytes.
+     */
+    void Decode(const char* in) {
+        type = static_cast<uint8_t>(in[0]);
+        stream = static_cast<uint32_t>(decodeUint(in + 1, 4));
+        len = static_cast<uint32_t>(decodeUint(in + 5, 4));
+    }
+};
+
+/**
+ * @brief Parameters of an encrypted transfer, sent after FileHeader.
+ *
+ * Encoded as 24 bytes: cipher (1), reserved (7), salt (16).
+ * The data follows as frames of: plaintext length (4), ciphertext, tag (16).
+ * The per-transfer key is derived from the pre-shared key and the salt,
+ * the nonce of a frame is its sequence number.
+ */
+struct CryptoHeader {
+    static const size_t encoded_size = 24;
+    static const size_t salt_size = 16;
+    static const size_t frame_prefix_size = 4;
+    static const size_t tag_size = 16;
+
+    uint8_t cipher = 0;
+    char salt[salt_size] = {};
+
+    void Encode(char* out) const {
+        memset(out, 0, encoded_size);
+        out[0] = static_cast<char>(cipher);
+        memcpy(out + 8, salt, salt_size);
+    }
+
+    void Decode(const char* in) {
+        cipher = static_cast<uint8_t>(in[0]);
+        memcpy(salt, in + 8, salt_size);
+    }
+};
+
+/**
+ * @brief Encodes the headers sent before the file data.
+ *
+ * The result is also the additional authenticated data of encrypted frames.
+ *
+ * @param header File header.
+ * @param crypto Crypto header, sent only if the ENCRYPTED flag is set.
+ * @return std::string Encoded headers.
+ */
+inline std::string encodePrologue(const FileHeader& header, const CryptoHeader& crypto) {
+    std::string prologue(FileHeader::encoded_size, '\0');
+    header.Encode(&prologue[0]);
+    if (header.hasFlag(FileHeader::ENCRYPTED)) {
+        prologue.resize(FileHeader::encoded_size + CryptoHeader::encoded_size);
+        crypto.Encode(&prologue[FileHeader::encoded_size]);
+    }
+    return prologue;
+}
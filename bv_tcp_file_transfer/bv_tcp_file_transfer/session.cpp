@@ -0,0 +1,330 @@
+#include "session.h"
+#include "file.h"
+#include "protocol.h"
+#include "log.h"
+
+#include <algorithm>
+
+/**
+ * @brief A file sent by a session.
+ */
+struct FOSession::Stream {
+    uint32_t id = 0;
+    std::string location;
+    std::string name;
+    // Used by the sender thread only.
+    FileReader fr;
+    uint64_t size = 0;
+    uint64_t sent = 0;
+    // Bytes the stream may send until the next WINDOW frame.
+    uint64_t credit = 0;
+    bool is_done = false;
+    bool is_ok = false;
+};
+
+bool sendFrame(Connection& connection, uint8_t type, uint32_t stream, const char* payload, size_t len) {
+    FrameHeader frame;
+    frame.type = type;
+    frame.stream = stream;
+    frame.len = static_cast<uint32_t>(len);
+    char header[FrameHeader::encoded_size];
+    frame.Encode(header);
+    tcpft_iovec iov[] = { { header, sizeof(header) }, { payload, len } };
+    return connection.SendV(iov, len > 0 ? 2 : 1) >= 0;
+}
+
+FOSession::FOSession()
+    : _next_stream(1), _window(0), _max_streams(0), _active(0), _is_closing(true), _is_failed(false)
+{}
+
+FOSession::~FOSession() {
+    Close();
+}
+
+status FOSession::Connect(const std::string& dst_addr, const uint16_t dst_port) {
+    Close();
+    if (config().encryption != cipher::NONE) {
+        tcpft_logCritical("encryption is not supported by sessions");
+        return status::TRANSPORT_NOT_SUPPORTED;
+    }
+    _connection = Connection::Create(config());
+    if (!_connection) {
+        return status::TRANSPORT_NOT_SUPPORTED;
+    }
+    status result = _connection->Connect(dst_addr, dst_port);
+    if (result != status::OK) {
+        return result;
+    }
+    _connection->setBusyPoll(config().busy_poll_us);
+
+    FileHeader header;
+    header.flags = FileHeader::SESSION;
+    char prologue[FileHeader::encoded_size];
+    header.Encode(prologue);
+    tcpft_iovec iov = { prologue, sizeof(prologue) };
+    char settings[FrameHeader::encoded_size + FrameHeader::settings_size];
+    FrameHeader frame;
+    bool is_valid = _connection->SendV(&iov, 1) >= 0 && _connection->ReceiveExact(settings, sizeof(settings));
+    frame.Decode(settings);
+    uint64_t window = decodeUint(settings + FrameHeader::encoded_size, 4);
+    uint64_t max_streams = decodeUint(settings + FrameHeader::encoded_size + 4, 4);
+    if (!is_valid || frame.type != FrameHeader::SETTINGS || frame.len != FrameHeader::settings_size
+        || window == 0 || max_streams == 0) {
+        tcpft_logCritical("session refused");
+        _connection->Close();
+        _connection.reset();
+        return status::SOCKET_CONNECT_FAILED;
+    }
+
+    TransferStats& st = transferStats();
+    st = TransferStats();
+    st.chunk_size = config().chunk_size;
+    _start = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _streams.clear();
+        _next_stream = 1;
+        _window = static_cast<uint32_t>(window);
+        _max_streams = static_cast<uint32_t>(max_streams);
+        _active = 0;
+        _is_closing = false;
+        _is_failed = false;
+    }
+    tcpft_logInfo("session open: window ", window, ", streams ", max_streams);
+    _sender = std::thread(&FOSession::SendLoop, this);
+    _replies = std::thread(&FOSession::ReplyLoop, this);
+    return status::OK;
+}
+
+uint32_t FOSession::Submit(const std::string& location, const std::string& name) {
+    std::shared_ptr<Stream> stream(new Stream());
+    stream->location = location;
+    stream->name = name;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_is_closing || _is_failed) {
+            return 0;
+        }
+        stream->id = _next_stream++;
+        _streams[stream->id] = stream;
+        _pending.push_back(stream);
+    }
+    _cv.notify_all();
+    return stream->id;
+}
+
+bool FOSession::Wait(uint32_t stream) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    std::map<uint32_t, std::shared_ptr<Stream>>::iterator it = _streams.find(stream);
+    if (it == _streams.end()) {
+        return false;
+    }
+    std::shared_ptr<Stream> waited = it->second;
+    _cv.wait(lock, [&waited] { return waited->is_done; });
+    _streams.erase(stream);
+    return waited->is_ok;
+}
+
+int FOSession::Close() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _is_closing = true;
+    }
+    _cv.notify_all();
+    if (_sender.joinable()) {
+        _sender.join();
+        _replies.join();
+        TransferStats& st = transferStats();
+        st.elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - _start).count();
+        tcpft_logInfo("session closed: ", st.streams, " streams, ", st.bytes, " bytes");
+    }
+    int result = _connection ? _connection->Close() : 0;
+    _connection.reset();
+    return result;
+}
+
+void FOSession::SendLoop() {
+    TraceThread trace(config().tracer, "session sender");
+    std::string buf;
+    for (;;) {
+        std::shared_ptr<Stream> opening;
+        std::shared_ptr<Stream> sending;
+        size_t len = 0;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this] {
+                return _is_failed || (!_pending.empty() && _active < _max_streams)
+                       || std::any_of(_sending.begin(), _sending.end(),
+                                      [](const std::shared_ptr<Stream>& stream) { return stream->credit > 0; })
+                       || (_is_closing && _pending.empty() && _active == 0);
+            });
+            if (_is_failed) {
+                return;
+            }
+            if (!_pending.empty() && _active < _max_streams) {
+                opening = _pending.front();
+                _pending.pop_front();
+                ++_active;
+            }
+            else if (!_sending.empty()) {
+                // Streams take turns: the one that sends moves to the back.
+                std::deque<std::shared_ptr<Stream>>::iterator it = std::find_if(
+                    _sending.begin(), _sending.end(), [](const std::shared_ptr<Stream>& stream) { return stream->credit > 0; });
+                sending = *it;
+                _sending.erase(it);
+                _sending.push_back(sending);
+                len = static_cast<size_t>(std::min<uint64_t>(std::min<uint64_t>(config().chunk_size, sending->credit),
+                                                             sending->size - sending->sent));
+                sending->credit -= len;
+            }
+        }
+
+        bool is_sent = true;
+        if (opening) {
+            is_sent = OpenStream(opening);
+        }
+        else if (sending) {
+            is_sent = SendData(sending, len, buf);
+        }
+        else {
+            // All streams are finished and no more will come.
+            if (!sendFrame(*_connection, FrameHeader::CLOSE, 0)) {
+                tcpft_logCritical("send failed");
+            }
+            return;
+        }
+        if (!is_sent) {
+            tcpft_logCritical("send failed");
+            std::lock_guard<std::mutex> lock(_mutex);
+            _is_failed = true;
+            FailLocked();
+            _cv.notify_all();
+            return;
+        }
+    }
+}
+
+bool FOSession::OpenStream(const std::shared_ptr<Stream>& stream) {
+    try {
+        if (stream->name.empty() || stream->name.size() > FrameHeader::max_name_size) {
+            throw std::runtime_error("invalid stream name");
+        }
+        stream->fr.OpenSequential(stream->location, config().prefetch_depth);
+        stream->size = stream->fr.size();
+    }
+    catch (const std::runtime_error& e) {
+        tcpft_logCritical("stream ", stream->id, " \"", stream->location, "\": ", e.what());
+        std::lock_guard<std::mutex> lock(_mutex);
+        stream->is_done = true;
+        --_active;
+        _cv.notify_all();
+        return true;
+    }
+
+    std::string payload(FrameHeader::open_size, '\0');
+    encodeUint(&payload[0], stream->size, FrameHeader::open_size);
+    payload += stream->name;
+    if (!sendFrame(*_connection, FrameHeader::OPEN, stream->id, payload.data(), payload.size())) {
+        return false;
+    }
+    tcpft_logInfo("stream ", stream->id, " \"", stream->location, "\": ", stream->size, " bytes");
+    if (stream->size == 0) {
+        return EndStream(stream);
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    stream->credit = _window;
+    _sending.push_back(stream);
+    return true;
+}
+
+bool FOSession::SendData(const std::shared_ptr<Stream>& stream, size_t len, std::string& buf) {
+    buf.resize(std::max(buf.size(), len));
+    size_t nb = stream->fr.Read(&buf[0], len);
+    if (nb > 0) {
+        if (!sendFrame(*_connection, FrameHeader::DATA, stream->id, buf.data(), nb)) {
+            return false;
+        }
+        stream->sent += nb;
+        TransferStats& st = transferStats();
+        st.bytes += nb;
+        ++st.chunks;
+    }
+    // A short read means the file was truncated, the receiver then discards it.
+    if (nb < len || stream->sent == stream->size) {
+        return EndStream(stream);
+    }
+    return true;
+}
+
+bool FOSession::EndStream(const std::shared_ptr<Stream>& stream) {
+    stream->fr.Close();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::deque<std::shared_ptr<Stream>>::iterator it = std::find(_sending.begin(), _sending.end(), stream);
+        if (it != _sending.end()) {
+            _sending.erase(it);
+        }
+    }
+    return sendFrame(*_connection, FrameHeader::END, stream->id);
+}
+
+void FOSession::ReplyLoop() {
+    TraceThread trace(config().tracer, "session replies");
+    TransferStats& st = transferStats();
+    for (;;) {
+        char buf[FrameHeader::encoded_size + 4];
+        FrameHeader frame;
+        if (!_connection->ReceiveExact(buf, FrameHeader::encoded_size)) {
+            break;
+        }
+        frame.Decode(buf);
+        uint32_t len = frame.type == FrameHeader::WINDOW ? 4 : frame.type == FrameHeader::DONE ? 1 : 0;
+        if (len == 0 || frame.len != len) {
+            tcpft_logCritical("invalid frame: type ", static_cast<int>(frame.type), ", length ", frame.len);
+            break;
+        }
+        if (!_connection->ReceiveExact(buf + FrameHeader::encoded_size, len)) {
+            break;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::map<uint32_t, std::shared_ptr<Stream>>::iterator it = _streams.find(frame.stream);
+        if (it == _streams.end() || it->second->is_done) {
+            // Forgotten by Wait() only after DONE, so this is not a stream of the session.
+            tcpft_logCritical("frame of an unknown stream ", frame.stream);
+            break;
+        }
+        Stream& stream = *it->second;
+        if (frame.type == FrameHeader::WINDOW) {
+            stream.credit += decodeUint(buf + FrameHeader::encoded_size, 4);
+        }
+        else {
+            stream.is_done = true;
+            stream.is_ok = buf[FrameHeader::encoded_size] == 1;
+            --_active;
+            if (stream.is_ok) {
+                ++st.streams;
+            }
+            tcpft_logInfo("stream ", stream.id, " ", stream.is_ok ? "done" : "failed");
+        }
+        _cv.notify_all();
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_is_closing || !_pending.empty() || _active > 0) {
+        tcpft_logCritical("session closed by the receiver");
+    }
+    _is_failed = true;
+    FailLocked();
+    _cv.notify_all();
+}
+
+void FOSession::FailLocked() {
+    for (std::pair<const uint32_t, std::shared_ptr<Stream>>& entry : _streams) {
+        entry.second->is_done = true;
+    }
+    _pending.clear();
+    _sending.clear();
+    _active = 0;
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "fsocket.h"
+
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * @brief Sends a session frame: its header and payload in one vectored send.
+ *
+ * @param connection Connection of the session.
+ * @param type Frame type, FrameHeader::Type.
+ * @param stream Stream number, 0 for the session.
+ * @param payload Payload data.
+ * @param len Payload length.
+ * @return true on success, false if the connection failed.
+ */
+bool sendFrame(Connection& connection, uint8_t type, uint32_t stream, const char* payload = nullptr, size_t len = 0);
+
+/**
+ * @brief Long-lived session sending many files over one connection.
+ *
+ * Files are submitted at any time and sent as streams of interleaved frames
+ * (see FrameHeader), received by FISocket::ReceiveSession(). Open streams
+ * take turns frame by frame, so a large file does not hold back small ones;
+ * each stream sends at most the receiver's window ahead of its writes.
+ * The connection, and its congestion window, is reused by all files.
+ */
+class FOSession : public FSocket {
+public:
+    FOSession();
+    ~FOSession();
+
+    /**
+     * @brief Connects to a receiver and opens the session.
+     *
+     * Call setConfig() first, TransferConfig::channel selects the transport.
+     * Encryption is not supported by sessions.
+     *
+     * @param dst_addr Destination IP address, or the path of the socket file.
+     * @param dst_port Destination port, ignored for socket files.
+     * @return status Error status.
+     */
+    status Connect(const std::string& dst_addr, const uint16_t dst_port);
+
+    /**
+     * @brief Queues a file for sending, thread-safe.
+     *
+     * @param location Path to the input file.
+     * @param name Name of the output file in the receiver's directory.
+     * @return uint32_t Stream number, 0 if the session is not open.
+     */
+    uint32_t Submit(const std::string& location, const std::string& name);
+
+    /**
+     * @brief Waits until a stream is finished and forgets it, once per stream.
+     *
+     * @param stream Stream number returned by Submit().
+     * @return true if the receiver wrote the whole file, false otherwise.
+     */
+    bool Wait(uint32_t stream);
+
+    /**
+     * @brief Sends the submitted files, then closes the session.
+     *
+     * stats() then holds the counters of the whole session.
+     *
+     * @return int Result of closing.
+     */
+    int Close() override;
+
+private:
+    struct Stream;
+
+    void SendLoop();
+    void ReplyLoop();
+    bool OpenStream(const std::shared_ptr<Stream>& stream);
+    bool SendData(const std::shared_ptr<Stream>& stream, size_t len, std::string& buf);
+    bool EndStream(const std::shared_ptr<Stream>& stream);
+    // Finishes the unfinished streams as failed, under the lock.
+    void FailLocked();
+
+    std::unique_ptr<Connection> _connection;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    // Streams are shared with the sender thread, Wait() may forget them while it still sends.
+    std::map<uint32_t, std::shared_ptr<Stream>> _streams;
+    // Submitted streams, then the streams being sent in turn.
+    std::deque<std::shared_ptr<Stream>> _pending;
+    std::deque<std::shared_ptr<Stream>> _sending;
+    uint32_t _next_stream;
+    // Limits announced by the receiver.
+    uint32_t _window;
+    uint32_t _max_streams;
+    // Streams opened and not yet finished by the receiver.
+    size_t _active;
+    // Set until Connect() and from Close(): no more streams are accepted.
+    bool _is_closing;
+    bool _is_failed;
+    std::chrono::steady_clock::time_point _start;
+    std::thread _sender;
+    std::thread _replies;
+};
@@ -0,0 +1,533 @@
+#include "shm_transport.h"
+#include "spin.h"
+#include "trace.h"
+#include "log.h"
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+
+// The rings are shared between processes, their atomics must not hide a lock.
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "lock-free atomics required");
+
+namespace {
+    const uint32_t region_magic = 0x54465348;
+    const uint32_t region_version = 1;
+    // Bytes of the ring from the accepting side, it only carries short replies.
+    const size_t reply_ring_size = 64 * 1024;
+    const size_t min_ring_size = 64 * 1024;
+    const size_t max_ring_size = static_cast<size_t>(1) << 30;
+    // Checks of a ring before sleeping on its futex, without a busy-poll time.
+    const int spin_count = 256;
+    // Sleeps are cut at this interval to check whether the peer is still there.
+    const long wait_timeout_ns = 100 * 1000 * 1000;
+    // Seals of the region: a peer shrinking it would make the other side fault with SIGBUS.
+    const int region_seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+    /**
+     * @brief Shared state of a single-producer single-consumer byte ring.
+     *
+     * head and tail count the bytes written and read since the start. A side
+     * about to sleep registers in the waiter count of the event it sleeps on,
+     * the other side bumps and wakes the event only when someone is registered.
+     */
+    struct RingControl {
+        // Written by the producer.
+        alignas(64) std::atomic<uint64_t> head;
+        std::atomic<uint32_t> data_event;
+        std::atomic<uint32_t> space_waiters;
+        std::atomic<uint32_t> is_writer_closed;
+        // Written by the consumer.
+        alignas(64) std::atomic<uint64_t> tail;
+        std::atomic<uint32_t> space_event;
+        std::atomic<uint32_t> data_waiters;
+        std::atomic<uint32_t> is_reader_closed;
+    };
+
+    /**
+     * @brief Start of the shared region, the data of both rings follows at data_offset.
+     */
+    struct RegionHeader {
+        uint32_t magic;
+        uint32_t version;
+        // Ring from the connecting side, then the ring from the accepting side.
+        uint64_t ring_sizes[2];
+        RingControl rings[2];
+    };
+
+    const size_t data_offset = (sizeof(RegionHeader) + 4095) / 4096 * 4096;
+
+    bool isPowerOfTwo(uint64_t value) {
+        return value != 0 && (value & (value - 1)) == 0;
+    }
+
+    size_t roundRingSize(size_t size) {
+        size_t rounded = min_ring_size;
+        while (rounded < size && rounded < max_ring_size) {
+            rounded *= 2;
+        }
+        return rounded;
+    }
+
+    void futexWait(std::atomic<uint32_t>& word, uint32_t value) {
+        struct timespec timeout = { 0, wait_timeout_ns };
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+    }
+
+    void futexWake(std::atomic<uint32_t>& word) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    /**
+     * @brief Wakes the sides sleeping on an event, without a system call if there are none.
+     */
+    void signal(std::atomic<uint32_t>& event, std::atomic<uint32_t>& waiters) {
+        if (waiters.load() > 0) {
+            event.fetch_add(1);
+            futexWake(event);
+        }
+    }
+
+    bool sendFd(tcpft_sock sock, int fd) {
+        char byte = 0;
+        struct iovec iov = { &byte, 1 };
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+        ssize_t nb;
+        do {
+            nb = sendmsg(sock, &msg, tcpft_nosignal);
+        } while (nb < 0 && errno == EINTR);
+        return nb == 1;
+    }
+
+    bool receiveFd(tcpft_sock sock, int& fd) {
+        char byte = 0;
+        struct iovec iov = { &byte, 1 };
+        union {
+            struct cmsghdr header;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control = {};
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t nb;
+        do {
+            nb = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        } while (nb < 0 && errno == EINTR);
+        struct cmsghdr* cmsg = nb == 1 ? CMSG_FIRSTHDR(&msg) : nullptr;
+        if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+            || cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+            return false;
+        }
+        std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+        return true;
+    }
+
+    /**
+     * @brief View of a ring from one side: its producer or its consumer.
+     *
+     * Positions are masked with the local copy of the size, so a corrupted
+     * control block cannot move an access out of the ring.
+     */
+    class Ring {
+    public:
+        void Attach(RingControl* control, char* data, uint64_t size) {
+            _control = control;
+            _data = data;
+            _size = static_cast<size_t>(size);
+        }
+
+        bool isAttached() const { return _control != nullptr; }
+        RingControl& control() { return *_control; }
+
+        /**
+         * @brief Copies up to len bytes into the free space and wakes the consumer.
+         *
+         * @return size_t Number of bytes written, 0 if the ring is full.
+         */
+        size_t Write(const char* buf, size_t len) {
+            uint64_t head = _control->head.load(std::memory_order_relaxed);
+            uint64_t used = head - _control->tail.load(std::memory_order_acquire);
+            size_t nb = static_cast<size_t>(std::min<uint64_t>(len, used < _size ? _size - used : 0));
+            if (nb == 0) {
+                return 0;
+            }
+            size_t offset = static_cast<size_t>(head) & (_size - 1);
+            size_t first = std::min(nb, _size - offset);
+            std::memcpy(_data + offset, buf, first);
+            std::memcpy(_data, buf + first, nb - first);
+            _control->head.store(head + nb);
+            signal(_control->data_event, _control->data_waiters);
+            return nb;
+        }
+
+        /**
+         * @brief Copies up to len bytes out of the ring and wakes the producer.
+         *
+         * @return size_t Number of bytes read, 0 if the ring is empty.
+         */
+        size_t Read(char* buf, size_t len) {
+            uint64_t tail = _control->tail.load(std::memory_order_relaxed);
+            uint64_t used = _control->head.load(std::memory_order_acquire) - tail;
+            size_t nb = static_cast<size_t>(std::min<uint64_t>(len, std::min<uint64_t>(used, _size)));
+            if (nb == 0) {
+                return 0;
+            }
+            size_t offset = static_cast<size_t>(tail) & (_size - 1);
+            size_t first = std::min(nb, _size - offset);
+            std::memcpy(buf, _data + offset, first);
+            std::memcpy(buf + first, _data, nb - first);
+            _control->tail.store(tail + nb);
+            signal(_control->space_event, _control->space_waiters);
+            return nb;
+        }
+
+        bool isReadable() const {
+            return _control->head.load() != _control->tail.load();
+        }
+
+        bool isWritable() const {
+            return _control->head.load() - _control->tail.load() < _size;
+        }
+
+    private:
+        RingControl* _control = nullptr;
+        char* _data = nullptr;
+        size_t _size = 0;
+    };
+
+    /**
+     * @brief Connection over two rings in a shared memory file, see createShmConnection().
+     */
+    class ShmConnection : public Connection {
+    public:
+        explicit ShmConnection(size_t ring_size) : _ring_size(roundRingSize(ring_size)) {}
+        explicit ShmConnection(tcpft_sock sock) : _socket(sock), _ring_size(0) {}
+        ~ShmConnection() override { Close(); }
+
+        status Connect(const std::string& dst_addr, uint16_t dst_port, bool is_nonblocking) override;
+
+        /**
+         * @brief Receives the shared memory file on an accepted socket and maps it.
+         *
+         * @return true on success, false if the handshake failed or the region is invalid.
+         */
+        bool Attach();
+
+        int Send(const char* buf, int len) override;
+        int64_t SendV(const tcpft_iovec* iov, size_t count) override;
+        int Receive(char* buf, int len) override;
+        bool isPeerLocal() override { return true; }
+        tcpft_sock sock() override { return static_cast<tcpft_sock>(-1); }
+        void setBusyPoll(uint32_t busy_poll_us) override { _busy_poll = std::chrono::microseconds(busy_poll_us); }
+        int Close() override;
+
+    private:
+        bool Map(int fd, size_t size);
+
+        /**
+         * @brief Spins, then sleeps on an event until ready() holds.
+         *
+         * @return true if ready, false if the peer went away.
+         */
+        template <typename Ready>
+        bool Wait(std::atomic<uint32_t>& event, std::atomic<uint32_t>& waiters, Ready ready);
+
+        bool isPeerGone();
+
+        // Unix domain socket of the handshake, kept open as a sign of life of the peer.
+        TCPClient _socket;
+        const size_t _ring_size;
+        char* _region = nullptr;
+        size_t _region_size = 0;
+        Ring _out;
+        Ring _in;
+        // Spin time of Wait(), spin_count checks if zero.
+        std::chrono::microseconds _busy_poll{ 0 };
+    };
+
+    status ShmConnection::Connect(const std::string& dst_addr, uint16_t, bool is_nonblocking) {
+        if (is_nonblocking) {
+            return status::TRANSPORT_NOT_SUPPORTED;
+        }
+        status st = _socket.ConnectUnix(dst_addr);
+        if (st != status::OK) {
+            return st;
+        }
+
+        size_t size = data_offset + _ring_size + reply_ring_size;
+        int fd = memfd_create("tcpft-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        bool is_ok = fd >= 0 && ftruncate(fd, static_cast<off_t>(size)) == 0
+                     && fcntl(fd, F_ADD_SEALS, region_seals) == 0 && Map(fd, size);
+        if (is_ok) {
+            RegionHeader* header = new (_region) RegionHeader();
+            header->magic = region_magic;
+            header->version = region_version;
+            header->ring_sizes[0] = _ring_size;
+            header->ring_sizes[1] = reply_ring_size;
+            _out.Attach(&header->rings[0], _region + data_offset, _ring_size);
+            _in.Attach(&header->rings[1], _region + data_offset + _ring_size, reply_ring_size);
+            is_ok = sendFd(_socket.sock(), fd);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!is_ok) {
+            tcpft_logCritical("shared memory setup failed");
+            Close();
+            return status::SOCKET_CONNECT_FAILED;
+        }
+        return status::OK;
+    }
+
+    bool ShmConnection::Attach() {
+        int fd = -1;
+        if (!receiveFd(_socket.sock(), fd)) {
+            return false;
+        }
+        // Only a sealed region keeps its size while it is mapped.
+        int seals = fcntl(fd, F_GET_SEALS);
+        struct stat info;
+        bool is_ok = seals >= 0 && (seals & region_seals) == region_seals
+                     && fstat(fd, &info) == 0 && info.st_size > static_cast<off_t>(data_offset)
+                     && Map(fd, static_cast<size_t>(info.st_size));
+        close(fd);
+        if (!is_ok) {
+            return false;
+        }
+
+        // The sizes are copied before use, the peer may still change the header.
+        RegionHeader* header = reinterpret_cast<RegionHeader*>(_region);
+        uint64_t forward_size = header->ring_sizes[0];
+        uint64_t reply_size = header->ring_sizes[1];
+        uint64_t data_size = _region_size - data_offset;
+        if (header->magic != region_magic || header->version != region_version
+            || !isPowerOfTwo(forward_size) || !isPowerOfTwo(reply_size)
+            || forward_size > data_size || reply_size != data_size - forward_size) {
+            return false;
+        }
+        _in.Attach(&header->rings[0], _region + data_offset, forward_size);
+        _out.Attach(&header->rings[1], _region + data_offset + forward_size, reply_size);
+        return true;
+    }
+
+    bool ShmConnection::Map(int fd, size_t size) {
+        void* region = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (region == MAP_FAILED) {
+            return false;
+        }
+        _region = static_cast<char*>(region);
+        _region_size = size;
+        return true;
+    }
+
+    int ShmConnection::Send(const char* buf, int len) {
+        TraceSpan span("send");
+        if (!_out.isAttached()) {
+            errno = ENOTCONN;
+            return -1;
+        }
+        RingControl& out = _out.control();
+        for (;;) {
+            if (out.is_reader_closed.load() != 0) {
+                errno = EPIPE;
+                return -1;
+            }
+            size_t nb = _out.Write(buf, static_cast<size_t>(len));
+            if (nb > 0 || len <= 0) {
+                return static_cast<int>(nb);
+            }
+            bool is_ready = Wait(out.space_event, out.space_waiters, [this, &out] {
+                return _out.isWritable() || out.is_reader_closed.load() != 0;
+            });
+            if (!is_ready) {
+                errno = EPIPE;
+                return -1;
+            }
+        }
+    }
+
+    int64_t ShmConnection::SendV(const tcpft_iovec* iov, size_t count) {
+        int64_t total = 0;
+        for (size_t idx = 0; idx < count; ++idx) {
+            size_t sent = 0;
+            while (sent < iov[idx].len) {
+                int nb = Send(iov[idx].data + sent, static_cast<int>(std::min<size_t>(iov[idx].len - sent, INT_MAX)));
+                if (nb < 0) {
+                    return -1;
+                }
+                sent += nb;
+            }
+            total += sent;
+        }
+        return total;
+    }
+
+    int ShmConnection::Receive(char* buf, int len) {
+        TraceSpan span("recv");
+        if (!_in.isAttached()) {
+            errno = ENOTCONN;
+            return -1;
+        }
+        RingControl& in = _in.control();
+        for (;;) {
+            size_t nb = _in.Read(buf, static_cast<size_t>(len));
+            if (nb > 0 || len <= 0) {
+                return static_cast<int>(nb);
+            }
+            if (in.is_writer_closed.load() != 0) {
+                // Data written before the close is visible now.
+                return static_cast<int>(_in.Read(buf, static_cast<size_t>(len)));
+            }
+            bool is_ready = Wait(in.data_event, in.data_waiters, [this, &in] {
+                return _in.isReadable() || in.is_writer_closed.load() != 0;
+            });
+            if (!is_ready) {
+                errno = ECONNRESET;
+                return -1;
+            }
+        }
+    }
+
+    int ShmConnection::Close() {
+        if (_in.isAttached()) {
+            RingControl& out = _out.control();
+            RingControl& in = _in.control();
+            out.is_writer_closed.store(1);
+            signal(out.data_event, out.data_waiters);
+            in.is_reader_closed.store(1);
+            signal(in.space_event, in.space_waiters);
+            _out = Ring();
+            _in = Ring();
+        }
+        if (_region != nullptr) {
+            munmap(_region, _region_size);
+            _region = nullptr;
+        }
+        return _socket.Close();
+    }
+
+    template <typename Ready>
+    bool ShmConnection::Wait(std::atomic<uint32_t>& event, std::atomic<uint32_t>& waiters, Ready ready) {
+        if (_busy_poll.count() > 0) {
+            SpinBackoff backoff(_busy_poll);
+            do {
+                if (ready()) {
+                    return true;
+                }
+            } while (backoff.Pause());
+        }
+        else {
+            for (int spin = 0; spin < spin_count; ++spin) {
+                if (ready()) {
+                    return true;
+                }
+            }
+        }
+        for (;;) {
+            // Registered before the check: a change after it bumps the event and fails the wait.
+            waiters.fetch_add(1);
+            uint32_t seen = event.load();
+            bool is_ready = ready();
+            if (!is_ready) {
+                futexWait(event, seen);
+            }
+            waiters.fetch_sub(1);
+            if (is_ready || ready()) {
+                return true;
+            }
+            if (isPeerGone()) {
+                return false;
+            }
+        }
+    }
+
+    bool ShmConnection::isPeerGone() {
+        // Nothing is sent over the socket after the handshake, readable means closed.
+        pollfd fd = {};
+        fd.fd = _socket.sock();
+        fd.events = POLLIN;
+        return poll(&fd, 1, 0) > 0;
+    }
+
+    /**
+     * @brief Listener on a Unix domain socket handing out shared memory connections.
+     */
+    class ShmListener : public Listener {
+    public:
+        status Init(const std::string& src_addr, uint16_t) override {
+            return _server.InitUnix(src_addr);
+        }
+
+        std::unique_ptr<Connection> Accept() override {
+            tcpft_sock sock = _server.Accept();
+            if (sock == static_cast<tcpft_sock>(-1)) {
+                return nullptr;
+            }
+            std::unique_ptr<ShmConnection> connection(new ShmConnection(sock));
+            if (!connection->Attach()) {
+                tcpft_logCritical("shared memory handshake failed");
+                return nullptr;
+            }
+            return std::unique_ptr<Connection>(connection.release());
+        }
+
+        tcpft_sock sock() override {
+            return _server.sock();
+        }
+
+        int Close() override {
+            return _server.Close();
+        }
+
+    private:
+        TCPServer _server;
+    };
+}
+
+std::unique_ptr<Connection> createShmConnection(size_t ring_size) {
+    return std::unique_ptr<Connection>(new ShmConnection(ring_size));
+}
+
+std::unique_ptr<Listener> createShmListener() {
+    return std::unique_ptr<Listener>(new ShmListener());
+}
+
+#else
+
+std::unique_ptr<Connection> createShmConnection(size_t) {
+    return nullptr;
+}
+
+std::unique_ptr<Listener> createShmListener() {
+    return nullptr;
+}
+
+#endif
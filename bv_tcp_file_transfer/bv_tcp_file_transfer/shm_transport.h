@@ -0,0 +1,27 @@
+#pragma once
+
+#include "transport.h"
+
+#include <stddef.h>
+#include <memory>
+
+/**
+ * @brief Creates a connection over rings in shared memory.
+ *
+ * The connecting side creates an anonymous memory file with one ring per
+ * direction and passes its descriptor to the listener over a Unix domain
+ * socket. The data then goes through the rings without system calls, a side
+ * sleeps on a futex only while its ring is empty or full. The socket stays
+ * open to detect a peer that exits without closing.
+ *
+ * @param ring_size Bytes of the ring from the connecting to the accepting side.
+ * @return std::unique_ptr<Connection> Connection, nullptr if not supported on this platform.
+ */
+std::unique_ptr<Connection> createShmConnection(size_t ring_size);
+
+/**
+ * @brief Creates a listener for connections made by createShmConnection().
+ *
+ * @return std::unique_ptr<Listener> Listener, nullptr if not supported on this platform.
+ */
+std::unique_ptr<Listener> createShmListener();
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define tcpft_cpurelax() _mm_pause()
+#elif defined(_M_ARM64)
+#include <intrin.h>
+#define tcpft_cpurelax() __yield()
+#elif defined(__aarch64__) || defined(__arm__)
+#define tcpft_cpurelax() __asm__ __volatile__("yield")
+#else
+#define tcpft_cpurelax() std::this_thread::yield()
+#endif
+
+/**
+ * @brief Bounded backoff of a thread polling for a condition instead of sleeping.
+ *
+ * Every Pause() spins twice as many CPU pauses as the previous one, up to
+ * max_pauses, so a condition met at once is seen within a few nanoseconds
+ * while a longer poll leaves the core and the memory bus mostly to the peer.
+ * Once the spin time has passed Pause() fails and the caller blocks instead.
+ *
+ * Usage: do { if (ready()) return; } while (backoff.Pause()); then sleep.
+ */
+class SpinBackoff {
+public:
+    static const uint32_t max_pauses = 64;
+
+    /**
+     * @brief Starts spinning.
+     *
+     * @param spin_time Time to spin before Pause() fails.
+     */
+    explicit SpinBackoff(std::chrono::nanoseconds spin_time)
+        : _deadline(std::chrono::steady_clock::now() + spin_time), _pauses(1)
+    {}
+
+    /**
+     * @brief Spins before the next check of the condition.
+     *
+     * @return true to check again, false when the spin time is over.
+     */
+    bool Pause() {
+        if (std::chrono::steady_clock::now() >= _deadline) {
+            return false;
+        }
+        for (uint32_t idx = 0; idx < _pauses; ++idx) {
+            tcpft_cpurelax();
+        }
+        if (_pauses < max_pauses) {
+            _pauses *= 2;
+        }
+        return true;
+    }
+
+private:
+    const std::chrono::steady_clock::time_point _deadline;
+    uint32_t _pauses;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * @brief Counters of the last transfer made by FOSocket/FISocket.
+ */
+struct TransferStats {
+    uint64_t bytes = 0;
+    uint64_t chunks = 0;
+    uint64_t elapsed_us = 0;
+    // Chunk size and queue depth in effect at the end of the transfer.
+    size_t chunk_size = 0;
+    size_t queue_depth = 0;
+    // Last measured round-trip time, 0 if unknown.
+    uint32_t rtt_us = 0;
+    // Blocks read ahead of the sender, 0 if no prefetch was done.
+    size_t prefetch_depth = 0;
+    // Bytes of holes skipped by a sparse transfer, set by the sender.
+    uint64_t hole_bytes = 0;
+    // The receiver copied the file on its host, bytes is the file size.
+    bool is_local_copy = false;
+    // Streams finished in a session, bytes and chunks count their data and frames.
+    uint64_t streams = 0;
+    // Chunk memory reserved from the system and whether huge pages back it.
+    size_t memory_reserved = 0;
+    bool is_hugepage_backed = false;
+    // Time spent waiting for the shared memory budget, 0 without one.
+    uint64_t budget_wait_us = 0;
+
+    /**
+     * @brief Returns the average throughput.
+     *
+     * @return double Bytes per second.
+     */
+    double throughput() const {
+        return elapsed_us ? bytes * 1e6 / elapsed_us : 0.0;
+    }
+};
@@ -11,5 +11,6 @@ enum class status {
     INVALID_ADDRESS = -4,
     SOCKET_BIND_FAILED = -5,
     SOCKET_LISTEN_FAILED = -6,
-    SOCKET_CONNECT_FAILED = -7
+    SOCKET_CONNECT_FAILED = -7,
+    TRANSPORT_NOT_SUPPORTED = -8
 };
@@ -1,7 +1,18 @@
 #include "tcp_client_server.h"
+#include "spin.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <vector>
 
-status TCPClient::Connect(const std::string& dst_addr, const uint16_t dst_port) {
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+
+status TCPClient::Connect(const std::string& dst_addr, const uint16_t dst_port, bool is_nonblocking,
+                          bool is_fast_open) {
     status st = WSAStartupIfNeeded();
     if (st != status::OK) {
         return st;
@@ -21,7 +32,58 @@ status TCPClient::Connect(const std::string& dst_addr, const uint16_t dst_port)
         return status::INVALID_ADDRESS;
     }
 
-    if (connect(_sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+    if (is_nonblocking && !tcpft_setnonblocking(_sock)) {
+        WSACleanupIfNeeded();
+        return status::SOCKET_CREATE_FAILED;
+    }
+
+#ifdef TCP_FASTOPEN_CONNECT
+    // connect() returns at once, the first send carries the SYN and its data.
+    // Failing to set the option only costs the round trip of a regular handshake.
+    if (is_fast_open && !is_nonblocking) {
+        int enable = 1;
+        tcpft_setsockopt(_sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &enable, sizeof(enable));
+    }
+#else
+    (void)is_fast_open;
+#endif
+
+    if (connect(_sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0
+        && !(is_nonblocking && tcpft_isinprogress(tcpft_lasterror()))) {
+        WSACleanupIfNeeded();
+        return status::SOCKET_CONNECT_FAILED;
+    }
+
+    return status::OK;
+}
+
+status TCPClient::ConnectUnix(const std::string& path, bool is_nonblocking) {
+    status st = WSAStartupIfNeeded();
+    if (st != status::OK) {
+        return st;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        WSACleanupIfNeeded();
+        return status::INVALID_ADDRESS;
+    }
+    std::memcpy(addr.sun_path, path.data(), path.size());
+
+    _sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_sock < 0) {
+        WSACleanupIfNeeded();
+        return status::SOCKET_CREATE_FAILED;
+    }
+
+    if (is_nonblocking && !tcpft_setnonblocking(_sock)) {
+        WSACleanupIfNeeded();
+        return status::SOCKET_CREATE_FAILED;
+    }
+
+    if (connect(_sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0
+        && !(is_nonblocking && tcpft_isinprogress(tcpft_lasterror()))) {
         WSACleanupIfNeeded();
         return status::SOCKET_CONNECT_FAILED;
     }
@@ -29,12 +91,129 @@ status TCPClient::Connect(const std::string& dst_addr, const uint16_t dst_port)
     return status::OK;
 }
 
-int TCPClient::Send(char* buf, int len, int flags) {
+int TCPClient::Send(const char* buf, int len, int flags) {
     return send(_sock, buf, len, flags);
 }
 
+int64_t TCPClient::SendV(const tcpft_iovec* iov, size_t count) {
+#ifdef _WIN32
+    std::vector<WSABUF> bufs(count);
+    for (size_t idx = 0; idx < count; ++idx) {
+        bufs[idx].buf = const_cast<char*>(iov[idx].data);
+        bufs[idx].len = static_cast<ULONG>(iov[idx].len);
+    }
+    // A blocking WSASend completes only when all blocks are sent.
+    DWORD sent = 0;
+    if (WSASend(_sock, bufs.data(), static_cast<DWORD>(count), &sent, 0, nullptr, nullptr) != 0) {
+        return -1;
+    }
+    return static_cast<int64_t>(sent);
+#else
+    std::vector<struct iovec> bufs(count);
+    for (size_t idx = 0; idx < count; ++idx) {
+        bufs[idx].iov_base = const_cast<char*>(iov[idx].data);
+        bufs[idx].iov_len = iov[idx].len;
+    }
+
+    int64_t total = 0;
+    size_t idx = 0;
+    while (idx < count) {
+        struct msghdr msg = {};
+        msg.msg_iov = &bufs[idx];
+        msg.msg_iovlen = count - idx;
+        ssize_t nb = sendmsg(_sock, &msg, tcpft_nosignal);
+        if (nb < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += nb;
+
+        // Skip the blocks sent completely and advance inside the partially sent one.
+        size_t left = static_cast<size_t>(nb);
+        while (idx < count && left >= bufs[idx].iov_len) {
+            left -= bufs[idx].iov_len;
+            ++idx;
+        }
+        if (idx < count) {
+            bufs[idx].iov_base = static_cast<char*>(bufs[idx].iov_base) + left;
+            bufs[idx].iov_len -= left;
+        }
+    }
+    return total;
+#endif
+}
+
+int TCPClient::Receive(char* buf, int len, int flags) {
+    if (_busy_poll_us > 0) {
+        PollReadable();
+    }
+    return recv(_sock, buf, len, flags);
+}
+
+void TCPClient::setBusyPoll(uint32_t busy_poll_us) {
+    _busy_poll_us = busy_poll_us;
+#ifdef SO_BUSY_POLL
+    if (busy_poll_us > 0) {
+        int value = static_cast<int>(std::min<uint32_t>(busy_poll_us, INT_MAX));
+        // Without the permission the polling of Receive() still applies.
+        tcpft_setsockopt(_sock, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof(value));
+    }
+#endif
+}
+
+void TCPClient::PollReadable() {
+    const std::chrono::microseconds spin_time(_busy_poll_us);
+    SpinBackoff backoff(spin_time);
+    do {
+        // Readable also at the end of the stream and on errors, recv() reports them.
+#ifdef _WIN32
+        WSAPOLLFD fd = {};
+        fd.fd = _sock;
+        fd.events = POLLRDNORM;
+        if (WSAPoll(&fd, 1, 0) != 0) {
+            return;
+        }
+#else
+        pollfd fd = {};
+        fd.fd = _sock;
+        fd.events = POLLIN;
+        if (poll(&fd, 1, 0) != 0) {
+            return;
+        }
+#endif
+    } while (backoff.Pause());
+}
+
+uint32_t TCPClient::rtt() {
+#if defined(_WIN32) && defined(SIO_TCP_INFO)
+    DWORD version = 0;
+    TCP_INFO_v0 info = {};
+    DWORD nb = 0;
+    if (WSAIoctl(_sock, SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &nb, nullptr, nullptr) != 0) {
+        return 0;
+    }
+    return static_cast<uint32_t>(info.RttUs);
+#elif defined(TCP_INFO)
+    struct tcp_info info = {};
+    socklen_t len = sizeof(info);
+    if (getsockopt(_sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        return 0;
+    }
+    return info.tcpi_rtt;
+#else
+    return 0;
+#endif
+}
+
 int TCPClient::Close() {
-    return tcpft_closesocket(_sock);
+    if (_sock == static_cast<tcpft_sock>(-1)) {
+        return 0;
+    }
+    int result = tcpft_closesocket(_sock);
+    _sock = static_cast<tcpft_sock>(-1);
+    return result;
 }
 
 tcpft_sock TCPClient::sock() {
@@ -3,6 +3,7 @@
 #include "status.h"
 
 #include <stdint.h>
+#include <errno.h>
 #include <string>
 
 #define NOMINMAX
@@ -10,9 +11,17 @@
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mstcpip.h>
+#include <afunix.h>
 #pragma comment(lib, "ws2_32.lib")
 #else
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 
@@ -20,11 +29,81 @@
 using tcpft_sock = SOCKET;
 #define tcpft_closesocket closesocket
 #define tcpft_setsockopt(socket, level, optname, optval, optlen) setsockopt(socket, level, optname, (const char*)(optval), optlen)
+#define tcpft_lasterror() WSAGetLastError()
+#define tcpft_istimeout(err) ((err) == WSAETIMEDOUT || (err) == WSAEWOULDBLOCK)
+#define tcpft_isinprogress(err) ((err) == WSAEWOULDBLOCK)
+#define tcpft_nosignal 0
 #else
 using tcpft_sock = int;
 #define tcpft_closesocket close
 #define tcpft_setsockopt(socket, level, optname, optval, optlen) setsockopt(socket, level, optname, optval, optlen)
+#define tcpft_lasterror() errno
+#define tcpft_istimeout(err) ((err) == EAGAIN || (err) == EWOULDBLOCK || (err) == EINTR)
+#define tcpft_isinprogress(err) ((err) == EINPROGRESS)
+#ifdef MSG_NOSIGNAL
+#define tcpft_nosignal MSG_NOSIGNAL
+#else
+#define tcpft_nosignal 0
+#endif
+#endif
+
+/**
+ * @brief Switches a socket to non-blocking mode.
+ *
+ * @param sock Socket.
+ * @return true on success, false otherwise.
+ */
+inline bool tcpft_setnonblocking(tcpft_sock sock) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags >= 0 && fcntl(sock, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+/**
+ * @brief Switches a socket back to blocking mode.
+ *
+ * @param sock Socket.
+ * @return true on success, false otherwise.
+ */
+inline bool tcpft_setblocking(tcpft_sock sock) {
+#ifdef _WIN32
+    u_long mode = 0;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    return flags >= 0 && fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) == 0;
 #endif
+}
+
+/**
+ * @brief Checks whether the peer of a connected socket runs on this host.
+ *
+ * @param sock Connected socket.
+ * @return true if the peer address is a loopback address or the local address of the connection.
+ */
+inline bool tcpft_ispeerlocal(tcpft_sock sock) {
+    sockaddr_in local{};
+    sockaddr_in peer{};
+    socklen_t local_len = sizeof(local);
+    socklen_t peer_len = sizeof(peer);
+    if (getsockname(sock, reinterpret_cast<sockaddr*>(&local), &local_len) != 0
+        || getpeername(sock, reinterpret_cast<sockaddr*>(&peer), &peer_len) != 0 || peer.sin_family != AF_INET) {
+        return false;
+    }
+    return (ntohl(peer.sin_addr.s_addr) >> 24) == 127 || peer.sin_addr.s_addr == local.sin_addr.s_addr;
+}
+
+/**
+ * @brief Data block of a vectored send.
+ */
+struct tcpft_iovec {
+    const char* data;
+    size_t len;
+};
 
 /**
  * @brief TCP Server class for accepting incoming connections.
@@ -40,11 +119,25 @@ public:
     /**
      * @brief Initializes the server with the source address and port.
      *
+     * With is_fast_open the server accepts data in the SYN of TCP Fast Open
+     * clients, if the system allows it; otherwise the option has no effect.
+     *
      * @param src_addr Source IP address.
      * @param src_port Source port.
+     * @param is_fast_open true to enable TCP Fast Open.
      * @return status Error status.
      */
-    status Init(const std::string& src_addr, uint16_t src_port);
+    status Init(const std::string& src_addr, uint16_t src_port, bool is_fast_open = false);
+
+    /**
+     * @brief Initializes the server on a Unix domain socket.
+     *
+     * A stale socket file at the path is removed first, the file is removed again on Close().
+     *
+     * @param path Path of the socket file.
+     * @return status Error status.
+     */
+    status InitUnix(const std::string& path);
 
     /**
      * @brief Accepts an incoming connection.
@@ -64,6 +157,17 @@ public:
      */
     int Receive(tcpft_sock sock, char* buf, int len, int flags);
 
+    /**
+     * @brief Sends data over an accepted socket.
+     *
+     * @param sock The socket to send to.
+     * @param buf Pointer to data buffer.
+     * @param len Length of data.
+     * @param flags Flags for send().
+     * @return int Number of bytes sent.
+     */
+    int Send(tcpft_sock sock, const char* buf, int len, int flags);
+
     /**
      * @brief Closes the server socket.
      *
@@ -80,6 +184,8 @@ public:
 
 private:
     tcpft_sock _sock;
+    // Socket file removed on Close(), empty for TCP.
+    std::string _unix_path;
 
 private:
     status WSAStartupIfNeeded();
@@ -91,17 +197,45 @@ private:
  */
 class TCPClient {
 public:
-    explicit TCPClient() : _sock(-1) {}
+    explicit TCPClient() : _sock(-1), _busy_poll_us(0) {}
+
+    /**
+     * @brief Takes ownership of a connected socket, e.g. one returned by TCPServer::Accept().
+     *
+     * @param sock Connected socket.
+     */
+    explicit TCPClient(tcpft_sock sock) : _sock(sock), _busy_poll_us(0) {}
     ~TCPClient() { Close(); }
 
     /**
      * @brief Connects to the given destination address and port.
      *
+     * With is_nonblocking the socket is switched to non-blocking mode and the
+     * call returns while the connection is in progress, wait for the socket to
+     * become writable to complete it.
+     *
+     * With is_fast_open the SYN is deferred until the first send and carries
+     * its data (TCP_FASTOPEN_CONNECT, Linux), the connection then falls back
+     * to a regular handshake if the server has no Fast Open cookie for us.
+     * Ignored with is_nonblocking and where the system does not support it.
+     *
      * @param dst_addr Destination IP address.
      * @param dst_port Destination port.
+     * @param is_nonblocking true to connect without blocking.
+     * @param is_fast_open true to use TCP Fast Open.
      * @return status Error status.
      */
-    status Connect(const std::string& dst_addr, const uint16_t dst_port);
+    status Connect(const std::string& dst_addr, const uint16_t dst_port, bool is_nonblocking = false,
+                   bool is_fast_open = false);
+
+    /**
+     * @brief Connects to a server listening on a Unix domain socket.
+     *
+     * @param path Path of the socket file.
+     * @param is_nonblocking true to connect without blocking.
+     * @return status Error status.
+     */
+    status ConnectUnix(const std::string& path, bool is_nonblocking = false);
 
     /**
      * @brief Sends data over the connected socket.
@@ -111,7 +245,48 @@ public:
      * @param flags Flags for send().
      * @return int Number of bytes sent.
      */
-    int Send(char* buf, int len, int flags);
+    int Send(const char* buf, int len, int flags);
+
+    /**
+     * @brief Sends several data blocks with a single vectored call.
+     *
+     * Partial sends are continued until all blocks are sent.
+     *
+     * @param iov Array of data blocks.
+     * @param count Number of data blocks.
+     * @return int64_t Number of bytes sent, -1 on error.
+     */
+    int64_t SendV(const tcpft_iovec* iov, size_t count);
+
+    /**
+     * @brief Receives data from the connected socket.
+     *
+     * @param buf Buffer to store the received data.
+     * @param len Maximum length to receive.
+     * @param flags Flags for recv().
+     * @return int Number of bytes received.
+     */
+    int Receive(char* buf, int len, int flags);
+
+    /**
+     * @brief Makes Receive() poll the socket before it blocks.
+     *
+     * Receive() then checks the socket without blocking, with growing pauses,
+     * for up to busy_poll_us microseconds before it calls a blocking recv().
+     * The socket also busy-polls the device queue for that long in the kernel
+     * (SO_BUSY_POLL, Linux), where the system allows it: raising it above
+     * net.core.busy_read needs CAP_NET_ADMIN.
+     *
+     * @param busy_poll_us Microseconds to poll, 0 to block at once.
+     */
+    void setBusyPoll(uint32_t busy_poll_us);
+
+    /**
+     * @brief Returns the smoothed round-trip time of the connection.
+     *
+     * @return uint32_t RTT in microseconds, 0 if not available.
+     */
+    uint32_t rtt();
 
     /**
      * @brief Closes the client socket.
@@ -129,8 +304,11 @@ public:
 
 private:
     tcpft_sock _sock;
+    uint32_t _busy_poll_us;
 
 private:
+    // Waits for data for up to the busy-poll time without blocking.
+    void PollReadable();
     status WSAStartupIfNeeded();
     status WSACleanupIfNeeded();
 };
\ No newline at end of file
@@ -1,7 +1,10 @@
 #include "tcp_client_server.h"
 #include "log.h"
 
-status TCPServer::Init(const std::string& src_addr, uint16_t src_port) {
+#include <cstdio>
+#include <cstring>
+
+status TCPServer::Init(const std::string& src_addr, uint16_t src_port, bool is_fast_open) {
     tcpft_logInfo("starting tcp server...");
     status st = WSAStartupIfNeeded();
     if (st != status::OK) {
@@ -20,6 +23,12 @@ status TCPServer::Init(const std::string& src_addr, uint16_t src_port) {
     timeout.tv_usec = 0;
     tcpft_setsockopt(_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
+#ifndef _WIN32
+    // Allow restarting on the same port while old connections are in TIME_WAIT.
+    int reuse = 1;
+    tcpft_setsockopt(_sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(src_port);
@@ -33,7 +42,23 @@ status TCPServer::Init(const std::string& src_addr, uint16_t src_port) {
         return status::SOCKET_BIND_FAILED;
     }
 
-    if (listen(_sock, 1) < 0) {
+#ifdef TCP_FASTOPEN
+    if (is_fast_open) {
+        // The value is the queue of pending Fast Open connections, a switch on Windows.
+#ifdef _WIN32
+        DWORD queue = 1;
+#else
+        int queue = SOMAXCONN;
+#endif
+        if (tcpft_setsockopt(_sock, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) != 0) {
+            tcpft_logInfo("tcp fast open is not available");
+        }
+    }
+#else
+    (void)is_fast_open;
+#endif
+
+    if (listen(_sock, SOMAXCONN) < 0) {
         WSACleanupIfNeeded();
         return status::SOCKET_LISTEN_FAILED;
     }
@@ -42,6 +67,50 @@ status TCPServer::Init(const std::string& src_addr, uint16_t src_port) {
     return status::OK;
 }
 
+status TCPServer::InitUnix(const std::string& path) {
+    tcpft_logInfo("starting unix socket server...");
+    status st = WSAStartupIfNeeded();
+    if (st != status::OK) {
+        return st;
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        WSACleanupIfNeeded();
+        return status::INVALID_ADDRESS;
+    }
+    std::memcpy(addr.sun_path, path.data(), path.size());
+
+    _sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_sock < 0) {
+        WSACleanupIfNeeded();
+        return status::SOCKET_CREATE_FAILED;
+    }
+
+    // Set receive timeout, as for TCP
+    struct timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    tcpft_setsockopt(_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // A socket file left by a previous server would fail the bind.
+    std::remove(path.c_str());
+    if (bind(_sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        WSACleanupIfNeeded();
+        return status::SOCKET_BIND_FAILED;
+    }
+    _unix_path = path;
+
+    if (listen(_sock, SOMAXCONN) < 0) {
+        WSACleanupIfNeeded();
+        return status::SOCKET_LISTEN_FAILED;
+    }
+
+    tcpft_logInfo("unix socket server started successfully");
+    return status::OK;
+}
+
 tcpft_sock TCPServer::Accept() {
     return accept(_sock, nullptr, nullptr);
 }
@@ -50,8 +119,21 @@ int TCPServer::Receive(tcpft_sock sock, char* buf, int len, int flags) {
     return recv(sock, buf, len, flags);
 }
 
+int TCPServer::Send(tcpft_sock sock, const char* buf, int len, int flags) {
+    return send(sock, buf, len, flags);
+}
+
 int TCPServer::Close() {
-    return tcpft_closesocket(_sock);
+    if (_sock == static_cast<tcpft_sock>(-1)) {
+        return 0;
+    }
+    int result = tcpft_closesocket(_sock);
+    _sock = static_cast<tcpft_sock>(-1);
+    if (!_unix_path.empty()) {
+        std::remove(_unix_path.c_str());
+        _unix_path.clear();
+    }
+    return result;
 }
 
 tcpft_sock TCPServer::sock() {
@@ -1,4 +1,7 @@
 #pragma once
 
 #include "fsocket.h"
+#include "session.h"
+#include "connection_pool.h"
+#include "trace.h"
 #include "log.h"
@@ -0,0 +1,112 @@
+#include "trace.h"
+
+#include <fstream>
+#include <iomanip>
+
+thread_local Tracer::ThreadLog* Tracer::_current = nullptr;
+
+namespace {
+    // Writes a JSON string literal.
+    void writeString(std::ostream& out, const std::string& str) {
+        out << '"';
+        for (char ch : str) {
+            if (ch == '"' || ch == '\\') {
+                out << '\\' << ch;
+            }
+            else if (static_cast<unsigned char>(ch) < 0x20) {
+                out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(ch)
+                    << std::dec << std::setfill(' ');
+            }
+            else {
+                out << ch;
+            }
+        }
+        out << '"';
+    }
+
+    // Writes nanoseconds as the microseconds of trace events.
+    void writeMicroseconds(std::ostream& out, uint64_t ns) {
+        out << ns / 1000 << '.' << std::setw(3) << std::setfill('0') << ns % 1000 << std::setfill(' ');
+    }
+}
+
+Tracer::Tracer(size_t max_events) : _max_events(max_events), _origin(std::chrono::steady_clock::now()) {}
+
+void Tracer::Write(std::ostream& out) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool is_first = true;
+    for (const std::unique_ptr<ThreadLog>& log : _logs) {
+        out << (is_first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << log->tid
+            << ",\"args\":{\"name\":";
+        writeString(out, log->name);
+        out << "}}";
+        is_first = false;
+
+        size_t count = log->count.load(std::memory_order_acquire);
+        for (size_t idx = 0; idx < count; ++idx) {
+            const Event& event = log->events[idx];
+            // Complete events: a begin time and a duration.
+            out << ",\n{\"name\":";
+            writeString(out, event.name);
+            out << ",\"cat\":\"tcpft\",\"ph\":\"X\",\"pid\":1,\"tid\":" << log->tid << ",\"ts\":";
+            writeMicroseconds(out, event.begin_ns);
+            out << ",\"dur\":";
+            writeMicroseconds(out, event.end_ns - event.begin_ns);
+            out << '}';
+        }
+    }
+    out << "\n]}\n";
+}
+
+bool Tracer::Export(const std::string& path) const {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        return false;
+    }
+    Write(out);
+    out.close();
+    return !out.fail();
+}
+
+uint64_t Tracer::events() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint64_t total = 0;
+    for (const std::unique_ptr<ThreadLog>& log : _logs) {
+        total += log->count.load(std::memory_order_acquire);
+    }
+    return total;
+}
+
+uint64_t Tracer::dropped() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint64_t total = 0;
+    for (const std::unique_ptr<ThreadLog>& log : _logs) {
+        total += log->dropped.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+Tracer::ThreadLog* Tracer::Register(const char* name) {
+    std::unique_ptr<ThreadLog> log(new ThreadLog());
+    log->name = name;
+    log->origin = _origin;
+    log->events.reset(new Event[_max_events]);
+    log->capacity = _max_events;
+    std::lock_guard<std::mutex> lock(_mutex);
+    log->tid = static_cast<uint32_t>(_logs.size() + 1);
+    _logs.push_back(std::move(log));
+    return _logs.back().get();
+}
+
+TraceThread::TraceThread(Tracer* tracer, const char* name) : _prev(Tracer::_current), _is_active(tracer != nullptr) {
+    if (_is_active) {
+        Tracer::_current = tracer->Register(name);
+    }
+}
+
+TraceThread::~TraceThread() {
+    if (_is_active) {
+        Tracer::_current = _prev;
+    }
+}
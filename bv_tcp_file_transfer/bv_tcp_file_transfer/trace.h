@@ -0,0 +1,177 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Timeline of the pipeline stages of transfers, in Chrome trace-event format.
+ *
+ * A thread joins the trace with a TraceThread, then every TraceSpan it runs
+ * (file read and write, send, recv, queue push and pop, waits on queues)
+ * is recorded as a begin/end pair into the thread's own log, without locks.
+ * Write() exports the logs as trace-event JSON, which chrome://tracing and
+ * Perfetto show as one track per thread, so it is visible when the reader,
+ * the socket thread and the writer are idle relative to each other.
+ *
+ * Set in TransferConfig::tracer, must outlive the transfers using it.
+ */
+class Tracer {
+public:
+    /**
+     * @brief Recorded span.
+     */
+    struct Event {
+        // Static string naming the stage.
+        const char* name;
+        // Nanoseconds since the construction of the tracer.
+        uint64_t begin_ns;
+        uint64_t end_ns;
+    };
+
+    /**
+     * @brief Events of one thread, appended by that thread only.
+     */
+    struct ThreadLog {
+        std::string name;
+        uint32_t tid = 0;
+        std::chrono::steady_clock::time_point origin;
+        std::unique_ptr<Event[]> events;
+        size_t capacity = 0;
+        // Published with release order, so Write() may run concurrently.
+        std::atomic<size_t> count;
+        std::atomic<uint64_t> dropped;
+
+        ThreadLog() : count(0), dropped(0) {}
+
+        void Add(const char* event_name, uint64_t begin_ns, uint64_t end_ns) {
+            size_t idx = count.load(std::memory_order_relaxed);
+            if (idx >= capacity) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            events[idx] = Event{ event_name, begin_ns, end_ns };
+            count.store(idx + 1, std::memory_order_release);
+        }
+
+        uint64_t now() const {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - origin).count());
+        }
+    };
+
+    /**
+     * @brief Constructs a tracer.
+     *
+     * @param max_events Events kept per thread, later ones are dropped.
+     */
+    explicit Tracer(size_t max_events = 64 * 1024);
+
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    /**
+     * @brief Writes the events of all threads as a trace-event JSON object.
+     *
+     * @param out Output stream.
+     */
+    void Write(std::ostream& out) const;
+
+    /**
+     * @brief Writes the trace into a file, see Write().
+     *
+     * @param path Path to the output file.
+     * @return true on success, false if the file could not be written.
+     */
+    bool Export(const std::string& path) const;
+
+    /**
+     * @brief Returns the number of events recorded by all threads.
+     */
+    uint64_t events() const;
+
+    /**
+     * @brief Returns the number of events dropped by full thread logs.
+     */
+    uint64_t dropped() const;
+
+    /**
+     * @brief Returns the log the calling thread records into, nullptr if it is not traced.
+     */
+    static ThreadLog* current() { return _current; }
+
+private:
+    friend class TraceThread;
+
+    ThreadLog* Register(const char* name);
+
+    const size_t _max_events;
+    const std::chrono::steady_clock::time_point _origin;
+    // Guards the list of logs, not their events.
+    mutable std::mutex _mutex;
+    std::vector<std::unique_ptr<ThreadLog>> _logs;
+
+    static thread_local ThreadLog* _current;
+};
+
+/**
+ * @brief Traces the calling thread for the lifetime of the object.
+ *
+ * The thread gets a new log named name; the log traced before is restored
+ * on destruction.
+ */
+class TraceThread {
+public:
+    /**
+     * @brief Starts tracing the calling thread.
+     *
+     * @param tracer Tracer, nullptr to leave the thread untraced.
+     * @param name Name of the thread in the trace.
+     */
+    TraceThread(Tracer* tracer, const char* name);
+    ~TraceThread();
+
+    TraceThread(const TraceThread&) = delete;
+    TraceThread& operator=(const TraceThread&) = delete;
+
+private:
+    Tracer::ThreadLog* _prev;
+    bool _is_active;
+};
+
+/**
+ * @brief Records a stage from construction to destruction, if the thread is traced.
+ *
+ * Costs a thread-local load when tracing is off.
+ */
+class TraceSpan {
+public:
+    /**
+     * @brief Begins the span.
+     *
+     * @param name Static string naming the stage.
+     */
+    explicit TraceSpan(const char* name)
+        : _log(Tracer::current()), _name(name), _begin_ns(_log != nullptr ? _log->now() : 0)
+    {}
+
+    ~TraceSpan() {
+        if (_log != nullptr) {
+            _log->Add(_name, _begin_ns, _log->now());
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    Tracer::ThreadLog* const _log;
+    const char* const _name;
+    const uint64_t _begin_ns;
+};
@@ -0,0 +1,133 @@
+#include "transport.h"
+#include "shm_transport.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <climits>
+
+namespace {
+    /**
+     * @brief Connection over a TCP or Unix domain socket.
+     */
+    class SocketConnection : public Connection {
+    public:
+        SocketConnection(bool is_unix, bool is_fast_open) : _is_unix(is_unix), _is_fast_open(is_fast_open) {}
+        SocketConnection(tcpft_sock sock, bool is_unix) : _client(sock), _is_unix(is_unix), _is_fast_open(false) {}
+
+        status Connect(const std::string& dst_addr, uint16_t dst_port, bool is_nonblocking) override {
+            return _is_unix ? _client.ConnectUnix(dst_addr, is_nonblocking)
+                            : _client.Connect(dst_addr, dst_port, is_nonblocking, _is_fast_open);
+        }
+
+        int Send(const char* buf, int len) override {
+            TraceSpan span("send");
+            return _client.Send(buf, len, tcpft_nosignal);
+        }
+
+        int64_t SendV(const tcpft_iovec* iov, size_t count) override {
+            TraceSpan span("send");
+            return _client.SendV(iov, count);
+        }
+
+        int Receive(char* buf, int len) override {
+            TraceSpan span("recv");
+            return _client.Receive(buf, len, 0);
+        }
+
+        uint32_t rtt() override {
+            return _is_unix ? 0 : _client.rtt();
+        }
+
+        bool isPeerLocal() override {
+            return _is_unix || tcpft_ispeerlocal(_client.sock());
+        }
+
+        tcpft_sock sock() override {
+            return _client.sock();
+        }
+
+        void setBusyPoll(uint32_t busy_poll_us) override {
+            _client.setBusyPoll(busy_poll_us);
+        }
+
+        int Close() override {
+            return _client.Close();
+        }
+
+    private:
+        TCPClient _client;
+        const bool _is_unix;
+        const bool _is_fast_open;
+    };
+
+    /**
+     * @brief Listener on a TCP or Unix domain socket.
+     */
+    class SocketListener : public Listener {
+    public:
+        SocketListener(bool is_unix, bool is_fast_open) : _is_unix(is_unix), _is_fast_open(is_fast_open) {}
+
+        status Init(const std::string& src_addr, uint16_t src_port) override {
+            return _is_unix ? _server.InitUnix(src_addr) : _server.Init(src_addr, src_port, _is_fast_open);
+        }
+
+        std::unique_ptr<Connection> Accept() override {
+            tcpft_sock sock = _server.Accept();
+            if (sock == static_cast<tcpft_sock>(-1)) {
+                return nullptr;
+            }
+            return std::unique_ptr<Connection>(new SocketConnection(sock, _is_unix));
+        }
+
+        tcpft_sock sock() override {
+            return _server.sock();
+        }
+
+        int Close() override {
+            return _server.Close();
+        }
+
+    private:
+        TCPServer _server;
+        const bool _is_unix;
+        const bool _is_fast_open;
+    };
+}
+
+bool Connection::ReceiveExact(char* buf, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        int nb = Receive(buf + received, static_cast<int>(std::min<size_t>(len - received, INT_MAX)));
+        if (nb > 0) {
+            received += nb;
+        }
+        else if (nb == 0 || !tcpft_istimeout(tcpft_lasterror())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::unique_ptr<Connection> Connection::Create(const TransferConfig& config) {
+    switch (config.channel) {
+    case transport::TCP:
+        return std::unique_ptr<Connection>(new SocketConnection(false, config.fast_open));
+    case transport::UNIX:
+        return std::unique_ptr<Connection>(new SocketConnection(true, false));
+    case transport::SHARED_MEMORY:
+        return createShmConnection(config.shm_ring_size);
+    }
+    return nullptr;
+}
+
+std::unique_ptr<Listener> Listener::Create(const TransferConfig& config) {
+    switch (config.channel) {
+    case transport::TCP:
+        return std::unique_ptr<Listener>(new SocketListener(false, config.fast_open));
+    case transport::UNIX:
+        return std::unique_ptr<Listener>(new SocketListener(true, false));
+    case transport::SHARED_MEMORY:
+        return createShmListener();
+    }
+    return nullptr;
+}
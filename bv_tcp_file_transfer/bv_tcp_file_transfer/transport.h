@@ -0,0 +1,152 @@
+#pragma once
+
+#include "config.h"
+#include "status.h"
+#include "tcp_client_server.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+/**
+ * @brief Byte stream between a sender and a receiver.
+ *
+ * Implemented over TCP, Unix domain sockets and shared memory, selected by
+ * TransferConfig::channel. Receive() follows recv(): 0 when the peer closed
+ * the stream, -1 on error with a timeout error code if the call only timed out.
+ */
+class Connection {
+public:
+    virtual ~Connection() = default;
+
+    /**
+     * @brief Creates an unconnected connection of the configured transport.
+     *
+     * @param config Transfer configuration.
+     * @return std::unique_ptr<Connection> Connection, nullptr if the transport is not supported here.
+     */
+    static std::unique_ptr<Connection> Create(const TransferConfig& config);
+
+    /**
+     * @brief Connects to a listener of the same transport.
+     *
+     * @param dst_addr Destination IP address, or the path of the socket file.
+     * @param dst_port Destination port, ignored for socket files.
+     * @param is_nonblocking true to connect without blocking, see TCPClient::Connect().
+     * @return status Error status.
+     */
+    virtual status Connect(const std::string& dst_addr, uint16_t dst_port, bool is_nonblocking = false) = 0;
+
+    /**
+     * @brief Sends up to len bytes.
+     *
+     * @return int Number of bytes sent, -1 on error.
+     */
+    virtual int Send(const char* buf, int len) = 0;
+
+    /**
+     * @brief Sends several data blocks completely.
+     *
+     * @param iov Array of data blocks.
+     * @param count Number of data blocks.
+     * @return int64_t Number of bytes sent, -1 on error.
+     */
+    virtual int64_t SendV(const tcpft_iovec* iov, size_t count) = 0;
+
+    /**
+     * @brief Receives up to len bytes.
+     *
+     * @return int Number of bytes received, 0 at the end of the stream, -1 on error.
+     */
+    virtual int Receive(char* buf, int len) = 0;
+
+    /**
+     * @brief Receives exactly len bytes, waiting through receive timeouts.
+     *
+     * @return true on success, false if the connection was closed or failed.
+     */
+    bool ReceiveExact(char* buf, size_t len);
+
+    /**
+     * @brief Returns the smoothed round-trip time of the connection.
+     *
+     * @return uint32_t RTT in microseconds, 0 if not available.
+     */
+    virtual uint32_t rtt() { return 0; }
+
+    /**
+     * @brief Checks whether the peer runs on this host.
+     */
+    virtual bool isPeerLocal() = 0;
+
+    /**
+     * @brief Returns the socket carrying the data, for the event loop.
+     *
+     * @return tcpft_sock Socket, -1 if the data does not go through a socket.
+     */
+    virtual tcpft_sock sock() = 0;
+
+    /**
+     * @brief Lets the calling threads poll for incoming data before they sleep
+     * in Receive(), see TransferConfig::busy_poll_us.
+     *
+     * For blocking connections only, call once connected.
+     *
+     * @param busy_poll_us Microseconds to poll, 0 to sleep at once.
+     */
+    virtual void setBusyPoll(uint32_t busy_poll_us) { (void)busy_poll_us; }
+
+    /**
+     * @brief Closes the connection.
+     *
+     * @return int Result of closing.
+     */
+    virtual int Close() = 0;
+};
+
+/**
+ * @brief Accepts connections of one transport.
+ */
+class Listener {
+public:
+    virtual ~Listener() = default;
+
+    /**
+     * @brief Creates an uninitialized listener of the configured transport.
+     *
+     * @param config Transfer configuration.
+     * @return std::unique_ptr<Listener> Listener, nullptr if the transport is not supported here.
+     */
+    static std::unique_ptr<Listener> Create(const TransferConfig& config);
+
+    /**
+     * @brief Starts listening.
+     *
+     * @param src_addr Source IP address, or the path of the socket file.
+     * @param src_port Source port, ignored for socket files.
+     * @return status Error status.
+     */
+    virtual status Init(const std::string& src_addr, uint16_t src_port) = 0;
+
+    /**
+     * @brief Accepts a connection.
+     *
+     * @return std::unique_ptr<Connection> Accepted connection, nullptr on error or timeout.
+     */
+    virtual std::unique_ptr<Connection> Accept() = 0;
+
+    /**
+     * @brief Returns the listening socket.
+     *
+     * @return tcpft_sock The listening socket.
+     */
+    virtual tcpft_sock sock() = 0;
+
+    /**
+     * @brief Stops listening.
+     *
+     * @return int Result of closing.
+     */
+    virtual int Close() = 0;
+};
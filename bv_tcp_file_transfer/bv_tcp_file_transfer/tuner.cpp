@@ -0,0 +1,65 @@
+#include "tuner.h"
+
+#include <algorithm>
+
+namespace {
+    // How often throughput is sampled.
+    const std::chrono::milliseconds sample_interval(100);
+    // Chunks in flight per bandwidth-delay product.
+    const uint64_t chunks_per_bdp = 8;
+    // Upper bound of chunks sent per second, keeps the per-chunk overhead low on fast links.
+    const double max_chunks_per_second = 10000.0;
+    const size_t min_queue_depth = 4;
+
+    size_t roundUpPow2(uint64_t value) {
+        size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+}
+
+AutoTuner::AutoTuner(const TransferConfig& config)
+    : _config(config), _chunk_size(config.chunk_size), _queue_depth(config.queue_depth),
+      _sample_start(clock::now()), _sample_bytes(0), _rate(0.0), _rtt_us(0)
+{}
+
+void AutoTuner::onTransferred(size_t bytes) {
+    _sample_bytes += bytes;
+}
+
+bool AutoTuner::isSampleDue() const {
+    return _config.auto_tune && clock::now() - _sample_start >= sample_interval;
+}
+
+bool AutoTuner::Update(uint32_t rtt_us) {
+    if (!_config.auto_tune) {
+        return false;
+    }
+
+    clock::time_point now = clock::now();
+    double dt = std::chrono::duration<double>(now - _sample_start).count();
+    if (dt <= 0.0) {
+        return false;
+    }
+    double rate = _sample_bytes / dt;
+    _rate = (_rate == 0.0) ? rate : 0.75 * _rate + 0.25 * rate;
+    _sample_bytes = 0;
+    _sample_start = now;
+    if (rtt_us != 0) {
+        _rtt_us = rtt_us;
+    }
+
+    uint64_t bdp = static_cast<uint64_t>(_rate * _rtt_us / 1e6);
+    uint64_t wanted = std::max<uint64_t>(bdp / chunks_per_bdp,
+                                         static_cast<uint64_t>(_rate / max_chunks_per_second));
+    size_t chunk_size = std::min(std::max(roundUpPow2(wanted), _config.min_chunk_size), _config.max_chunk_size);
+    size_t queue_depth = static_cast<size_t>(2 * bdp / chunk_size + 1);
+    queue_depth = std::min(std::max(queue_depth, min_queue_depth), _config.max_queue_depth);
+
+    bool changed = chunk_size != _chunk_size.load() || queue_depth != _queue_depth.load();
+    _chunk_size.store(chunk_size);
+    _queue_depth.store(queue_depth);
+    return changed;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "config.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+
+/**
+ * @brief Adjusts chunk size and queue depth of a transfer from measured RTT and throughput.
+ *
+ * The socket thread reports transferred bytes and periodically calls Update() with
+ * the current RTT. The queue is sized to hold about twice the bandwidth-delay
+ * product, chunks are a power of two so that Pool::Fit() hits its fast paths.
+ * When auto-tuning is disabled the configured values are returned unchanged.
+ */
+class AutoTuner {
+public:
+    /**
+     * @brief Constructs an AutoTuner.
+     *
+     * @param config Transfer configuration with initial values and limits.
+     */
+    explicit AutoTuner(const TransferConfig& config);
+
+    /**
+     * @brief Accounts transferred bytes for the current sample.
+     *
+     * @param bytes Number of bytes.
+     */
+    void onTransferred(size_t bytes);
+
+    /**
+     * @brief Checks whether a new sample should be taken.
+     *
+     * @return true if auto-tuning is enabled and the sample interval has elapsed.
+     */
+    bool isSampleDue() const;
+
+    /**
+     * @brief Closes the current sample and recomputes chunk size and queue depth.
+     *
+     * @param rtt_us Measured round-trip time in microseconds, 0 if unknown.
+     * @return true if chunk size or queue depth changed.
+     */
+    bool Update(uint32_t rtt_us);
+
+    size_t chunkSize() const { return _chunk_size.load(); }
+    size_t queueDepth() const { return _queue_depth.load(); }
+    uint32_t rtt() const { return _rtt_us; }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    const TransferConfig _config;
+    std::atomic<size_t> _chunk_size;
+    std::atomic<size_t> _queue_depth;
+    clock::time_point _sample_start;
+    uint64_t _sample_bytes;
+    double _rate;
+    uint32_t _rtt_us;
+};
@@ -0,0 +1,307 @@
+#include "wan_proxy.h"
+#include "buffer.h"
+#include "log.h"
+
+#include <chrono>
+#include <deque>
+#include <random>
+
+#ifdef _WIN32
+#define tcpft_shutdown_send SD_SEND
+#define tcpft_shutdown_both SD_BOTH
+#else
+#define tcpft_shutdown_send SHUT_WR
+#define tcpft_shutdown_both SHUT_RDWR
+#endif
+
+namespace {
+    using clock_type = std::chrono::steady_clock;
+
+    // Bytes read from the socket at once, the unit of delay and pacing.
+    const size_t segment_size = 16 * 1024;
+}
+
+/**
+ * @brief One direction of a proxied connection.
+ */
+class WanProxy::Link {
+public:
+    /**
+     * @brief Constructs a Link.
+     *
+     * @param profile Emulated network conditions.
+     * @param from Socket to read from.
+     * @param to Socket to write to.
+     * @param seed Seed of the jitter generator.
+     */
+    Link(const WanProfile& profile, tcpft_sock from, tcpft_sock to, unsigned seed)
+        : _profile(profile), _from(from), _to(to), _random(seed), _epoch(clock_type::now()),
+          _link_free(_epoch), _last_due(_epoch), _in_flight(0)
+    {
+        _queue.setCapacity(std::max<size_t>(1, profile.queue_limit / segment_size) + 1);
+    }
+
+    /**
+     * @brief Starts the reader and writer threads.
+     */
+    void Start() {
+        _reader = std::thread(&Link::Receive, this);
+        _writer = std::thread(&Link::Transmit, this);
+    }
+
+    /**
+     * @brief Waits for both threads to finish.
+     */
+    void Join() {
+        if (_reader.joinable()) {
+            _reader.join();
+        }
+        if (_writer.joinable()) {
+            _writer.join();
+        }
+    }
+
+private:
+    struct Segment {
+        std::string data;
+        clock_type::time_point due;
+    };
+
+    struct Ack {
+        clock_type::time_point time;
+        size_t len;
+    };
+
+    void Receive() {
+        std::string buf(segment_size, '\0');
+        for (;;) {
+            WaitForWindow();
+            int nb = recv(_from, &buf[0], static_cast<int>(buf.size()), 0);
+            if (nb > 0) {
+                Segment segment{ buf.substr(0, nb), Schedule(nb) };
+                // The data leaves the window when its acknowledgement would arrive, half an RTT after delivery.
+                _acks.push_back(Ack{ segment.due + std::chrono::microseconds(_profile.rtt_us / 2),
+                                     static_cast<size_t>(nb) });
+                _in_flight += nb;
+                _queue.waitForNotFull();
+                _queue.Push(std::move(segment));
+            }
+            else if (nb == 0 || !tcpft_istimeout(tcpft_lasterror())) {
+                break;
+            }
+        }
+        // Empty segment marks the end of the stream.
+        _queue.waitForNotFull();
+        _queue.Push(Segment{ std::string(), clock_type::now() });
+    }
+
+    void Transmit() {
+        bool is_failed = false;
+        for (;;) {
+            _queue.waitForNotEmpty();
+            Segment segment = _queue.Pop();
+            if (segment.data.empty()) {
+                break;
+            }
+            if (is_failed) {
+                continue;
+            }
+            std::this_thread::sleep_until(segment.due);
+            WaitForStall();
+
+            size_t sent = 0;
+            while (sent < segment.data.size()) {
+                int nb = send(_to, segment.data.data() + sent, static_cast<int>(segment.data.size() - sent),
+                              tcpft_nosignal);
+                if (nb <= 0) {
+                    // Keep draining the queue so that the reader can finish.
+                    is_failed = true;
+                    break;
+                }
+                sent += nb;
+            }
+        }
+        shutdown(_to, tcpft_shutdown_send);
+    }
+
+    clock_type::time_point Schedule(size_t len) {
+        clock_type::time_point now = clock_type::now();
+        // Serialization at the bandwidth cap, then propagation with jitter.
+        clock_type::time_point depart = std::max(now, _link_free);
+        if (_profile.bandwidth > 0) {
+            _link_free = depart + std::chrono::microseconds(len * 1000000 / _profile.bandwidth);
+        }
+        else {
+            _link_free = depart;
+        }
+
+        int64_t delay_us = _profile.rtt_us / 2;
+        if (_profile.jitter_us > 0) {
+            std::uniform_int_distribution<int64_t> jitter(-static_cast<int64_t>(_profile.jitter_us),
+                                                          static_cast<int64_t>(_profile.jitter_us));
+            delay_us = std::max<int64_t>(0, delay_us + jitter(_random));
+        }
+        // TCP delivers in order: a segment is never due before the previous one.
+        _last_due = std::max(_link_free + std::chrono::microseconds(delay_us), _last_due);
+        return _last_due;
+    }
+
+    void WaitForWindow() {
+        for (;;) {
+            clock_type::time_point now = clock_type::now();
+            while (!_acks.empty() && _acks.front().time <= now) {
+                _in_flight -= _acks.front().len;
+                _acks.pop_front();
+            }
+            if (_acks.empty() || _in_flight + segment_size <= _profile.queue_limit) {
+                return;
+            }
+            std::this_thread::sleep_until(_acks.front().time);
+        }
+    }
+
+    void WaitForStall() {
+        if (_profile.stall_interval_ms == 0 || _profile.stall_ms == 0) {
+            return;
+        }
+        int64_t cycle = static_cast<int64_t>(_profile.stall_interval_ms) + _profile.stall_ms;
+        int64_t phase = std::chrono::duration_cast<std::chrono::milliseconds>(clock_type::now() - _epoch).count() % cycle;
+        if (phase >= _profile.stall_interval_ms) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(cycle - phase));
+        }
+    }
+
+    const WanProfile& _profile;
+    const tcpft_sock _from;
+    const tcpft_sock _to;
+    Buffer<Segment, 4096> _queue;
+    std::mt19937 _random;
+    const clock_type::time_point _epoch;
+    clock_type::time_point _link_free;
+    clock_type::time_point _last_due;
+    // Segments not yet acknowledged, owned by the reader thread.
+    std::deque<Ack> _acks;
+    size_t _in_flight;
+    std::thread _reader;
+    std::thread _writer;
+};
+
+/**
+ * @brief Proxied connection: an accepted socket, its upstream and two links.
+ */
+class WanProxy::Connection {
+public:
+    /**
+     * @brief Constructs a Connection.
+     *
+     * @param profile Emulated network conditions.
+     * @param sock Accepted socket.
+     */
+    Connection(const WanProfile& profile, tcpft_sock sock) : _profile(profile), _sock(sock) {}
+
+    ~Connection() {
+        if (_forward) {
+            _forward->Join();
+        }
+        if (_backward) {
+            _backward->Join();
+        }
+        tcpft_closesocket(_sock);
+        _upstream.Close();
+    }
+
+    /**
+     * @brief Connects to the destination and starts both links.
+     *
+     * @param dst_addr Destination address.
+     * @param dst_port Destination port.
+     * @return status Error status.
+     */
+    status Start(const std::string& dst_addr, uint16_t dst_port) {
+        status st = _upstream.Connect(dst_addr, dst_port);
+        if (st != status::OK) {
+            return st;
+        }
+        _forward.reset(new Link(_profile, _sock, _upstream.sock(), 1));
+        _backward.reset(new Link(_profile, _upstream.sock(), _sock, 2));
+        _forward->Start();
+        _backward->Start();
+        return status::OK;
+    }
+
+    /**
+     * @brief Aborts both directions, blocked threads return.
+     */
+    void Shutdown() {
+        shutdown(_sock, tcpft_shutdown_both);
+        shutdown(_upstream.sock(), tcpft_shutdown_both);
+    }
+
+private:
+    const WanProfile& _profile;
+    const tcpft_sock _sock;
+    TCPClient _upstream;
+    std::unique_ptr<Link> _forward;
+    std::unique_ptr<Link> _backward;
+};
+
+WanProxy::WanProxy(const WanProfile& profile)
+    : _profile(profile), _dst_port(0), _is_running(false)
+{}
+
+WanProxy::~WanProxy() {
+    Stop();
+}
+
+status WanProxy::Start(const std::string& src_addr, uint16_t src_port, const std::string& dst_addr,
+                       uint16_t dst_port) {
+    status st = _server.Init(src_addr, src_port);
+    if (st != status::OK) {
+        return st;
+    }
+    _dst_addr = dst_addr;
+    _dst_port = dst_port;
+    _is_running.store(true);
+    _thread = std::thread(&WanProxy::Run, this);
+    tcpft_logInfo("wan proxy ", src_addr, ":", src_port, " -> ", dst_addr, ":", dst_port,
+                  ", rtt ", _profile.rtt_us, " us, bandwidth ", _profile.bandwidth, " B/s");
+    return status::OK;
+}
+
+void WanProxy::Stop() {
+    if (!_is_running.exchange(false)) {
+        return;
+    }
+    _thread.join();
+    _server.Close();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (std::unique_ptr<Connection>& connection : _connections) {
+        connection->Shutdown();
+    }
+    _connections.clear();
+}
+
+void WanProxy::Run() {
+    while (_is_running.load()) {
+        // Wait with a timeout so that Stop() is noticed.
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(_server.sock(), &fds);
+        struct timeval timeout = { 0, 100000 };
+        if (select(static_cast<int>(_server.sock()) + 1, &fds, nullptr, nullptr, &timeout) <= 0) {
+            continue;
+        }
+        tcpft_sock sock = _server.Accept();
+        if (sock == static_cast<tcpft_sock>(-1)) {
+            continue;
+        }
+        std::unique_ptr<Connection> connection(new Connection(_profile, sock));
+        if (connection->Start(_dst_addr, _dst_port) != status::OK) {
+            tcpft_logCritical("wan proxy: connect to ", _dst_addr, ":", _dst_port, " failed");
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _connections.push_back(std::move(connection));
+    }
+}
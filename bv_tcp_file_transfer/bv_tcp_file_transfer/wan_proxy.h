@@ -0,0 +1,84 @@
+#pragma once
+
+#include "tcp_client_server.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Network conditions emulated by WanProxy, applied to each direction.
+ */
+struct WanProfile {
+    // Added round-trip time, half of it is applied to each direction.
+    uint32_t rtt_us = 0;
+    // Maximum deviation of the one-way delay, segments are never reordered.
+    uint32_t jitter_us = 0;
+    // Bandwidth cap in bytes per second, 0 for unlimited.
+    uint64_t bandwidth = 0;
+    // The link passes data for stall_interval_ms, then stops for stall_ms (0 for no stalls).
+    uint32_t stall_interval_ms = 0;
+    uint32_t stall_ms = 0;
+    // Bytes in flight on the link, from reading until the emulated acknowledgement
+    // one RTT later, before the sender is pushed back. The proxy terminates TCP,
+    // so this acts as the window: throughput is at most queue_limit / rtt.
+    size_t queue_limit = 4 * 1024 * 1024;
+};
+
+/**
+ * @brief Userspace TCP proxy that emulates a wide area network on one host.
+ *
+ * Accepts connections on a local port and forwards each of them to the
+ * destination. Every direction is a link: a reader thread stamps received
+ * segments with their delivery time (delay, jitter, bandwidth), a writer
+ * thread sends them when due and holds them during stalls. A full link stops
+ * reading, so the sender sees the backpressure of a bottleneck queue.
+ */
+class WanProxy {
+public:
+    /**
+     * @brief Constructs a WanProxy.
+     *
+     * @param profile Emulated network conditions.
+     */
+    explicit WanProxy(const WanProfile& profile);
+    ~WanProxy();
+
+    WanProxy(const WanProxy&) = delete;
+    WanProxy& operator=(const WanProxy&) = delete;
+
+    /**
+     * @brief Starts listening and forwarding in a background thread.
+     *
+     * @param src_addr Local address to listen on.
+     * @param src_port Local port to listen on.
+     * @param dst_addr Destination address.
+     * @param dst_port Destination port.
+     * @return status Error status.
+     */
+    status Start(const std::string& src_addr, uint16_t src_port, const std::string& dst_addr, uint16_t dst_port);
+
+    /**
+     * @brief Stops accepting, closes the connections and waits for the threads.
+     */
+    void Stop();
+
+private:
+    class Link;
+    class Connection;
+
+    void Run();
+
+    const WanProfile _profile;
+    std::string _dst_addr;
+    uint16_t _dst_port;
+    TCPServer _server;
+    std::thread _thread;
+    std::atomic<bool> _is_running;
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<Connection>> _connections;
+};